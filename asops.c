@@ -13,44 +13,256 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/blkdev.h>
+#include <linux/mpage.h>
+#include <linux/writeback.h>
+#include <linux/buffer_head.h>
 
 #include <rkfs.h>
 
+/*
+* Inline data (see RKFS_INLINE_MAGIC). While i_inline is set a regular
+* file has no blocks, its data sits in i_data (zero past i_size) and
+* page 0 is filled from and copied back to it. A write or truncate that
+* would take the file past rkfs_inline_size moves the data to a real
+* block first, after which the usual block paths take over.
+*/
+static void rkfs_inline_fill(struct inode *vfs_inode, struct page *page)
+{
+	char *kaddr = kmap(page);
+
+	memset(kaddr, 0, PAGE_CACHE_SIZE);
+	if (!page->index)
+		memcpy(kaddr, RKFS_I(vfs_inode)->i_data,
+		       rkfs_inline_size(vfs_inode->i_sb));
+	flush_dcache_page(page);
+	kunmap(page);
+	SetPageUptodate(page);
+}
+
+/*
+* Move the inline data of 'vfs_inode' to a newly allocated block 0. The
+* block is written out at once so that no dirty buffer cache copy of it
+* can later overwrite what goes through the page cache. If the block
+* can't be written it is freed again and the data stays inline.
+*/
+int rkfs_inline_to_block(struct inode *vfs_inode)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	struct buffer_head map_bh, *bh = NULL;
+	char data[RKFS_INLINE_SIZE];
+	int err = 0;
+
+	memcpy(data, rkfs_ii->i_data, rkfs_inline_size(sb));
+	memset(rkfs_ii->i_data, 0, sizeof(rkfs_ii->i_data));
+	rkfs_ii->i_inline = 0;
+	if (rkfs_has_extents(sb))
+		rkfs_ext_init(vfs_inode);
+
+	memset(&map_bh, 0, sizeof(map_bh));
+	map_bh.b_size = sb->s_blocksize;
+	if ((err = rkfs_get_block(vfs_inode, 0, &map_bh, 1)))
+		goto undo;
+
+	if (!(bh = getblk(vfs_inode->i_dev, map_bh.b_blocknr,
+			  sb->s_blocksize))) {
+		rkfs_printk("Unable to get block %lu of inode %ld\n",
+			    map_bh.b_blocknr, vfs_inode->i_ino);
+		err = -EIO;
+		goto unmap;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	memcpy(bh->b_data, data, rkfs_inline_size(sb));
+	mark_buffer_uptodate(bh, 1);
+	unlock_buffer(bh);
+
+	mark_buffer_dirty(bh);
+	ll_rw_block(WRITE, 1, &bh);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		brelse(bh);
+		err = -EIO;
+		goto unmap;
+	}
+	brelse(bh);
+
+	mark_inode_dirty(vfs_inode);
+	return 0;
+
+ unmap:
+	rkfs_free_blocks(vfs_inode, map_bh.b_blocknr, 1);
+ undo:
+	rkfs_discard_prealloc(vfs_inode);
+	rkfs_map_forget(vfs_inode);
+	memset(rkfs_ii->i_data, 0, sizeof(rkfs_ii->i_data));
+	memcpy(rkfs_ii->i_data, data, rkfs_inline_size(sb));
+	rkfs_ii->i_inline = 1;
+	rkfs_ii->i_extents = 0;
+	mark_inode_dirty(vfs_inode);
+	FAILED;
+	return err;
+}
+
+/*
+* prepare_write of an inline file: 0 if the write fits inline and the
+* page is ready for it, 1 once the data is in a block and the block
+* path has to go on, or an error.
+*/
+static int rkfs_inline_prepare_write(struct inode *vfs_inode,
+				     struct page *page, unsigned to)
+{
+	int err = 0;
+
+	if (!page->index && to <= rkfs_inline_size(vfs_inode->i_sb)) {
+		if (!Page_Uptodate(page))
+			rkfs_inline_fill(vfs_inode, page);
+		return 0;
+	}
+
+	if ((err = rkfs_inline_to_block(vfs_inode)))
+		return err;
+
+	return 1;
+}
+
+static int rkfs_inline_writepage(struct page *page)
+{
+	struct inode *vfs_inode = page->mapping->host;
+	char *idata = (char *)RKFS_I(vfs_inode)->i_data;
+	char *kaddr = NULL;
+	loff_t size = 0;
+
+	if (!page->index) {
+		size = vfs_inode->i_size;
+		if (size > rkfs_inline_size(vfs_inode->i_sb))
+			size = rkfs_inline_size(vfs_inode->i_sb);
+
+		kaddr = kmap(page);
+		memset(idata, 0, rkfs_inline_size(vfs_inode->i_sb));
+		memcpy(idata, kaddr, size);
+		kunmap(page);
+		mark_inode_dirty(vfs_inode);
+	}
+
+	unlock_page(page);
+	return 0;
+}
+
 int rkfs_readpage(struct file *file, struct page *page)
 {
+	struct inode *vfs_inode = page->mapping->host;
 	int rc = 0;
 
+	if (RKFS_I(vfs_inode)->i_inline) {
+		rkfs_inline_fill(vfs_inode, page);
+		unlock_page(page);
+		return 0;
+	}
+
 	if ((rc = block_read_full_page(page, rkfs_get_block)))
 		FAILED;
 
 	return rc;
 }
 
+/*
+* Readahead maps whole runs of contiguous blocks per rkfs_get_block call.
+*/
+int rkfs_readpages(struct file *file, struct address_space *mapping,
+		   struct list_head *pages, unsigned nr_pages)
+{
+	int rc = 0;
+
+	/*
+	 * Inline pages have no blocks to map; read_cache_pages adds each
+	 * to the page cache, fills it through readpage and releases it.
+	 */
+	if (RKFS_I(mapping->host)->i_inline)
+		return read_cache_pages(mapping, pages,
+					(filler_t *) rkfs_readpage, file);
+
+	if ((rc = mpage_readpages(mapping, pages, nr_pages, rkfs_get_block)))
+		FAILED;
+
+	return rc;
+}
+
 int rkfs_writepage(struct page *page)
 {
 	int rc = 0;
 
+	if (RKFS_I(page->mapping->host)->i_inline)
+		return rkfs_inline_writepage(page);
+
 	if ((rc = block_write_full_page(page, rkfs_get_block)))
 		FAILED;
 
 	return rc;
 }
 
+int rkfs_writepages(struct address_space *mapping,
+		    struct writeback_control *wbc)
+{
+	int rc = 0;
+
+	if (RKFS_I(mapping->host)->i_inline)
+		return generic_writepages(mapping, wbc);
+
+	if ((rc = mpage_writepages(mapping, wbc, rkfs_get_block)))
+		FAILED;
+
+	return rc;
+}
+
 int rkfs_prepare_write(struct file *file, struct page *page,
 		       unsigned from, unsigned to)
 {
+	struct inode *vfs_inode = page->mapping->host;
 	int rc = 0;
 
+	if (RKFS_I(vfs_inode)->i_inline &&
+	    (rc = rkfs_inline_prepare_write(vfs_inode, page, to)) <= 0)
+		return rc;
+
 	if ((rc = block_prepare_write(page, from, to, rkfs_get_block)))
 		FAILED;
 
 	return rc;
 }
 
+/*
+* An inline write only goes to i_data; the page is never dirtied.
+*/
+int rkfs_commit_write(struct file *file, struct page *page,
+		      unsigned from, unsigned to)
+{
+	struct inode *vfs_inode = page->mapping->host;
+	char *kaddr = NULL;
+
+	if (!RKFS_I(vfs_inode)->i_inline)
+		return generic_commit_write(file, page, from, to);
+
+	kaddr = kmap(page);
+	memcpy((char *)RKFS_I(vfs_inode)->i_data + from, kaddr + from,
+	       to - from);
+	kunmap(page);
+
+	if (to > vfs_inode->i_size)
+		vfs_inode->i_size = to;
+	mark_inode_dirty(vfs_inode);
+
+	return 0;
+}
+
 int rkfs_bmap(struct address_space *mapping, long blkno)
 {
 	int rc = 0;
 
+	if (RKFS_I(mapping->host)->i_inline)
+		return 0;
+
 	if ((rc = generic_block_bmap(mapping, blkno, rkfs_get_block)))
 		FAILED;
 
@@ -58,11 +270,263 @@ int rkfs_bmap(struct address_space *mapping, long blkno)
 
 }
 
+/*
+* Delayed allocation (mount option 'delalloc').
+*
+* prepare_write only reserves a block against the free block count, with
+* the indirect (or extent) blocks it may need, and marks the buffer
+* BH_Delay; nothing is allocated and no bitmap dirtied.
+* Consecutive reservations of an inode are tracked as one range so that
+* writeback can map the whole range with a single allocator call. Pages
+* dropped before writeback (short lived files) just give back their
+* reservations.
+*
+* prepare_write (under i_sem) and writeback (under the page lock only)
+* both move the range, so it is only touched under i_da_lock.
+*/
+#define RKFS_DELAYED_BLOCK (~0UL)
+
+/*
+* Remember that 'blkno' now has a delayed block, extending the inode's
+* current range if it follows it.
+*/
+static void rkfs_da_track(struct inode *vfs_inode, long blkno)
+{
+	struct rkfs_inode_info *rkfs_i = RKFS_I(vfs_inode);
+
+	spin_lock(&rkfs_i->i_da_lock);
+	if (rkfs_i->i_da_len &&
+	    blkno == (rkfs_i->i_da_start + rkfs_i->i_da_len)) {
+		rkfs_i->i_da_len++;
+	} else {
+		rkfs_i->i_da_start = blkno;
+		rkfs_i->i_da_len = 1;
+	}
+	spin_unlock(&rkfs_i->i_da_lock);
+}
+
+/*
+* Number of delayed blocks known to follow (and include) 'blkno'.
+*/
+static int rkfs_da_extent(struct inode *vfs_inode, long blkno)
+{
+	struct rkfs_inode_info *rkfs_i = RKFS_I(vfs_inode);
+	int count = 1;
+
+	spin_lock(&rkfs_i->i_da_lock);
+	if (rkfs_i->i_da_len && blkno >= rkfs_i->i_da_start &&
+	    blkno < (rkfs_i->i_da_start + rkfs_i->i_da_len))
+		count = (rkfs_i->i_da_start + rkfs_i->i_da_len) - blkno;
+	spin_unlock(&rkfs_i->i_da_lock);
+
+	return count;
+}
+
+/*
+* 'count' delayed blocks from 'blkno' on got real blocks; drop them
+* from the tracked range.
+*/
+static void rkfs_da_untrack(struct inode *vfs_inode, long blkno, int count)
+{
+	struct rkfs_inode_info *rkfs_i = RKFS_I(vfs_inode);
+
+	spin_lock(&rkfs_i->i_da_lock);
+	if (!rkfs_i->i_da_len || blkno < rkfs_i->i_da_start ||
+	    blkno >= (rkfs_i->i_da_start + rkfs_i->i_da_len))
+		goto out;
+
+	if (blkno == rkfs_i->i_da_start) {
+		if (count > rkfs_i->i_da_len)
+			count = rkfs_i->i_da_len;
+		rkfs_i->i_da_start += count;
+		rkfs_i->i_da_len -= count;
+		goto out;
+	}
+
+	rkfs_i->i_da_len = blkno - rkfs_i->i_da_start;
+ out:
+	spin_unlock(&rkfs_i->i_da_lock);
+}
+
+int rkfs_da_get_block_prep(struct inode *vfs_inode, long blkno,
+			   struct buffer_head *bh_result, int create)
+{
+	struct rkfs_inode_info *rkfs_i = RKFS_I(vfs_inode);
+	int err = 0, meta = 0, prev = 0;
+
+	err = rkfs_get_block(vfs_inode, blkno, bh_result, 0);
+	if (err || buffer_mapped(bh_result) || !create)
+		return err;
+
+	spin_lock(&rkfs_i->i_da_lock);
+	prev = rkfs_i->i_da_len &&
+	    blkno == (rkfs_i->i_da_start + rkfs_i->i_da_len);
+	spin_unlock(&rkfs_i->i_da_lock);
+	if ((meta = rkfs_da_meta_blocks(vfs_inode, blkno, prev)) < 0)
+		return meta;
+
+	if ((err = rkfs_reserve_blocks(vfs_inode, 1, meta)))
+		return err;
+
+	rkfs_da_track(vfs_inode, blkno);
+
+	bh_result->b_dev = vfs_inode->i_dev;
+	bh_result->b_blocknr = RKFS_DELAYED_BLOCK;
+	bh_result->b_state |= (1UL << BH_Mapped) | (1UL << BH_New) |
+	    (1UL << BH_Delay);
+
+	return 0;
+}
+
+/*
+* Writeback side: a delayed buffer gets a real block here, together with
+* the rest of its range so the range lands contiguously on disk.
+*/
+int rkfs_da_get_block_write(struct inode *vfs_inode, long blkno,
+			    struct buffer_head *bh_result, int create)
+{
+	struct buffer_head map_bh;
+	unsigned long claim = 0, meta = 0;
+	int err = 0, count = 0;
+
+	if (!(bh_result->b_state & (1UL << BH_Delay)))
+		return rkfs_get_block(vfs_inode, blkno, bh_result, create);
+
+	count = rkfs_da_extent(vfs_inode, blkno);
+
+	memset(&map_bh, 0, sizeof(map_bh));
+	map_bh.b_size = count << vfs_inode->i_blkbits;
+
+	/*
+	 * The blocks, and the metadata they may need, are already
+	 * reserved; let the allocator dip into the reserve for them.
+	 * 'claim' is what is left of that as the allocator goes.
+	 */
+	meta = rkfs_da_claim_meta(vfs_inode);
+	claim = count + meta;
+	err = rkfs__get_block(vfs_inode, blkno, &map_bh, 1, &claim);
+	claim = (count + meta) - claim;
+
+	count = 0;
+	if (!err && (map_bh.b_state & (1UL << BH_New))) {
+		count = map_bh.b_size >> vfs_inode->i_blkbits;
+		rkfs_da_untrack(vfs_inode, blkno, count);
+	}
+	rkfs_da_allocated(vfs_inode, count, claim, meta, err);
+	if (err)
+		return err;
+
+	bh_result->b_dev = map_bh.b_dev;
+	bh_result->b_blocknr = map_bh.b_blocknr;
+	bh_result->b_state |= (1UL << BH_Mapped);
+	bh_result->b_state &= ~((1UL << BH_Delay) | (1UL << BH_New));
+
+	return 0;
+}
+
+int rkfs_da_writepage(struct page *page)
+{
+	int rc = 0;
+
+	if (RKFS_I(page->mapping->host)->i_inline)
+		return rkfs_inline_writepage(page);
+
+	if ((rc = block_write_full_page(page, rkfs_da_get_block_write)))
+		FAILED;
+
+	return rc;
+}
+
+int rkfs_da_writepages(struct address_space *mapping,
+		       struct writeback_control *wbc)
+{
+	int rc = 0;
+
+	if ((rc = generic_writepages(mapping, wbc)))
+		FAILED;
+
+	return rc;
+}
+
+int rkfs_da_prepare_write(struct file *file, struct page *page,
+			  unsigned from, unsigned to)
+{
+	struct inode *vfs_inode = page->mapping->host;
+	int rc = 0;
+
+	if (RKFS_I(vfs_inode)->i_inline &&
+	    (rc = rkfs_inline_prepare_write(vfs_inode, page, to)) <= 0)
+		return rc;
+
+	if ((rc = block_prepare_write(page, from, to, rkfs_da_get_block_prep)))
+		FAILED;
+
+	return rc;
+}
+
+/*
+* Delayed buffers dropped from the page cache hand their reservation
+* back, unless writeback already allocated their block as part of a
+* range (the block is then freed by truncate like any other).
+*/
+void rkfs_da_invalidatepage(struct page *page, unsigned long offset)
+{
+	struct inode *vfs_inode = page->mapping->host;
+	struct buffer_head *head = NULL, *bh = NULL, map_bh;
+	unsigned long blkno = 0, start = 0;
+
+	if (!page_has_buffers(page))
+		goto out;
+
+	head = bh = page_buffers(page);
+	blkno = page->index << (PAGE_CACHE_SHIFT - vfs_inode->i_blkbits);
+	do {
+		if (start >= offset && (bh->b_state & (1UL << BH_Delay))) {
+			memset(&map_bh, 0, sizeof(map_bh));
+			map_bh.b_size = 1 << vfs_inode->i_blkbits;
+			rkfs_get_block(vfs_inode, blkno, &map_bh, 0);
+			if (!buffer_mapped(&map_bh))
+				rkfs_release_blocks(vfs_inode, 1);
+			bh->b_state &= ~(1UL << BH_Delay);
+		}
+		start += bh->b_size;
+		blkno++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+ out:
+	block_invalidatepage(page, offset);
+}
+
+/*
+* bmap has to see real blocks.
+*/
+int rkfs_da_bmap(struct address_space *mapping, long blkno)
+{
+	filemap_write_and_wait(mapping);
+
+	return rkfs_bmap(mapping, blkno);
+}
+
 struct address_space_operations rkfs_aops = {
  readpage:rkfs_readpage,
+ readpages:rkfs_readpages,
  writepage:rkfs_writepage,
+ writepages:rkfs_writepages,
  sync_page:block_sync_page,
  prepare_write:rkfs_prepare_write,
- commit_write:generic_commit_write,
+ commit_write:rkfs_commit_write,
  bmap:	rkfs_bmap
 };
+
+struct address_space_operations rkfs_da_aops = {
+ readpage:rkfs_readpage,
+ readpages:rkfs_readpages,
+ writepage:rkfs_da_writepage,
+ writepages:rkfs_da_writepages,
+ sync_page:block_sync_page,
+ prepare_write:rkfs_da_prepare_write,
+ commit_write:rkfs_commit_write,
+ invalidatepage:rkfs_da_invalidatepage,
+ bmap:	rkfs_da_bmap
+};
@@ -11,21 +11,24 @@
 */
 
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
 #include <linux/quotaops.h>
 
 #include <rkfs.h>
 
 int rkfs__free_blocks(struct super_block *vfs_sb,
 		      struct inode *vfs_inode,
-		      unsigned short blkno, unsigned short count)
+		      unsigned long blkno, unsigned short count)
 {
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
-	unsigned short i = 0, tb = 0, nblkno = 0, group_last_blkno = 0;
-	unsigned short rkfs_sb_count = 0, rkfs_sb_index = 0, bit = 0;
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned long tb = 0, nblkno = 0, group_last_blkno = 0;
+	unsigned short i = 0, rkfs_sb_count = 0, rkfs_sb_index = 0, bit = 0;
 	int err = -EIO;
 
-	rkfs_debug("Block: %d, Count: %d\n", blkno, count);
+	rkfs_debug("Block: %lu, Count: %d\n", blkno, count);
 
 	if (!vfs_sb) {
 		rkfs_bug("VFS superblock is NULL\n");
@@ -33,9 +36,9 @@ int rkfs__free_blocks(struct super_block *vfs_sb,
 	}
 
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = blkno / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_block_group(vfs_sb, blkno);
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
-		rkfs_bug("Block %d is bad (invalid %s sb index)\n", blkno,
+		rkfs_bug("Block %lu is bad (invalid %s sb index)\n", blkno,
 			 RKFS_NAME);
 		goto out;
 	}
@@ -51,51 +54,51 @@ int rkfs__free_blocks(struct super_block *vfs_sb,
 		goto out;
 	}
 
-	tb = rkfs_dsb->s_total_blocks;
-	group_last_blkno = (rkfs_sb_index + 1) * RKFS_MIN_BLOCKS;
+	tb = vfs_sb->u.rkfs_sb.s_total_blocks;
+	group_last_blkno = rkfs_group_first_block(vfs_sb, rkfs_sb_index + 1);
 	if (((blkno + count) > tb) || ((blkno + count) > group_last_blkno)) {
-		rkfs_bug("Block %d not in valid range\n", blkno);
+		rkfs_bug("Block %lu not in valid range\n", blkno);
 		goto out;
 	}
 
-	for (i = 0; i < count; i++) {
-		nblkno = blkno + i;
-		bit = nblkno - (rkfs_sb_index * RKFS_MIN_BLOCKS);
-		if (rkfs_sb_index) {
-			if (bit == 0) {
-				rkfs_bug
-				    ("Block %d (bit %d) is bad (can't free metadata)\n",
-				     nblkno, bit);
-				goto out;
-			}
-		} else {
-			if (bit < RKFS_FIRST_BLOCK) {
-				rkfs_bug
-				    ("Block %d (bit %d) is bad (can't free metadata)\n",
-				     nblkno, bit);
-				goto out;
-			}
-		}
-
-		rkfs_debug("Freeing block: %d (bit: %d)\n", nblkno, bit);
-		if (!rkfs_clear_bit(bit, rkfs_dsb->s_block_map)) {
-			rkfs_bug("Block %d (bit %d) is already free\n", nblkno,
-				 bit);
-			goto out;
-		}
+	rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+	bit = blkno - rkfs_group_first_block(vfs_sb, rkfs_sb_index);
+	if (bit < rkfs_gi->g_first_bit) {
+		rkfs_bug("Block %lu (bit %d) is bad (can't free metadata)\n",
+			 blkno, bit);
+		goto out;
+	}
 
+	/*
+	 * The bitmap and the group count only change under the group lock;
+	 * the quota and the buffer are dealt with once it is dropped.
+	 */
+	spin_lock(&rkfs_gi->g_lock);
+	for (i = 0; i < count; i++)
+		if (!rkfs_clear_bit(bit + i, rkfs_gi->g_block_map))
+			break;
+	rkfs_gi->g_free_blocks += i;
+	rkfs_fe_insert(rkfs_gi, bit, i);
+	spin_unlock(&rkfs_gi->g_lock);
+
+	if (i) {
+		percpu_counter_add(&vfs_sb->u.rkfs_sb.s_freeblocks_counter, i);
 		if (vfs_inode)
-			DQUOT_FREE_BLOCK(vfs_inode, 1);
+			DQUOT_FREE_BLOCK(vfs_inode, i);
+		rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_bmap_bh);
 	}
 
-	mark_buffer_dirty(bh);
-
-	if (vfs_sb->s_flags & MS_SYNCHRONOUS) {
-		ll_rw_block(WRITE, 1, &bh);
-		wait_on_buffer(bh);
+	if (i < count) {
+		nblkno = blkno + i;
+		rkfs_bug("Block %lu (bit %d) is already free\n", nblkno,
+			 bit + i);
+		goto out;
 	}
 
-	rkfs_debug("Freed blocks from %d to %d\n", blkno, (blkno + count - 1));
+	if (vfs_sb->s_flags & MS_SYNCHRONOUS)
+		rkfs_sync_group(vfs_sb, rkfs_sb_index);
+
+	rkfs_debug("Freed blocks from %lu to %lu\n", blkno, (blkno + count - 1));
 	return 0;
 
  out:
@@ -103,13 +106,160 @@ int rkfs__free_blocks(struct super_block *vfs_sb,
 	return err;
 }
 
-int rkfs_free_blocks(struct inode *vfs_inode, unsigned short blkno,
+/*
+* Discard the free runs of at least 'minlen' bits in [bit, end) of group
+* 'index'. Each run is marked in use while the discard is in flight so
+* that it can't be handed out and written meanwhile, and given back
+* afterwards. Returns the number of blocks discarded, or an error.
+*/
+static long rkfs_trim_range(struct super_block *vfs_sb, unsigned short index,
+			    unsigned short bit, unsigned short end,
+			    unsigned short minlen)
+{
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned short i = 0, next = 0, len = 0;
+	long trimmed = 0;
+	int err = 0;
+
+	rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[index];
+	if (minlen < 1)
+		minlen = 1;
+
+	while (bit < end) {
+		spin_lock(&rkfs_gi->g_lock);
+		bit = rkfs_find_next_zero_bit(rkfs_gi->g_block_map, end, bit);
+		if (bit >= end) {
+			spin_unlock(&rkfs_gi->g_lock);
+			break;
+		}
+
+		next = rkfs_find_next_bit(rkfs_gi->g_block_map, end, bit);
+		len = next - bit;
+		if (len < minlen) {
+			spin_unlock(&rkfs_gi->g_lock);
+			bit = next;
+			continue;
+		}
+
+		for (i = 0; i < len; i++)
+			rkfs_set_bit(bit + i, rkfs_gi->g_block_map);
+		rkfs_gi->g_free_blocks -= len;
+		rkfs_fe_remove(rkfs_gi, bit, len);
+		spin_unlock(&rkfs_gi->g_lock);
+		percpu_counter_add(&vfs_sb->u.rkfs_sb.s_freeblocks_counter, -len);
+
+		err = sb_issue_discard(vfs_sb,
+				       rkfs_group_first_block(vfs_sb, index) +
+				       bit, len);
+
+		spin_lock(&rkfs_gi->g_lock);
+		for (i = 0; i < len; i++)
+			rkfs_clear_bit(bit + i, rkfs_gi->g_block_map);
+		rkfs_gi->g_free_blocks += len;
+		rkfs_fe_insert(rkfs_gi, bit, len);
+		spin_unlock(&rkfs_gi->g_lock);
+		percpu_counter_add(&vfs_sb->u.rkfs_sb.s_freeblocks_counter, len);
+
+		if (err)
+			return err;
+
+		trimmed += len;
+		bit = next;
+	}
+
+	return trimmed;
+}
+
+/*
+* Issue the discards queued by the 'discard' mount option; called from
+* rkfs_write_super and rkfs_put_super only. The block bitmaps of the
+* groups involved go to disk first if still dirty, so no discarded block
+* is still in use according to the on-disk bitmaps.
+*/
+void rkfs_flush_discards(struct super_block *vfs_sb)
+{
+	struct rkfs_discard_range *dr = NULL, *tmp = NULL;
+	struct buffer_head *bh = NULL;
+	unsigned short index = 0, bit = 0;
+	LIST_HEAD(ranges);
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_discard_lock);
+	list_splice_init(&vfs_sb->u.rkfs_sb.s_discard_list, &ranges);
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_discard_lock);
+
+	if (list_empty(&ranges))
+		return;
+
+	list_for_each_entry(dr, &ranges, dr_list) {
+		index = rkfs_block_group(vfs_sb, dr->dr_blkno);
+		bh = vfs_sb->u.rkfs_sb.s_groups[index].g_bmap_bh;
+		if (buffer_dirty(bh))
+			ll_rw_block(WRITE, 1, &bh);
+	}
+	list_for_each_entry(dr, &ranges, dr_list) {
+		index = rkfs_block_group(vfs_sb, dr->dr_blkno);
+		wait_on_buffer(vfs_sb->u.rkfs_sb.s_groups[index].g_bmap_bh);
+	}
+
+	list_for_each_entry_safe(dr, tmp, &ranges, dr_list) {
+		index = rkfs_block_group(vfs_sb, dr->dr_blkno);
+		bit = rkfs_block_bit(vfs_sb, dr->dr_blkno);
+		rkfs_debug("Discarding blocks %lu-%lu\n", dr->dr_blkno,
+			   (dr->dr_blkno + dr->dr_count - 1));
+		rkfs_trim_range(vfs_sb, index, bit, bit + dr->dr_count, 1);
+		list_del(&dr->dr_list);
+		kfree(dr);
+	}
+}
+
+/*
+* Queue freed blocks for discard. Ranges freed back to back are merged;
+* the queue is only flushed by rkfs_write_super, never here: the free
+* path may run under i_map_sem (truncate). Discards are advisory, so a
+* range that can't be queued is simply not discarded.
+*/
+static void rkfs_queue_discard(struct super_block *vfs_sb,
+			       unsigned long blkno, unsigned short count)
+{
+	struct rkfs_discard_range *dr = NULL, *new = NULL;
+	struct list_head *head = NULL;
+
+	if (!rkfs_test_opt(vfs_sb, DISCARD))
+		return;
+
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+
+	head = &vfs_sb->u.rkfs_sb.s_discard_list;
+	spin_lock(&vfs_sb->u.rkfs_sb.s_discard_lock);
+	if (!list_empty(head)) {
+		dr = list_entry(head->prev, struct rkfs_discard_range, dr_list);
+		if ((dr->dr_blkno + dr->dr_count) != blkno ||
+		    rkfs_block_bit(vfs_sb, blkno) == 0)
+			dr = NULL;
+	}
+
+	if (dr)
+		dr->dr_count += count;
+	else if (new) {
+		new->dr_blkno = blkno;
+		new->dr_count = count;
+		list_add_tail(&new->dr_list, head);
+		new = NULL;
+	}
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_discard_lock);
+
+	if (new)
+		kfree(new);
+	vfs_sb->s_dirt = 1;
+}
+
+int rkfs_free_blocks(struct inode *vfs_inode, unsigned long blkno,
 		     unsigned short count)
 {
 	struct super_block *vfs_sb = NULL;
 	int err = -EIO;
 
-	rkfs_debug("Block: %d, Count: %d\n", blkno, count);
+	rkfs_debug("Block: %lu, Count: %d\n", blkno, count);
 
 	if (!vfs_inode) {
 		rkfs_bug("VFS inode is NULL\n");
@@ -121,56 +271,237 @@ int rkfs_free_blocks(struct inode *vfs_inode, unsigned short blkno,
 		goto out;
 	}
 
-	lock_super(vfs_sb);
 	err = rkfs__free_blocks(vfs_sb, vfs_inode, blkno, count);
-	unlock_super(vfs_sb);
+	if (!err)
+		rkfs_queue_discard(vfs_sb, blkno, count);
 
  out:
 	return err;
 }
 
-int rkfs_free_inode_block(struct super_block *vfs_sb, unsigned short iblkno)
+int rkfs_free_inode_block(struct super_block *vfs_sb, unsigned long iblkno)
 {
 	int err = -EIO;
 
-	rkfs_debug("Inode block: %d\n", iblkno);
+	rkfs_debug("Inode block: %lu\n", iblkno);
 
 	if (!vfs_sb) {
 		rkfs_bug("VFS superblock is NULL\n");
 		goto out;
 	}
 
-	lock_super(vfs_sb);
 	err = rkfs__free_blocks(vfs_sb, NULL, iblkno, 1);
-	unlock_super(vfs_sb);
+	if (!err)
+		rkfs_queue_discard(vfs_sb, iblkno, 1);
 	return err;
 
  out:
 	return err;
 }
 
-int rkfs__new_block(struct super_block *vfs_sb,
-		    struct inode *vfs_inode, unsigned short *res_blkno)
+/*
+* Search the block map of group 'index' for a run of 'count' free bits.
+* The run at 'start' is taken if that bit is free, whatever its length,
+* to keep the caller contiguous. Otherwise the group is scanned from
+* 'start' (wrapping around to its first usable bit) and the first run
+* of 'count' bits, or else the longest run seen, is returned. Returns
+* RKFS_NO_BIT if the group is full. Groups with a free extent index
+* answer from it instead (best fit rather than first fit past 'start').
+* Without a goal in the group the search starts where the last
+* allocation in it ended (next fit), so a filling group isn't rescanned
+* from its start every time. The number of bitmap bits looked at is
+* added to '*scanned'; an answer from the index scans none, so adds
+* nothing. Called with the group lock held.
+*/
+static unsigned short rkfs_find_free_run(struct rkfs_group_info *rkfs_gi,
+					 unsigned short start,
+					 unsigned short count,
+					 unsigned short *res_len,
+					 unsigned long *scanned)
+{
+	unsigned short first = 0, size = 0, bit = 0, end = 0, pos = 0;
+	unsigned short best = RKFS_NO_BIT, best_len = 0, pass = 0;
+	unsigned short limit = 0;
+
+	*res_len = 0;
+	first = rkfs_gi->g_first_bit;
+	size = rkfs_gi->g_blocks;
+	if (size <= first)
+		return RKFS_NO_BIT;
+
+	if (start < first || start >= size)
+		start = rkfs_gi->g_last_bit;
+	if (start < first || start >= size)
+		start = first;
+
+	if (rkfs_gi->g_free_valid)
+		return rkfs_fe_find(rkfs_gi, start, count, res_len);
+
+	pos = start;
+	limit = size;
+	for (pass = 0; pass < 2; pass++) {
+		while (pos < limit) {
+			bit = rkfs_find_next_zero_bit(rkfs_gi->g_block_map,
+						      limit, pos);
+			if (bit >= limit) {
+				*scanned += limit - pos;
+				break;
+			}
+
+			end = rkfs_find_next_bit(rkfs_gi->g_block_map,
+						 size, bit);
+			*scanned += end - pos;
+			if ((end - bit) >= count || bit == start) {
+				*res_len = ((end - bit) < count) ?
+				    (end - bit) : count;
+				return bit;
+			}
+
+			if ((end - bit) > best_len) {
+				best = bit;
+				best_len = end - bit;
+			}
+			pos = end;
+		}
+
+		pos = first;
+		limit = start;
+	}
+
+	*res_len = best_len;
+	return best;
+}
+
+/*
+* Free blocks summed over all cpus. The approximate per-cpu read can be
+* off by a batch per cpu, too much to promise blocks against; every
+* admission decision uses this instead, under s_reserve_lock.
+*/
+static unsigned long rkfs_free_blocks_exact(struct super_block *vfs_sb)
+{
+	s64 free = percpu_counter_sum(&vfs_sb->u.rkfs_sb.s_freeblocks_counter);
+
+	return (free > 0) ? free : 0;
+}
+
+/*
+* Drop the hold an allocation kept on 'count' blocks while it claimed
+* them, once the free count reflects the claim.
+*/
+static void rkfs_unhold_blocks(struct super_block *vfs_sb,
+			       unsigned long count)
+{
+	if (!count)
+		return;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	vfs_sb->u.rkfs_sb.s_reserved_blocks -= count;
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+}
+
+/*
+* The allocator handed out 'count' blocks against writeback's '*claim'
+* (see rkfs_da_get_block_write): they come out of the reservation.
+*/
+static void rkfs_da_consume(struct super_block *vfs_sb,
+			    unsigned long *claim, unsigned long count)
+{
+	if (!claim || !*claim)
+		return;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	if (count > *claim)
+		count = *claim;
+	if (count > vfs_sb->u.rkfs_sb.s_reserved_blocks)
+		count = vfs_sb->u.rkfs_sb.s_reserved_blocks;
+	*claim -= count;
+	vfs_sb->u.rkfs_sb.s_reserved_blocks -= count;
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+}
+
+/*
+* 'claim', if not NULL, is the number of reserved blocks the caller may
+* still allocate from (delayed allocation writeback); it is decreased by
+* what is handed out.
+*/
+int rkfs__new_blocks(struct super_block *vfs_sb,
+		     struct inode *vfs_inode, unsigned long goal,
+		     unsigned short count, unsigned long *res_blkno,
+		     unsigned short *res_count, unsigned long *claim)
 {
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
-	unsigned short i = 0, rkfs_sb_count = 0;
-	unsigned short tb = 0, bit = 0, blkno = 0;
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned short i = 0, rkfs_sb_count = 0, rkfs_sb_index = 0;
+	unsigned short bit = 0, len = 0;
 	unsigned short fb_found = 0;
+	unsigned long blkno = 0, avail = 0, reserved = 0, scanned = 0;
+	unsigned long mine = 0, held = 0;
 	int err = -EIO;
 
-	rkfs_debug("New block requested...\n");
+	rkfs_debug("New blocks requested (goal: %lu, count: %d)...\n", goal,
+		   count);
 
 	*res_blkno = 0;
+	*res_count = 0;
 	if (!vfs_sb) {
 		rkfs_bug("VFS superblock is NULL\n");
 		goto out;
 	}
 
-	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
+	if (!count)
+		count = 1;
+
+	/*
+	 * Blocks reserved by delayed allocation are off limits, except
+	 * for the ones the inode is allocating them for. The rest of the
+	 * request is held as reserved until the free count drops, so that
+	 * nobody else can promise the same blocks meanwhile.
+	 */
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	avail = rkfs_free_blocks_exact(vfs_sb);
+	reserved = vfs_sb->u.rkfs_sb.s_reserved_blocks;
+	if (claim)
+		mine = (*claim < reserved) ? *claim : reserved;
+	reserved -= mine;
+	avail = (avail > reserved) ? (avail - reserved) : 0;
+	if (count > avail)
+		count = avail;
+	held = (count > mine) ? count - mine : 0;
+	vfs_sb->u.rkfs_sb.s_reserved_blocks += held;
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+
+	if (!count) {
+		err = -ENOSPC;
+		goto out;
+	}
 
+	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
+	if (rkfs_block_group(vfs_sb, goal) > (rkfs_sb_count - 1)) {
+		rkfs_sb_index = vfs_sb->u.rkfs_sb.s_last_group;
+		if (rkfs_sb_index > (rkfs_sb_count - 1))
+			rkfs_sb_index = 0;
+		goal = rkfs_group_first_block(vfs_sb, rkfs_sb_index);
+	} else
+		rkfs_sb_index = rkfs_block_group(vfs_sb, goal);
+
+	/*
+	 * Try the goal and the rest of its group first, then spill
+	 * over to the following groups (wrapping around). The first
+	 * group with free space wins, so a short run near the goal is
+	 * preferred over a long one far away. Each group is searched and
+	 * claimed under its own lock, so allocators working in different
+	 * groups don't serialize.
+	 */
 	for (i = 0; i < rkfs_sb_count; i++) {
-		if (!(bh = vfs_sb->u.rkfs_sb.s_sbh[i])) {
+		rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+		if (!rkfs_gi->g_free_blocks) {
+			if (++rkfs_sb_index >= rkfs_sb_count)
+				rkfs_sb_index = 0;
+			continue;
+		}
+
+		if (!(bh = vfs_sb->u.rkfs_sb.s_sbh[rkfs_sb_index])) {
 			rkfs_bug("%s superblock not in memory\n", RKFS_NAME);
 			goto out;
 		}
@@ -181,35 +512,23 @@ int rkfs__new_block(struct super_block *vfs_sb,
 			goto out;
 		}
 
-		tb = rkfs_dsb->s_total_blocks;
-		bit = rkfs_find_first_zero_bit(rkfs_dsb->s_block_map,
-					       RKFS_MIN_BLOCKS);
-
-		if (i) {
-			if (bit == 0 || bit >= RKFS_MIN_BLOCKS)
-				continue;
-		} else {
-			if (bit < RKFS_FIRST_BLOCK || bit >= RKFS_MIN_BLOCKS)
-				continue;
+		spin_lock(&rkfs_gi->g_lock);
+		bit = rkfs_find_free_run(rkfs_gi,
+					 i ? 0 : rkfs_block_bit(vfs_sb, goal),
+					 count, &len, &scanned);
+		atomic_inc(&vfs_sb->u.rkfs_sb.s_alloc_groups);
+		if (bit != RKFS_NO_BIT) {
+			fb_found = 1;
+			break;
 		}
+		spin_unlock(&rkfs_gi->g_lock);
 
-		blkno = bit + (i * RKFS_MIN_BLOCKS);
-		if (blkno >= tb)
-			continue;
-
-		if (rkfs_set_bit(bit, rkfs_dsb->s_block_map)) {
-			rkfs_bug("Block %d (bit: %d) already allocated\n",
-				 blkno, bit);
-			goto out;
-		}
-
-		if (vfs_inode)
-			DQUOT_ALLOC_BLOCK(vfs_inode, 1);
-
-		fb_found = 1;
-		break;
+		if (++rkfs_sb_index >= rkfs_sb_count)
+			rkfs_sb_index = 0;
 	}
 
+	atomic_inc(&vfs_sb->u.rkfs_sb.s_alloc_calls);
+	atomic_add(scanned, &vfs_sb->u.rkfs_sb.s_alloc_bits);
 	if (!fb_found) {
 		rkfs_debug("No free blocks found in the device %s\n",
 			   bdevname(vfs_sb->s_dev));
@@ -217,24 +536,278 @@ int rkfs__new_block(struct super_block *vfs_sb,
 		goto out;
 	}
 
-	*res_blkno = blkno;
-	mark_buffer_dirty(bh);
-	if (vfs_sb->s_flags & MS_SYNCHRONOUS) {
-		ll_rw_block(WRITE, 1, &bh);
-		wait_on_buffer(bh);
+	blkno = bit + rkfs_group_first_block(vfs_sb, rkfs_sb_index);
+	for (i = 0; i < len; i++) {
+		if (rkfs_set_bit(bit + i, rkfs_gi->g_block_map)) {
+			while (i--)
+				rkfs_clear_bit(bit + i, rkfs_gi->g_block_map);
+			rkfs_fe_release(rkfs_gi);
+			spin_unlock(&rkfs_gi->g_lock);
+			rkfs_bug("Block %lu (bit: %d) already allocated\n",
+				 blkno, bit);
+			goto out;
+		}
 	}
+	rkfs_gi->g_free_blocks -= len;
+	rkfs_gi->g_last_bit = bit + len;
+	rkfs_fe_remove(rkfs_gi, bit, len);
+	spin_unlock(&rkfs_gi->g_lock);
+
+	vfs_sb->u.rkfs_sb.s_last_group = rkfs_sb_index;
+	percpu_counter_add(&vfs_sb->u.rkfs_sb.s_freeblocks_counter, -len);
+	rkfs_unhold_blocks(vfs_sb, held);
+
+	if (vfs_inode)
+		DQUOT_ALLOC_BLOCK(vfs_inode, len);
+	rkfs_da_consume(vfs_sb, claim, len);
+
+	*res_blkno = blkno;
+	*res_count = len;
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_bmap_bh);
+	if (vfs_sb->s_flags & MS_SYNCHRONOUS)
+		rkfs_sync_group(vfs_sb, rkfs_sb_index);
 
-	rkfs_debug("Found free block: %d (bit: %d)\n", *res_blkno, bit);
+	rkfs_debug("Found free blocks: %lu-%lu (bit: %d)\n", *res_blkno,
+		   (*res_blkno + len - 1), bit);
 	return 0;
 
  out:
+	rkfs_unhold_blocks(vfs_sb, held);
 	FAILED;
 	return err;
 }
 
-int rkfs_new_block(struct inode *vfs_inode, unsigned short *res_blkno)
+int rkfs__new_block(struct super_block *vfs_sb,
+		    struct inode *vfs_inode, unsigned long goal,
+		    unsigned long *res_blkno)
+{
+	unsigned short count = 0;
+
+	return rkfs__new_blocks(vfs_sb, vfs_inode, goal, 1, res_blkno, &count,
+				NULL);
+}
+
+/*
+* Claim up to 'window' free blocks from 'blkno' on (within its group)
+* for a preallocation window. The blocks are marked in use in the
+* bitmap but not charged to anybody; the caller installs them in the
+* inode. Returns the number of blocks claimed.
+*/
+unsigned short rkfs__prealloc(struct super_block *vfs_sb,
+			      unsigned long blkno, unsigned short window)
+{
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned short rkfs_sb_index = 0, bit = 0, size = 0, n = 0;
+
+	if (!window ||
+	    rkfs_block_group(vfs_sb, blkno) >= vfs_sb->u.rkfs_sb.s_sb_count)
+		return 0;
+
+	rkfs_sb_index = rkfs_block_group(vfs_sb, blkno);
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	if (rkfs_free_blocks_exact(vfs_sb) <
+	    (vfs_sb->u.rkfs_sb.s_reserved_blocks + window)) {
+		spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+		return 0;
+	}
+	vfs_sb->u.rkfs_sb.s_reserved_blocks += window;
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+
+	rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+	size = rkfs_gi->g_blocks;
+	bit = rkfs_block_bit(vfs_sb, blkno);
+
+	spin_lock(&rkfs_gi->g_lock);
+	for (n = 0; n < window && (bit + n) < size; n++) {
+		if (rkfs_test_bit(bit + n, rkfs_gi->g_block_map))
+			break;
+		rkfs_set_bit(bit + n, rkfs_gi->g_block_map);
+	}
+	rkfs_gi->g_free_blocks -= n;
+	rkfs_fe_remove(rkfs_gi, bit, n);
+	spin_unlock(&rkfs_gi->g_lock);
+
+	if (n)
+		percpu_counter_add(&vfs_sb->u.rkfs_sb.s_freeblocks_counter,
+				   -n);
+	rkfs_unhold_blocks(vfs_sb, window);
+	if (!n)
+		return 0;
+
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_bmap_bh);
+
+	rkfs_debug("Preallocated %lu-%lu\n", blkno, (blkno + n - 1));
+	return n;
+}
+
+/*
+* Return the unused part of the inode's preallocation window to the
+* bitmap. The window is taken off the inode under i_prealloc_lock and
+* freed once the lock is dropped.
+*/
+void rkfs_discard_prealloc(struct inode *vfs_inode)
+{
+	struct super_block *vfs_sb = NULL;
+	unsigned long blkno = 0;
+	unsigned short count = 0;
+
+	if (!vfs_inode || !(vfs_sb = vfs_inode->i_sb))
+		return;
+
+	if (!RKFS_I(vfs_inode)->i_prealloc_count)
+		return;
+
+	spin_lock(&RKFS_I(vfs_inode)->i_prealloc_lock);
+	blkno = RKFS_I(vfs_inode)->i_prealloc_block;
+	count = RKFS_I(vfs_inode)->i_prealloc_count;
+	RKFS_I(vfs_inode)->i_prealloc_count = 0;
+	spin_unlock(&RKFS_I(vfs_inode)->i_prealloc_lock);
+
+	if (!count)
+		return;
+
+	rkfs_debug("Inode %ld: discarding prealloc %lu-%lu\n", vfs_inode->i_ino,
+		   blkno, (blkno + count - 1));
+	rkfs__free_blocks(vfs_sb, NULL, blkno, count);
+}
+
+/*
+* Delayed allocation: account for 'count' data blocks of 'vfs_inode', and
+* 'meta' indirect or extent blocks they may need, to be allocated at
+* writeback time without touching any bitmap. The inode keeps its share
+* in i_da_blocks and i_da_meta, the filesystem the total in
+* s_reserved_blocks.
+*/
+int rkfs_reserve_blocks(struct inode *vfs_inode, unsigned long count,
+			unsigned long meta)
+{
+	struct super_block *vfs_sb = vfs_inode->i_sb;
+	int err = -ENOSPC;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	if (rkfs_free_blocks_exact(vfs_sb) >=
+	    (vfs_sb->u.rkfs_sb.s_reserved_blocks + count + meta)) {
+		vfs_sb->u.rkfs_sb.s_reserved_blocks += count + meta;
+		RKFS_I(vfs_inode)->i_da_blocks += count;
+		RKFS_I(vfs_inode)->i_da_meta += meta;
+		err = 0;
+	}
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+
+	return err;
+}
+
+/*
+* Drop the metadata reservation of an inode left with no delayed data
+* blocks. Called with s_reserve_lock held.
+*/
+static void rkfs__release_meta(struct inode *vfs_inode)
+{
+	struct rkfs_sb_info *rkfs_sbi = &vfs_inode->i_sb->u.rkfs_sb;
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+
+	if (rkfs_ii->i_da_blocks)
+		return;
+
+	if (rkfs_ii->i_da_meta > rkfs_sbi->s_reserved_blocks)
+		rkfs_ii->i_da_meta = rkfs_sbi->s_reserved_blocks;
+	rkfs_sbi->s_reserved_blocks -= rkfs_ii->i_da_meta;
+	rkfs_ii->i_da_meta = 0;
+}
+
+/*
+* 'count' delayed blocks of 'vfs_inode' went away without being
+* allocated (page invalidated).
+*/
+void rkfs_release_blocks(struct inode *vfs_inode, unsigned long count)
+{
+	struct super_block *vfs_sb = vfs_inode->i_sb;
+	unsigned long reserved = 0, asked = count;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	reserved = RKFS_I(vfs_inode)->i_da_blocks;
+	if (count > reserved)
+		count = reserved;
+	if (count > vfs_sb->u.rkfs_sb.s_reserved_blocks)
+		count = vfs_sb->u.rkfs_sb.s_reserved_blocks;
+	vfs_sb->u.rkfs_sb.s_reserved_blocks -= count;
+	RKFS_I(vfs_inode)->i_da_blocks -= count;
+	rkfs__release_meta(vfs_inode);
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+
+	if (asked > reserved)
+		rkfs_bug("Releasing %ld blocks, only %ld reserved\n", asked,
+			 reserved);
+}
+
+/*
+* Writeback is about to map delayed blocks: hand it the inode's metadata
+* reservation, so that two writebacks of the same inode can't both count
+* on it. rkfs_da_allocated gives back whatever is left.
+*/
+unsigned long rkfs_da_claim_meta(struct inode *vfs_inode)
+{
+	struct super_block *vfs_sb = vfs_inode->i_sb;
+	unsigned long meta = 0;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	meta = RKFS_I(vfs_inode)->i_da_meta;
+	RKFS_I(vfs_inode)->i_da_meta = 0;
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+
+	return meta;
+}
+
+/*
+* Writeback mapped 'count' delayed blocks, using 'used' reserved blocks
+* for them and their indirect or extent blocks; whatever of 'used' was
+* not data came out of the 'meta' it claimed, the rest of which goes
+* back to the inode. If mapping failed ('err') the blocks it had taken
+* are free again and the reservation goes back.
+*/
+void rkfs_da_allocated(struct inode *vfs_inode, unsigned long count,
+		       unsigned long used, unsigned long meta, int err)
+{
+	struct super_block *vfs_sb = vfs_inode->i_sb;
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	unsigned long spent = 0;
+
+	spin_lock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+	if (err) {
+		vfs_sb->u.rkfs_sb.s_reserved_blocks += used;
+		rkfs_ii->i_da_meta += meta;
+		rkfs__release_meta(vfs_inode);
+		spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+		return;
+	}
+
+	if (count > rkfs_ii->i_da_blocks)
+		count = rkfs_ii->i_da_blocks;
+	rkfs_ii->i_da_blocks -= count;
+
+	spent = (used > count) ? used - count : 0;
+	if (spent > meta)
+		spent = meta;
+	rkfs_ii->i_da_meta += meta - spent;
+	rkfs__release_meta(vfs_inode);
+	spin_unlock(&vfs_sb->u.rkfs_sb.s_reserve_lock);
+}
+
+/*
+* Regular files allocate from their preallocation window while the goal
+* keeps following it (appending writers); any other goal drops the
+* window. Fresh allocations open a new window right after the blocks
+* handed out. The window itself is only touched under i_prealloc_lock;
+* blocks are claimed and freed with the lock dropped.
+*/
+int rkfs_new_blocks(struct inode *vfs_inode, unsigned long goal,
+		    unsigned short count, unsigned long *res_blkno,
+		    unsigned short *res_count, unsigned long *claim)
 {
 	struct super_block *vfs_sb = NULL;
+	struct rkfs_inode_info *rkfs_ii = NULL;
+	unsigned long old_blkno = 0;
+	unsigned short window = 0, n = 0, old_count = 0;
 	int err = -EIO;
 
 	if (!vfs_inode) {
@@ -247,19 +820,79 @@ int rkfs_new_block(struct inode *vfs_inode, unsigned short *res_blkno)
 		goto out;
 	}
 
-	lock_super(vfs_sb);
-	err = rkfs__new_block(vfs_sb, vfs_inode, res_blkno);
-	unlock_super(vfs_sb);
+	if (S_ISREG(vfs_inode->i_mode))
+		window = vfs_sb->u.rkfs_sb.s_prealloc_window;
+
+	rkfs_ii = RKFS_I(vfs_inode);
+	spin_lock(&rkfs_ii->i_prealloc_lock);
+	if (rkfs_ii->i_prealloc_count) {
+		if (goal == rkfs_ii->i_prealloc_block) {
+			n = rkfs_ii->i_prealloc_count;
+			if (n > count)
+				n = count;
+
+			rkfs_ii->i_prealloc_block += n;
+			rkfs_ii->i_prealloc_count -= n;
+			spin_unlock(&rkfs_ii->i_prealloc_lock);
+
+			*res_blkno = goal;
+			*res_count = n;
+			DQUOT_ALLOC_BLOCK(vfs_inode, n);
+			rkfs_da_consume(vfs_sb, claim, n);
+			rkfs_debug("Inode %ld: blocks %lu-%lu from prealloc\n",
+				   vfs_inode->i_ino, goal, (goal + n - 1));
+			return 0;
+		}
 
-	return err;
+		old_blkno = rkfs_ii->i_prealloc_block;
+		old_count = rkfs_ii->i_prealloc_count;
+		rkfs_ii->i_prealloc_count = 0;
+	}
+	spin_unlock(&rkfs_ii->i_prealloc_lock);
+
+	if (old_count)
+		rkfs__free_blocks(vfs_sb, NULL, old_blkno, old_count);
+
+	err = rkfs__new_blocks(vfs_sb, vfs_inode, goal, count, res_blkno,
+			       res_count, claim);
+	if (err || !window)
+		return err;
+
+	old_blkno = *res_blkno + *res_count;
+	if (!(n = rkfs__prealloc(vfs_sb, old_blkno, window)))
+		return 0;
+
+	/*
+	 * Somebody else may have opened a window meanwhile; theirs wins.
+	 */
+	spin_lock(&rkfs_ii->i_prealloc_lock);
+	if (!rkfs_ii->i_prealloc_count) {
+		rkfs_ii->i_prealloc_block = old_blkno;
+		rkfs_ii->i_prealloc_count = n;
+		n = 0;
+	}
+	spin_unlock(&rkfs_ii->i_prealloc_lock);
+
+	if (n)
+		rkfs__free_blocks(vfs_sb, NULL, old_blkno, n);
+
+	return 0;
 
  out:
 	FAILED;
 	return err;
+}
+
+int rkfs_new_block(struct inode *vfs_inode, unsigned long goal,
+		   unsigned long *res_blkno)
+{
+	unsigned short count = 0;
 
+	return rkfs_new_blocks(vfs_inode, goal, 1, res_blkno, &count, NULL);
 }
 
-int rkfs_new_inode_block(struct inode *vfs_inode, unsigned short *res_blkno)
+int rkfs_new_inode_block(struct inode *vfs_inode, unsigned long goal,
+			 unsigned long *res_blkno)
 {
 	struct super_block *vfs_sb = NULL;
 	int err = -EIO;
@@ -274,10 +907,61 @@ int rkfs_new_inode_block(struct inode *vfs_inode, unsigned short *res_blkno)
 		goto out;
 	}
 
-	err = rkfs__new_block(vfs_sb, NULL, res_blkno);
+	err = rkfs__new_block(vfs_sb, NULL, goal, res_blkno);
 	return err;
 
  out:
 	FAILED;
 	return err;
 }
+
+/*
+* FITRIM: discard every free run of at least range->minlen bytes that
+* lies within [range->start, range->start + range->len). On return
+* range->len holds the number of bytes discarded.
+*/
+int rkfs_trim_fs(struct super_block *vfs_sb, struct fstrim_range *range)
+{
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned char bits = vfs_sb->s_blocksize_bits;
+	__u64 first = 0, last = 0, gstart = 0, trimmed = 0;
+	unsigned short index = 0, bit = 0, end = 0, size = 0;
+	unsigned short minlen = 0;
+	unsigned long tb = 0;
+	long ret = 0;
+
+	if (range->len < vfs_sb->s_blocksize)
+		return -EINVAL;
+
+	tb = vfs_sb->u.rkfs_sb.s_total_blocks;
+
+	first = range->start >> bits;
+	last = first + (range->len >> bits);
+	if (last > tb)
+		last = tb;
+	minlen = ((range->minlen >> bits) > rkfs_blocks_per_group(vfs_sb)) ?
+	    rkfs_blocks_per_group(vfs_sb) : (range->minlen >> bits);
+
+	for (index = 0; index < vfs_sb->u.rkfs_sb.s_sb_count; index++) {
+		gstart = rkfs_group_first_block(vfs_sb, index);
+		if (gstart >= last)
+			break;
+
+		rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[index];
+		size = rkfs_gi->g_blocks;
+		if ((gstart + size) <= first || !rkfs_gi->g_free_blocks)
+			continue;
+
+		bit = (first > gstart) ? (first - gstart) : 0;
+		if (bit < rkfs_gi->g_first_bit)
+			bit = rkfs_gi->g_first_bit;
+		end = ((last - gstart) < size) ? (last - gstart) : size;
+
+		if ((ret = rkfs_trim_range(vfs_sb, index, bit, end, minlen)) < 0)
+			return ret;
+		trimmed += ret;
+	}
+
+	range->len = trimmed << bits;
+	return 0;
+}
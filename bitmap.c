@@ -12,13 +12,18 @@
 
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/bitops.h>
 
 #include <rkfs.h>
 
-unsigned short rkfs_count_free(void *map, unsigned short offset,
-			       unsigned short total_blocks)
+/*
+* Count the free bits among the first 'nbits' of a group map, 16 bits at
+* a time; the bits past 'nbits' in the last word are masked off.
+*/
+unsigned short rkfs_count_free(void *map, unsigned short nbits)
 {
-	unsigned short sum = 0, i = 0, blkno = 0;
+	__u16 *word = map;
+	unsigned short sum = 0, i = 0, tail = 0;
 
 	if (!map) {
 		rkfs_bug("NULL map specified\n");
@@ -26,13 +31,11 @@ unsigned short rkfs_count_free(void *map, unsigned short offset,
 		goto out;
 	}
 
-	for (i = 0; i < RKFS_MIN_BLOCKS; i++) {
-		blkno = offset + i;
-		if (blkno > (total_blocks - 1))
-			return sum;
-		if (!rkfs_test_bit(i, map))
-			sum += 1;
-	}
+	for (i = 0; i < (nbits / 16); i++)
+		sum += 16 - hweight16(word[i]);
+
+	if ((tail = nbits % 16))
+		sum += tail - hweight16(word[i] & ((1 << tail) - 1));
 
  out:
 	return sum;
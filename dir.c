@@ -74,10 +74,37 @@ struct page *rkfs_get_page(struct inode *vfs_pinode, unsigned long n)
 	return ERR_PTR(-EIO);
 }
 
+/*
+* Statahead: start reading the inode table blocks of up to 'count'
+* entries from 'p_addr' on in a directory page, so the iget()s that
+* usually follow a readdir or lookup find them in memory, or at least
+* on the way, instead of reading them one at a time.
+*/
+static void rkfs_dir_readahead(struct super_block *sb, char *p_addr,
+			       char *pe_addr, unsigned count)
+{
+	struct rkfs_dir_entry *de = NULL;
+	unsigned long blkno = 0, last = 0;
+
+	while (p_addr <= pe_addr && count--) {
+		de = (struct rkfs_dir_entry *)p_addr;
+		if (!rkfs_de_name_len(sb, de))
+			break;
+
+		if (rkfs_de_inode(sb, de) &&
+		    (blkno = rkfs_inode_readahead(sb, rkfs_de_inode(sb, de),
+						  last)))
+			last = blkno;
+
+		p_addr = p_addr + rkfs_de_rec_len(sb, de);
+	}
+}
+
 int rkfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	loff_t pos = 0;
 	struct inode *inode = NULL;
+	struct super_block *sb = NULL;
 	unsigned offset = 0;
 	unsigned long n = 0, npages = 0;
 	char *ps_addr = NULL, *pe_addr = NULL, *p_addr = NULL;
@@ -86,6 +113,7 @@ int rkfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	int over = 0;
 
 	inode = filp->f_dentry->d_inode;
+	sb = inode->i_sb;
 	pos = filp->f_pos;
 
 	n = pos / PAGE_CACHE_SIZE;
@@ -108,7 +136,8 @@ int rkfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		}
 
 		ps_addr = page_address(page);
-		pe_addr = ps_addr + PAGE_CACHE_SIZE - RKFS_DIR_ENTRY_LEN(1);
+		pe_addr = ps_addr + PAGE_CACHE_SIZE -
+		    rkfs_dir_entry_len(sb, 1);
 
 		p_addr = ps_addr + offset;
 
@@ -116,16 +145,18 @@ int rkfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 		rkfs_debug("p_addr= %ld\n", (ulong) p_addr);
 		rkfs_debug("pe_addr= %ld\n", (ulong) pe_addr);
 
+		rkfs_dir_readahead(sb, p_addr, pe_addr, PAGE_CACHE_SIZE);
+
 		while (p_addr <= pe_addr) {
 			de = (struct rkfs_dir_entry *)p_addr;
 
-			if (de->de_inode) {
+			if (rkfs_de_inode(sb, de)) {
 				offset = ((char *)de) - ps_addr;
 				over =
-				    filldir(dirent, de->de_name,
-					    de->de_name_len,
+				    filldir(dirent, rkfs_de_name(sb, de),
+					    rkfs_de_name_len(sb, de),
 					    ((n * PAGE_CACHE_SIZE) + offset),
-					    de->de_inode, DT_UNKNOWN);
+					    rkfs_de_inode(sb, de), DT_UNKNOWN);
 
 				if (over) {
 					rkfs_put_page(page);
@@ -136,10 +167,8 @@ int rkfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 				}
 			}
 
-			if (de->de_name_len) {
-				p_addr =
-				    p_addr +
-				    RKFS_DIR_ENTRY_LEN(de->de_name_len);
+			if (rkfs_de_name_len(sb, de)) {
+				p_addr = p_addr + rkfs_de_rec_len(sb, de);
 			} else {
 				rkfs_debug
 				    ("namelen = 0, so no next entry...\n");
@@ -163,6 +192,7 @@ struct rkfs_dir_entry *rkfs_find_entry(struct inode *dir,
 				       struct dentry *dentry,
 				       struct page **res_page)
 {
+	struct super_block *sb = dir->i_sb;
 	char *name = NULL;
 	unsigned namelen = 0;
 	unsigned long n = 0, npages = 0;
@@ -184,15 +214,18 @@ struct rkfs_dir_entry *rkfs_find_entry(struct inode *dir,
 		}
 
 		p_addr = ps_addr = page_address(page);
-		pe_addr = ps_addr + PAGE_CACHE_SIZE - RKFS_DIR_ENTRY_LEN(1);
+		pe_addr = ps_addr + PAGE_CACHE_SIZE -
+		    rkfs_dir_entry_len(sb, 1);
 
 		while (p_addr <= pe_addr) {
 			de = (struct rkfs_dir_entry *)p_addr;
 
-			if (!de->de_inode && !de->de_name_len)
+			if (!rkfs_de_inode(sb, de) &&
+			    !rkfs_de_name_len(sb, de))
 				break;
 
-			if (de->de_inode && !de->de_name_len) {
+			if (rkfs_de_inode(sb, de) &&
+			    !rkfs_de_name_len(sb, de)) {
 				rkfs_bug
 				    ("Invalid dir entry found in page %ld\n",
 				     n);
@@ -201,11 +234,12 @@ struct rkfs_dir_entry *rkfs_find_entry(struct inode *dir,
 				goto not_found;
 			}
 
-			if (de->de_inode && (de->de_name_len == namelen) &&
-			    (strncmp(de->de_name, name, de->de_name_len) == 0))
+			if (rkfs_de_inode(sb, de) &&
+			    (rkfs_de_name_len(sb, de) == namelen) &&
+			    (strncmp(rkfs_de_name(sb, de), name, namelen) == 0))
 				goto found;
 
-			p_addr = p_addr + RKFS_DIR_ENTRY_LEN(de->de_name_len);
+			p_addr = p_addr + rkfs_de_rec_len(sb, de);
 		}
 
 		rkfs_put_page(page);
@@ -222,13 +256,18 @@ struct rkfs_dir_entry *rkfs_find_entry(struct inode *dir,
 
 ino_t rkfs_inode_by_name(struct inode * dir, struct dentry * dentry)
 {
+	struct super_block *sb = dir->i_sb;
 	ino_t res = 0;
 	struct rkfs_dir_entry *de = NULL;
 	struct page *page = NULL;
 
 	de = rkfs_find_entry(dir, dentry, &page);
 	if (de) {
-		res = de->de_inode;
+		res = rkfs_de_inode(sb, de);
+		rkfs_dir_readahead(sb, (char *)de + rkfs_de_rec_len(sb, de),
+				   (char *)page_address(page) +
+				   PAGE_CACHE_SIZE - rkfs_dir_entry_len(sb, 1),
+				   RKFS_STATAHEAD_ENTRIES);
 		rkfs_put_page(page);
 		goto out;
 	}
@@ -242,29 +281,30 @@ ino_t rkfs_inode_by_name(struct inode * dir, struct dentry * dentry)
 void rkfs_set_link(struct inode *dir, struct rkfs_dir_entry *de,
 		   struct page *page, struct inode *inode)
 {
+	struct super_block *sb = dir->i_sb;
 	char *ps_addr = NULL;
 	unsigned from = 0, to = 0;
 	int err = 0;
 
 	ps_addr = page_address(page);
 	from = ((char *)de) - ps_addr;
-	to = from + RKFS_DIR_ENTRY_LEN(de->de_name_len);
+	to = from + rkfs_de_rec_len(sb, de);
 
 	lock_page(page);
 
 	err = page->mapping->a_ops->prepare_write(NULL, page, from, to);
 	if (err) {
 		rkfs_bug("Can't link %s to %ld (prepare write failed)\n",
-			 de->de_name, inode->i_ino);
+			 rkfs_de_name(sb, de), inode->i_ino);
 		goto error_out;
 	}
 
-	de->de_inode = inode->i_ino;
+	rkfs_de_set_inode(sb, de, inode->i_ino);
 
 	err = rkfs_commit_chunk(page, from, to);
 	if (err) {
 		rkfs_bug("Can't link %s to %ld (prepare write failed)\n",
-			 de->de_name, inode->i_ino);
+			 rkfs_de_name(sb, de), inode->i_ino);
 		goto error_out;
 	}
 
@@ -286,6 +326,7 @@ void rkfs_set_link(struct inode *dir, struct rkfs_dir_entry *de,
 int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 {
 	struct inode *dir = NULL;
+	struct super_block *sb = NULL;
 	char *name = NULL;
 	unsigned namelen = 0, reclen = 0, rec_len = 0;
 	struct page *page = NULL;
@@ -296,9 +337,10 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 	int err = 0;
 
 	dir = dentry->d_parent->d_inode;
+	sb = dir->i_sb;
 	name = (char *)dentry->d_name.name;
 	namelen = dentry->d_name.len;
-	reclen = RKFS_DIR_ENTRY_LEN(namelen);
+	reclen = rkfs_dir_entry_len(sb, namelen);
 	npages = RKFS_DIR_PAGES(dir);
 
 	for (n = 0; n <= npages; n++) {
@@ -311,13 +353,14 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 		}
 
 		p_addr = ps_addr = page_address(page);
-		pe_addr = ps_addr + PAGE_CACHE_SIZE - RKFS_DIR_ENTRY_LEN(1);
+		pe_addr = ps_addr + PAGE_CACHE_SIZE -
+		    rkfs_dir_entry_len(sb, 1);
 
 		while (p_addr <= pe_addr) {
 			de = (struct rkfs_dir_entry *)p_addr;
 
-			if (de->de_inode) {
-				if (!de->de_name_len) {
+			if (rkfs_de_inode(sb, de)) {
+				if (!rkfs_de_name_len(sb, de)) {
 					err = -EIO;
 					rkfs_bug
 					    ("Invalid dir entry found in page %ld\n",
@@ -325,21 +368,21 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 					goto out_page;
 				}
 
-				if ((de->de_name_len == namelen) &&
-				    (strncmp(de->de_name, name, de->de_name_len)
+				if ((rkfs_de_name_len(sb, de) == namelen) &&
+				    (strncmp(rkfs_de_name(sb, de), name, namelen)
 				     == 0)) {
 					err = -EEXIST;
 					goto out_page;
 				}
 			} else {
-				if (!de->de_name_len) {
+				if (!rkfs_de_name_len(sb, de)) {
 					rec_len = reclen;
 					rkfs_debug
 					    ("Got new free dir-entry slot\n");
 					goto got_it;
 				}
 
-				rec_len = RKFS_DIR_ENTRY_LEN(de->de_name_len);
+				rec_len = rkfs_de_rec_len(sb, de);
 				if (rec_len == reclen) {
 					rkfs_debug
 					    ("Got exact free dir-entry slot of size: %d\n",
@@ -349,7 +392,7 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 
 				if ((rec_len > reclen) &&
 				    (rec_len - reclen) >=
-				    RKFS_DIR_ENTRY_LEN(1)) {
+				    rkfs_dir_entry_len(sb, 1)) {
 					rkfs_debug
 					    ("Got free bigger dir-entry slot of size: %d\n",
 					     rec_len);
@@ -361,7 +404,7 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 				     rec_len);
 			}
 
-			p_addr = p_addr + RKFS_DIR_ENTRY_LEN(de->de_name_len);
+			p_addr = p_addr + rkfs_de_rec_len(sb, de);
 		}
 
 		rkfs_put_page(page);
@@ -387,14 +430,15 @@ int rkfs_add_link(struct dentry *dentry, struct inode *inode)
 		goto out_unlock;
 	}
 
-	de->de_inode = inode->i_ino;
-	de->de_name_len = namelen;
-	memcpy(de->de_name, name, namelen);
+	rkfs_de_set_inode(sb, de, inode->i_ino);
+	rkfs_de_set_name_len(sb, de, namelen);
+	memcpy(rkfs_de_name(sb, de), name, namelen);
 
 	if (rec_len != reclen) {
 		de = (struct rkfs_dir_entry *)(((char *)de) + reclen);
-		de->de_inode = 0;
-		de->de_name_len = rec_len - reclen - 4;
+		rkfs_de_set_inode(sb, de, 0);
+		rkfs_de_set_name_len(sb, de, rec_len - reclen -
+				     rkfs_dir_entry_len(sb, 0));
 	}
 
 	err = rkfs_commit_chunk(page, from, to);
@@ -421,32 +465,34 @@ int rkfs_delete_entry(struct rkfs_dir_entry *de, struct page *page)
 {
 	struct address_space *mapping = NULL;
 	struct inode *inode = NULL;
+	struct super_block *sb = NULL;
 	char *ps_addr = NULL;
 	unsigned from = 0, to = 0;
 	int err = 0;
 
 	mapping = page->mapping;
 	inode = (struct inode *)mapping->host;
+	sb = inode->i_sb;
 	ps_addr = page_address(page);
 
 	from = ((char *)de) - ps_addr;
-	to = from + RKFS_DIR_ENTRY_LEN(de->de_name_len);
+	to = from + rkfs_de_rec_len(sb, de);
 
 	lock_page(page);
 
 	err = mapping->a_ops->prepare_write(NULL, page, from, to);
 	if (err) {
 		rkfs_bug("Can't delete the entry: %s (prepare write failed)\n",
-			 de->de_name);
+			 rkfs_de_name(sb, de));
 		goto fail;
 	}
 
-	de->de_inode = 0;
+	rkfs_de_set_inode(sb, de, 0);
 
 	err = rkfs_commit_chunk(page, from, to);
 	if (err) {
 		rkfs_bug("Can't delete the entry: %s (commit chunk failed)\n",
-			 de->de_name);
+			 rkfs_de_name(sb, de));
 		goto fail;
 	}
 
@@ -467,6 +513,7 @@ int rkfs_delete_entry(struct rkfs_dir_entry *de, struct page *page)
 
 int rkfs_make_empty(struct inode *inode, struct inode *parent)
 {
+	struct super_block *sb = inode->i_sb;
 	struct address_space *mapping = NULL;
 	struct page *page = NULL;
 	struct rkfs_dir_entry *de = NULL;
@@ -482,7 +529,7 @@ int rkfs_make_empty(struct inode *inode, struct inode *parent)
 		goto out;
 	}
 
-	err = mapping->a_ops->prepare_write(NULL, page, 0, RKFS_BLOCK_SIZE);
+	err = mapping->a_ops->prepare_write(NULL, page, 0, sb->s_blocksize);
 	if (err) {
 		rkfs_debug
 		    ("Can't make empty directory (fail to prepare write)\n");
@@ -493,16 +540,16 @@ int rkfs_make_empty(struct inode *inode, struct inode *parent)
 	memset(base, 0, PAGE_CACHE_SIZE);
 
 	de = (struct rkfs_dir_entry *)base;
-	de->de_inode = inode->i_ino;
-	de->de_name_len = 1;
-	strcpy(de->de_name, ".");
+	rkfs_de_set_inode(sb, de, inode->i_ino);
+	rkfs_de_set_name_len(sb, de, 1);
+	strcpy(rkfs_de_name(sb, de), ".");
 
-	de = (struct rkfs_dir_entry *)(base + RKFS_DIR_ENTRY_LEN(1));
-	de->de_inode = parent->i_ino;
-	de->de_name_len = 2;
-	strcpy(de->de_name, "..");
+	de = (struct rkfs_dir_entry *)(base + rkfs_dir_entry_len(sb, 1));
+	rkfs_de_set_inode(sb, de, parent->i_ino);
+	rkfs_de_set_name_len(sb, de, 2);
+	strcpy(rkfs_de_name(sb, de), "..");
 
-	err = rkfs_commit_chunk(page, 0, RKFS_BLOCK_SIZE);
+	err = rkfs_commit_chunk(page, 0, sb->s_blocksize);
 	if (err) {
 		rkfs_debug
 		    ("Can't make empty directory (fail to commit chunk)\n");
@@ -525,6 +572,7 @@ int rkfs_make_empty(struct inode *inode, struct inode *parent)
 
 int rkfs_empty_dir(struct inode *inode)
 {
+	struct super_block *sb = inode->i_sb;
 	struct page *page = NULL;
 	unsigned long n = 0, npages = 0;
 	char *ps_addr = NULL, *pe_addr = NULL, *p_addr = NULL;
@@ -541,41 +589,40 @@ int rkfs_empty_dir(struct inode *inode)
 		}
 
 		p_addr = ps_addr = page_address(page);
-		pe_addr = ps_addr + PAGE_CACHE_SIZE - RKFS_DIR_ENTRY_LEN(1);
+		pe_addr = ps_addr + PAGE_CACHE_SIZE -
+		    rkfs_dir_entry_len(sb, 1);
 
 		while (p_addr <= pe_addr) {
 			de = (struct rkfs_dir_entry *)p_addr;
 
-			if (de->de_inode) {
-				if (!de->de_name_len) {
+			if (rkfs_de_inode(sb, de)) {
+				if (!rkfs_de_name_len(sb, de)) {
 					rkfs_bug
 					    ("Invalid dir entry found at page %ld\n",
 					     n);
 					goto not_empty;
 				}
 
-				if ((de->de_name_len == 1)
-				    && (de->de_name[0] != '.'))
+				if ((rkfs_de_name_len(sb, de) == 1)
+				    && (rkfs_de_name(sb, de)[0] != '.'))
 					goto not_empty;
 
-				if ((de->de_name_len == 2)
-				    && (de->de_name[0] != '.')
-				    && (de->de_name[1] != '.'))
+				if ((rkfs_de_name_len(sb, de) == 2)
+				    && (rkfs_de_name(sb, de)[0] != '.')
+				    && (rkfs_de_name(sb, de)[1] != '.'))
 					goto not_empty;
 
-				if (de->de_name_len > 2)
+				if (rkfs_de_name_len(sb, de) > 2)
 					goto not_empty;
 
-				if (de->de_name_len < 2) {
-					if (de->de_inode != inode->i_ino)
+				if (rkfs_de_name_len(sb, de) < 2) {
+					if (rkfs_de_inode(sb, de) != inode->i_ino)
 						goto not_empty;
 				}
 			}
 
-			if (de->de_name_len)
-				p_addr =
-				    p_addr +
-				    RKFS_DIR_ENTRY_LEN(de->de_name_len);
+			if (rkfs_de_name_len(sb, de))
+				p_addr = p_addr + rkfs_de_rec_len(sb, de);
 			else
 				break;
 		}
@@ -595,4 +642,5 @@ struct file_operations rkfs_dir_operations = {
  read:	generic_read_dir,
  readdir:rkfs_readdir,
  fsync:rkfs_sync_file,
+ ioctl:rkfs_ioctl,
 };
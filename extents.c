@@ -0,0 +1,385 @@
+/*
+*
+* extents.c
+*
+* R.K.Raja
+* (rajkanna_hcl@yahoo.com, rajark_hcl@yahoo.co.in)
+*
+* (C) Copyright 2002, 2003.
+* All rights reserved.
+*
+*/
+
+#include <linux/fs.h>
+
+#include <rkfs.h>
+
+/*
+* Extent-mapped inodes (see rkfs_extent_header). The extents, in i_data
+* or in the overflow block, are kept sorted by logical block and never
+* overlap; a new run is merged into the extent it continues when it is
+* contiguous on disk too.
+*/
+#define rkfs_ext_root(inode) \
+        ((struct rkfs_extent_header *)RKFS_I(inode)->i_data)
+#define rkfs_ext_first(eh)   ((struct rkfs_extent *)((eh) + 1))
+
+void rkfs_ext_init(struct inode *vfs_inode)
+{
+	struct rkfs_extent_header *eh = rkfs_ext_root(vfs_inode);
+
+	memset(RKFS_I(vfs_inode)->i_data, 0,
+	       sizeof(RKFS_I(vfs_inode)->i_data));
+	eh->eh_magic = RKFS_EXT_MAGIC;
+	RKFS_I(vfs_inode)->i_extents = 1;
+}
+
+/*
+* The header the extents are under: the root in i_data, or the overflow
+* block, whose buffer is returned in '*bhp' (NULL for the root).
+*/
+static struct rkfs_extent_header *rkfs_ext_leaf(struct inode *vfs_inode,
+						struct buffer_head **bhp)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_extent_header *eh = rkfs_ext_root(vfs_inode);
+	unsigned long blkno = 0;
+
+	*bhp = NULL;
+	if (!eh->eh_depth)
+		return eh;
+
+	blkno = rkfs_ext_first(eh)->ee_start;
+	if (!(*bhp = bread(vfs_inode->i_dev, blkno, sb->s_blocksize))) {
+		rkfs_printk("Unable to read extent block %lu of inode %ld\n",
+			    blkno, vfs_inode->i_ino);
+		return NULL;
+	}
+
+	eh = (struct rkfs_extent_header *)(*bhp)->b_data;
+	if (eh->eh_magic != RKFS_EXT_MAGIC ||
+	    eh->eh_entries > RKFS_EXT_BLOCK_MAX(sb->s_blocksize)) {
+		rkfs_bug("Bad extent block %lu in inode %ld\n", blkno,
+			 vfs_inode->i_ino);
+		brelse(*bhp);
+		*bhp = NULL;
+		return NULL;
+	}
+
+	return eh;
+}
+
+/*
+* Index of the last extent starting at or before 'blkno', -1 if none.
+*/
+static int rkfs_ext_search(struct rkfs_extent_header *eh, unsigned long blkno)
+{
+	struct rkfs_extent *ex = rkfs_ext_first(eh);
+	int lo = 0, hi = eh->eh_entries - 1, mid = 0;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ex[mid].ee_block <= blkno)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return hi;
+}
+
+static void rkfs_ext_dirty(struct inode *vfs_inode, struct buffer_head *bh)
+{
+	if (bh)
+		mark_buffer_dirty_inode(bh, vfs_inode);
+	else
+		mark_inode_dirty(vfs_inode);
+}
+
+/*
+* Free 'len' blocks from 'blkno' on; an extent may run across a group
+* boundary, the allocator frees within one group only.
+*/
+static void rkfs_ext_free(struct inode *vfs_inode, unsigned long blkno,
+			  unsigned long len)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	unsigned long end = 0, count = 0;
+
+	while (len) {
+		end = rkfs_group_first_block(sb, rkfs_block_group(sb, blkno) + 1);
+		count = (end - blkno < len) ? end - blkno : len;
+		rkfs_free_blocks(vfs_inode, blkno, count);
+		blkno += count;
+		len -= count;
+	}
+}
+
+/*
+* The root is full: move its extents to a new overflow block.
+*/
+static int rkfs_ext_grow(struct inode *vfs_inode, unsigned long *claim)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_extent_header *eh = rkfs_ext_root(vfs_inode);
+	struct rkfs_extent *ex = rkfs_ext_first(eh);
+	struct buffer_head *bh = NULL;
+	unsigned long blkno = 0;
+	unsigned short got = 0;
+	int err = 0;
+
+	err = rkfs_new_blocks(vfs_inode, ex->ee_start + ex->ee_len, 1, &blkno,
+			      &got, claim);
+	if (err)
+		return err;
+
+	bh = getblk(vfs_inode->i_dev, blkno, sb->s_blocksize);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, sb->s_blocksize);
+	memcpy(bh->b_data, eh, sizeof(*eh) + eh->eh_entries * sizeof(*ex));
+	mark_buffer_uptodate(bh, 1);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, vfs_inode);
+	brelse(bh);
+
+	memset(ex, 0, RKFS_EXT_ROOT_MAX * sizeof(*ex));
+	ex->ee_start = blkno;
+	eh->eh_entries = 1;
+	eh->eh_depth = 1;
+	mark_inode_dirty(vfs_inode);
+
+	return 0;
+}
+
+/*
+* rkfs_get_block for an extent-mapped inode. A mapped block comes with
+* the rest of its extent, up to b_size; a hole is filled with one run,
+* as long as b_size allows and the next extent leaves room. Locking as
+* in rkfs_get_block: i_map_sem shared to look up, exclusive to allocate.
+*/
+int rkfs_ext_get_block(struct inode *vfs_inode, long blkno,
+		       struct buffer_head *bh_result, int create,
+		       unsigned long *claim)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_extent_header *eh = NULL;
+	struct rkfs_extent *ex = NULL;
+	struct buffer_head *bh = NULL;
+	unsigned long goal = 0, phys = 0, count = 0;
+	unsigned short got = 0, max = 0;
+	int err = 0, maxblocks = 0, i = 0, write = 0;
+
+	rkfs_debug("Inode: %ld, Block: %ld, Create: %d\n", vfs_inode->i_ino,
+		   blkno, create);
+
+	maxblocks = bh_result->b_size >> vfs_inode->i_blkbits;
+	if (maxblocks < 1)
+		maxblocks = 1;
+
+	down_read(&RKFS_I(vfs_inode)->i_map_sem);
+	if (rkfs_map_lookup(vfs_inode, blkno, bh_result, maxblocks))
+		goto out;
+ again:
+	if (!(eh = rkfs_ext_leaf(vfs_inode, &bh))) {
+		err = -EIO;
+		goto out;
+	}
+
+	ex = rkfs_ext_first(eh);
+	i = rkfs_ext_search(eh, blkno);
+	if (i >= 0 && blkno < ex[i].ee_block + ex[i].ee_len) {
+		phys = ex[i].ee_start + (blkno - ex[i].ee_block);
+		count = ex[i].ee_len - (blkno - ex[i].ee_block);
+		rkfs_map_remember(vfs_inode, blkno, phys, count);
+		goto got_it;
+	}
+
+	if (!create)
+		goto out;
+
+	if (!write) {
+		if (bh)
+			brelse(bh);
+		bh = NULL;
+		up_read(&RKFS_I(vfs_inode)->i_map_sem);
+		down_write(&RKFS_I(vfs_inode)->i_map_sem);
+		write = 1;
+		goto again;
+	}
+
+	count = maxblocks;
+	if (i + 1 < eh->eh_entries && ex[i + 1].ee_block - blkno < count)
+		count = ex[i + 1].ee_block - blkno;
+	if (count > RKFS_EXT_MAX_LEN)
+		count = RKFS_EXT_MAX_LEN;
+
+	if (i >= 0)
+		goal = ex[i].ee_start + (blkno - ex[i].ee_block);
+	else
+		goal = rkfs_group_first_block(sb, rkfs_inode_group(sb,
+							   vfs_inode->i_ino));
+
+	if ((err = rkfs_new_blocks(vfs_inode, goal, count, &phys, &got,
+				   claim)))
+		goto out;
+	count = got;
+
+	if (i >= 0 && ex[i].ee_block + ex[i].ee_len == blkno &&
+	    ex[i].ee_start + ex[i].ee_len == phys &&
+	    ex[i].ee_len + count <= RKFS_EXT_MAX_LEN) {
+		ex[i].ee_len += count;
+		goto added;
+	}
+
+	/*
+	 * The run needs an extent of its own. Only now, with a merge
+	 * ruled out, does a full root move to an overflow block.
+	 */
+	max = bh ? RKFS_EXT_BLOCK_MAX(sb->s_blocksize) : RKFS_EXT_ROOT_MAX;
+	if (!bh && eh->eh_entries >= max) {
+		if (!(err = rkfs_ext_grow(vfs_inode, claim)) &&
+		    !(eh = rkfs_ext_leaf(vfs_inode, &bh)))
+			err = -EIO;
+		if (err) {
+			rkfs_ext_free(vfs_inode, phys, count);
+			goto out;
+		}
+		ex = rkfs_ext_first(eh);
+		i = rkfs_ext_search(eh, blkno);
+		max = RKFS_EXT_BLOCK_MAX(sb->s_blocksize);
+	}
+
+	if (eh->eh_entries < max) {
+		memmove(&ex[i + 2], &ex[i + 1],
+			(eh->eh_entries - (i + 1)) * sizeof(*ex));
+		ex[i + 1].ee_block = blkno;
+		ex[i + 1].ee_start = phys;
+		ex[i + 1].ee_len = count;
+		ex[i + 1].ee_unused = 0;
+		eh->eh_entries++;
+	} else {
+		rkfs_printk("Inode %ld has too many extents\n",
+			    vfs_inode->i_ino);
+		rkfs_ext_free(vfs_inode, phys, count);
+		err = -EFBIG;
+		goto out;
+	}
+
+ added:
+	vfs_inode->i_ctime = CURRENT_TIME;
+	rkfs_ext_dirty(vfs_inode, bh);
+	mark_inode_dirty(vfs_inode);
+	rkfs_map_remember(vfs_inode, blkno, phys, count);
+	bh_result->b_state |= (1UL << BH_New);
+
+ got_it:
+	if (count > maxblocks)
+		count = maxblocks;
+
+	bh_result->b_dev = vfs_inode->i_dev;
+	bh_result->b_blocknr = phys;
+	bh_result->b_state |= (1UL << BH_Mapped);
+	if (maxblocks > 1)
+		bh_result->b_size = count << vfs_inode->i_blkbits;
+
+	rkfs_debug("Result block: %ld (count: %lu)\n", bh_result->b_blocknr,
+		   count);
+
+ out:
+	if (bh)
+		brelse(bh);
+	if (write)
+		up_write(&RKFS_I(vfs_inode)->i_map_sem);
+	else
+		up_read(&RKFS_I(vfs_inode)->i_map_sem);
+	return err;
+}
+
+/*
+* Delayed allocation: the overflow block, if it doesn't exist yet and
+* isn't reserved by an earlier delayed block, may be needed. With the
+* overflow block full a new block may need an extent there is no room
+* for; the write is refused (-EFBIG) now rather than failing writeback.
+*/
+int rkfs_ext_da_meta(struct inode *vfs_inode)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_extent_header *eh = NULL;
+	struct buffer_head *bh = NULL;
+	int meta = 0;
+
+	down_read(&RKFS_I(vfs_inode)->i_map_sem);
+	if (!(eh = rkfs_ext_leaf(vfs_inode, &bh)))
+		meta = -EIO;
+	else if (!bh)
+		meta = !RKFS_I(vfs_inode)->i_da_meta;
+	else if (eh->eh_entries >= RKFS_EXT_BLOCK_MAX(sb->s_blocksize))
+		meta = -EFBIG;
+	up_read(&RKFS_I(vfs_inode)->i_map_sem);
+
+	if (bh)
+		brelse(bh);
+	return meta;
+}
+
+/*
+* Free everything past i_size a whole extent, or the tail of one, at a
+* time. An overflow block that is no longer needed goes too.
+*/
+void rkfs_ext_truncate(struct inode *vfs_inode)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	struct rkfs_extent_header *eh = NULL, *root = NULL;
+	struct rkfs_extent *ex = NULL;
+	struct buffer_head *bh = NULL;
+	unsigned long last = 0, keep = 0, blkno = 0;
+	int i = 0;
+
+	last = (vfs_inode->i_size + sb->s_blocksize - 1) >>
+	    sb->s_blocksize_bits;
+
+	if (!(eh = rkfs_ext_leaf(vfs_inode, &bh)))
+		return;
+
+	ex = rkfs_ext_first(eh);
+	for (i = eh->eh_entries - 1; i >= 0; i--) {
+		if (ex[i].ee_block >= last) {
+			rkfs_ext_free(vfs_inode, ex[i].ee_start, ex[i].ee_len);
+			memset(&ex[i], 0, sizeof(*ex));
+			eh->eh_entries--;
+			continue;
+		}
+
+		if (ex[i].ee_block + ex[i].ee_len > last) {
+			keep = last - ex[i].ee_block;
+			rkfs_ext_free(vfs_inode, ex[i].ee_start + keep,
+				      ex[i].ee_len - keep);
+			ex[i].ee_len = keep;
+		}
+		break;
+	}
+
+	rkfs_ext_dirty(vfs_inode, bh);
+	if (!bh)
+		return;
+
+	/*
+	 * Back into the inode once the extents fit there again.
+	 */
+	if (eh->eh_entries <= RKFS_EXT_ROOT_MAX) {
+		root = rkfs_ext_root(vfs_inode);
+		blkno = rkfs_ext_first(root)->ee_start;
+		memset(rkfs_ext_first(root), 0,
+		       RKFS_EXT_ROOT_MAX * sizeof(*ex));
+		memcpy(rkfs_ext_first(root), ex, eh->eh_entries * sizeof(*ex));
+		root->eh_entries = eh->eh_entries;
+		root->eh_depth = 0;
+		mark_inode_dirty(vfs_inode);
+
+		bforget(bh);
+		rkfs_free_blocks(vfs_inode, blkno, 1);
+		return;
+	}
+
+	brelse(bh);
+}
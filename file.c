@@ -23,6 +23,11 @@ int rkfs_sync_file(struct file *file, struct dentry *dentry, int datasync)
 	err = fsync_inode_buffers(vfs_inode);
 	err |= fsync_inode_data_buffers(vfs_inode);
 
+	/*
+	 * A clean inode may still sit in a dirty inode table buffer (see
+	 * rkfs_update_inode); that buffer is on the inode's buffer list,
+	 * so fsync_inode_buffers above has written it.
+	 */
 	if (!(vfs_inode->i_state & I_DIRTY))
 		goto out;
 
@@ -38,13 +43,26 @@ int rkfs_sync_file(struct file *file, struct dentry *dentry, int datasync)
 	return err ? -EIO : 0;
 }
 
+/*
+* Last writer gone, give back what is left of the preallocation window.
+*/
+int rkfs_release_file(struct inode *vfs_inode, struct file *filp)
+{
+	if (filp->f_mode & FMODE_WRITE)
+		rkfs_discard_prealloc(vfs_inode);
+
+	return 0;
+}
+
 struct file_operations rkfs_file_operations = {
  llseek:generic_file_llseek,
  read:	generic_file_read,
  write:generic_file_write,
  mmap:	generic_file_mmap,
  open:	generic_file_open,
+ release:rkfs_release_file,
  fsync:rkfs_sync_file,
+ ioctl:rkfs_ioctl,
 };
 
 struct inode_operations rkfs_file_inode_operations = {
@@ -0,0 +1,315 @@
+/*
+*
+* freeext.c
+*
+* R.K.Raja
+* (rajkanna_hcl@yahoo.com, rajark_hcl@yahoo.co.in)
+*
+* (C) Copyright 2002, 2003
+* All rights reserved.
+*
+*/
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/rbtree.h>
+
+#include <rkfs.h>
+
+/*
+* In-memory index of the free runs of a group's block map. Every run is
+* kept in an rbtree ordered by its first bit (for "what is free at X")
+* and on a list picked by the log2 of its length (for best-fit and
+* longest-run queries). Bits are group relative.
+*
+* The index is only a cache of the bitmap. It is built at mount, kept
+* in step by the allocators under the group lock, and simply dropped
+* (g_free_valid = 0) if it can't be updated, after which the group is
+* searched through its bitmap again.
+*/
+struct rkfs_free_extent {
+	struct rb_node fe_node;	//In g_free_root, by fe_start
+	struct list_head fe_list;	//In g_free_size[rkfs_fe_bucket(fe_len)]
+	unsigned short fe_start;	//First free bit of the run
+	unsigned short fe_len;	//Number of free bits
+};
+
+#define rkfs_fe_bucket(len)  (fls(len) - 1)
+#define rkfs_fe_end(fe)      ((fe)->fe_start + (fe)->fe_len)
+
+static struct kmem_cache *rkfs_fe_cachep;
+
+int rkfs_init_free_extents(void)
+{
+	rkfs_fe_cachep = kmem_cache_create("rkfs_free_extent",
+					   sizeof(struct rkfs_free_extent),
+					   0, SLAB_HWCACHE_ALIGN, NULL);
+	if (rkfs_fe_cachep == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void rkfs_destroy_free_extents(void)
+{
+	kmem_cache_destroy(rkfs_fe_cachep);
+}
+
+static void rkfs_fe_link(struct rkfs_group_info *rkfs_gi,
+			 struct rkfs_free_extent *fe)
+{
+	struct rb_node **p = &rkfs_gi->g_free_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct rkfs_free_extent *tmp = NULL;
+
+	while (*p) {
+		parent = *p;
+		tmp = rb_entry(parent, struct rkfs_free_extent, fe_node);
+		if (fe->fe_start < tmp->fe_start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&fe->fe_node, parent, p);
+	rb_insert_color(&fe->fe_node, &rkfs_gi->g_free_root);
+	list_add(&fe->fe_list, &rkfs_gi->g_free_size[rkfs_fe_bucket(fe->fe_len)]);
+}
+
+static void rkfs_fe_unlink(struct rkfs_group_info *rkfs_gi,
+			   struct rkfs_free_extent *fe)
+{
+	rb_erase(&fe->fe_node, &rkfs_gi->g_free_root);
+	list_del(&fe->fe_list);
+	kmem_cache_free(rkfs_fe_cachep, fe);
+}
+
+/*
+* A run only ever grows or shrinks into bits no other run covers, so its
+* place in the rbtree stays the same; only its size list may change.
+*/
+static void rkfs_fe_resize(struct rkfs_group_info *rkfs_gi,
+			   struct rkfs_free_extent *fe,
+			   unsigned short start, unsigned short len)
+{
+	fe->fe_start = start;
+	fe->fe_len = len;
+	list_move(&fe->fe_list, &rkfs_gi->g_free_size[rkfs_fe_bucket(len)]);
+}
+
+/*
+* Last run starting at or before 'bit', NULL if there is none.
+*/
+static struct rkfs_free_extent *rkfs_fe_prev(struct rkfs_group_info *rkfs_gi,
+					     unsigned short bit)
+{
+	struct rb_node *n = rkfs_gi->g_free_root.rb_node;
+	struct rkfs_free_extent *fe = NULL, *prev = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct rkfs_free_extent, fe_node);
+		if (bit < fe->fe_start)
+			n = n->rb_left;
+		else {
+			prev = fe;
+			n = n->rb_right;
+		}
+	}
+
+	return prev;
+}
+
+void rkfs_fe_release(struct rkfs_group_info *rkfs_gi)
+{
+	struct rb_node *n = NULL;
+	unsigned short i = 0;
+
+	while ((n = rb_first(&rkfs_gi->g_free_root)) != NULL) {
+		rb_erase(n, &rkfs_gi->g_free_root);
+		kmem_cache_free(rkfs_fe_cachep,
+				rb_entry(n, struct rkfs_free_extent, fe_node));
+	}
+
+	for (i = 0; i < RKFS_FREE_BUCKETS; i++)
+		INIT_LIST_HEAD(&rkfs_gi->g_free_size[i]);
+	rkfs_gi->g_free_valid = 0;
+}
+
+/*
+* Build the index of a group from its block map. Done at mount, before
+* the group is visible to the allocators.
+*/
+int rkfs_fe_build(struct rkfs_group_info *rkfs_gi)
+{
+	struct rkfs_free_extent *fe = NULL;
+	unsigned short bit = 0, end = 0, size = 0;
+
+	rkfs_gi->g_free_root = RB_ROOT;
+	rkfs_fe_release(rkfs_gi);
+
+	size = rkfs_gi->g_blocks;
+	bit = rkfs_gi->g_first_bit;
+	while (bit < size) {
+		bit = rkfs_find_next_zero_bit(rkfs_gi->g_block_map, size, bit);
+		if (bit >= size)
+			break;
+		end = rkfs_find_next_bit(rkfs_gi->g_block_map, size, bit);
+
+		if (!(fe = kmem_cache_alloc(rkfs_fe_cachep, GFP_KERNEL))) {
+			rkfs_fe_release(rkfs_gi);
+			return -ENOMEM;
+		}
+		fe->fe_start = bit;
+		fe->fe_len = end - bit;
+		rkfs_fe_link(rkfs_gi, fe);
+		bit = end;
+	}
+
+	rkfs_gi->g_free_valid = 1;
+	return 0;
+}
+
+/*
+* Bits [bit, bit + len) were just allocated. Called with the group lock
+* held.
+*/
+void rkfs_fe_remove(struct rkfs_group_info *rkfs_gi, unsigned short bit,
+		    unsigned short len)
+{
+	struct rkfs_free_extent *fe = NULL, *right = NULL;
+	unsigned short end = bit + len;
+
+	if (!rkfs_gi->g_free_valid || !len)
+		return;
+
+	fe = rkfs_fe_prev(rkfs_gi, bit);
+	if (!fe || end > rkfs_fe_end(fe)) {
+		rkfs_bug("Free extent index out of step (bit %d, len %d)\n",
+			 bit, len);
+		rkfs_fe_release(rkfs_gi);
+		return;
+	}
+
+	if (bit == fe->fe_start && end == rkfs_fe_end(fe))
+		rkfs_fe_unlink(rkfs_gi, fe);
+	else if (bit == fe->fe_start)
+		rkfs_fe_resize(rkfs_gi, fe, end, fe->fe_len - len);
+	else if (end == rkfs_fe_end(fe))
+		rkfs_fe_resize(rkfs_gi, fe, fe->fe_start, fe->fe_len - len);
+	else {
+		if (!(right = kmem_cache_alloc(rkfs_fe_cachep, GFP_ATOMIC))) {
+			rkfs_fe_release(rkfs_gi);
+			return;
+		}
+		right->fe_start = end;
+		right->fe_len = rkfs_fe_end(fe) - end;
+		rkfs_fe_resize(rkfs_gi, fe, fe->fe_start, bit - fe->fe_start);
+		rkfs_fe_link(rkfs_gi, right);
+	}
+}
+
+/*
+* Bits [bit, bit + len) were just freed; merge them with the runs on
+* either side. Called with the group lock held.
+*/
+void rkfs_fe_insert(struct rkfs_group_info *rkfs_gi, unsigned short bit,
+		    unsigned short len)
+{
+	struct rkfs_free_extent *prev = NULL, *next = NULL, *fe = NULL;
+	struct rb_node *n = NULL;
+	unsigned short end = bit + len;
+
+	if (!rkfs_gi->g_free_valid || !len)
+		return;
+
+	prev = rkfs_fe_prev(rkfs_gi, bit);
+	n = prev ? rb_next(&prev->fe_node) : rb_first(&rkfs_gi->g_free_root);
+	if (n)
+		next = rb_entry(n, struct rkfs_free_extent, fe_node);
+
+	if ((prev && rkfs_fe_end(prev) > bit) ||
+	    (next && next->fe_start < end)) {
+		rkfs_bug("Free extent index out of step (bit %d, len %d)\n",
+			 bit, len);
+		rkfs_fe_release(rkfs_gi);
+		return;
+	}
+
+	if (prev && rkfs_fe_end(prev) == bit) {
+		if (next && next->fe_start == end) {
+			len += next->fe_len;
+			rkfs_fe_unlink(rkfs_gi, next);
+		}
+		rkfs_fe_resize(rkfs_gi, prev, prev->fe_start,
+			       prev->fe_len + len);
+	} else if (next && next->fe_start == end)
+		rkfs_fe_resize(rkfs_gi, next, bit, next->fe_len + len);
+	else {
+		if (!(fe = kmem_cache_alloc(rkfs_fe_cachep, GFP_ATOMIC))) {
+			rkfs_fe_release(rkfs_gi);
+			return;
+		}
+		fe->fe_start = bit;
+		fe->fe_len = len;
+		rkfs_fe_link(rkfs_gi, fe);
+	}
+}
+
+/*
+* Index counterpart of the bitmap search: the run at 'start' if that
+* bit is free, else the smallest run of at least 'count' bits, else the
+* longest run. Returns RKFS_NO_BIT if the group is full. Called with
+* the group lock held and the index valid.
+*/
+unsigned short rkfs_fe_find(struct rkfs_group_info *rkfs_gi,
+			    unsigned short start, unsigned short count,
+			    unsigned short *res_len)
+{
+	struct rkfs_free_extent *fe = NULL, *best = NULL;
+	int b = 0;
+
+	*res_len = 0;
+	if (!count)
+		count = 1;
+	else if (count > rkfs_gi->g_blocks)
+		count = rkfs_gi->g_blocks;
+
+	if ((fe = rkfs_fe_prev(rkfs_gi, start)) && rkfs_fe_end(fe) > start) {
+		*res_len = rkfs_fe_end(fe) - start;
+		if (*res_len > count)
+			*res_len = count;
+		return start;
+	}
+
+	/*
+	 * Runs in the bucket of 'count' may be shorter than it; every run
+	 * in a higher bucket is long enough.
+	 */
+	b = rkfs_fe_bucket(count);
+	list_for_each_entry(fe, &rkfs_gi->g_free_size[b], fe_list)
+		if (fe->fe_len >= count && (!best || fe->fe_len < best->fe_len))
+			best = fe;
+
+	for (b++; !best && b < RKFS_FREE_BUCKETS; b++)
+		if (!list_empty(&rkfs_gi->g_free_size[b]))
+			best = list_entry(rkfs_gi->g_free_size[b].next,
+					  struct rkfs_free_extent, fe_list);
+
+	if (best) {
+		*res_len = count;
+		return best->fe_start;
+	}
+
+	for (b = rkfs_fe_bucket(count); b >= 0 && !best; b--)
+		list_for_each_entry(fe, &rkfs_gi->g_free_size[b], fe_list)
+			if (!best || fe->fe_len > best->fe_len)
+				best = fe;
+
+	if (!best)
+		return RKFS_NO_BIT;
+
+	*res_len = best->fe_len;
+	return best->fe_start;
+}
@@ -15,13 +15,15 @@
 #include <rkfs.h>
 
 int rkfs_free_inode(struct inode *vfs_inode,
-		    unsigned short *res_icount, unsigned short *res_iblkno)
+		    unsigned short *res_icount, unsigned long *res_iblkno)
 {
 	struct super_block *vfs_sb = NULL;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
+	struct rkfs_group_info *rkfs_gi = NULL;
 	unsigned short rkfs_sb_index = 0, rkfs_sb_count = 0;
-	unsigned short bit = 0, blkno = 0, itable_index = 0;
+	unsigned short bit = 0, itable_index = 0;
+	unsigned long blkno = 0;
 	int err = -EIO;
 
 	*res_icount = 0;
@@ -38,103 +40,160 @@ int rkfs_free_inode(struct inode *vfs_inode,
 		goto out;
 	}
 
-	lock_super(vfs_sb);
 	clear_inode(vfs_inode);
 
 	if (is_bad_inode(vfs_inode)) {
 		rkfs_bug("Cannot free bad inode\n");
-		goto unlock_and_out;
+		goto out;
 	}
 
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = vfs_inode->i_ino / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, vfs_inode->i_ino);
 
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
 		rkfs_bug("Inode %ld is bad (invalid %s sb index)\n",
 			 vfs_inode->i_ino, RKFS_NAME);
-		goto unlock_and_out;
+		goto out;
 	}
 
 	if (!(bh = vfs_sb->u.rkfs_sb.s_sbh[rkfs_sb_index])) {
 		rkfs_bug("%s superblock not in memory\n", RKFS_NAME);
-		goto unlock_and_out;
+		goto out;
 	}
 
 	rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
 	if (rkfs_dsb->s_fsid != RKFS_ID) {
 		rkfs_bug("No valid %s superblock found\n", RKFS_NAME);
-		goto unlock_and_out;
+		goto out;
 	}
 
-	bit = vfs_inode->i_ino % RKFS_MIN_BLOCKS;
+	bit = rkfs_inode_bit(vfs_sb, vfs_inode->i_ino);
 	if (rkfs_sb_index) {
 		if (bit == 0) {
 			rkfs_bug
 			    ("Inode %ld (bit %d) is bad (can't free resv. inode)\n",
 			     vfs_inode->i_ino, bit);
-			goto unlock_and_out;
+			goto out;
 		}
 	} else {
 		if (bit < (RKFS_FIRST_INODE - 1)) {
 			rkfs_bug
 			    ("Inode %ld (bit %d) is bad (can't free resv. inode)\n",
 			     vfs_inode->i_ino, bit);
-			goto unlock_and_out;
+			goto out;
 		}
 	}
 
-	itable_index = bit / RKFS_INODES_PER_BLOCK;
-	if (!(blkno = rkfs_dsb->s_itable_map[itable_index][0])) {
+	itable_index = bit / rkfs_inodes_per_block(vfs_sb);
+	rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+	spin_lock(&rkfs_gi->g_lock);
+	if (!(blkno = rkfs_itable_block(vfs_sb, rkfs_gi, itable_index))) {
+		spin_unlock(&rkfs_gi->g_lock);
 		rkfs_bug("Inode %ld is bad (no inode block)\n",
 			 vfs_inode->i_ino);
-		goto unlock_and_out;
+		goto out;
 	}
 
 	rkfs_debug("Freeing inode %ld (bit %d)\n", vfs_inode->i_ino, bit);
-	if (!(rkfs_clear_bit(bit, rkfs_dsb->s_inode_map))) {
+	if (!(rkfs_clear_bit(bit, rkfs_gi->g_inode_map))) {
+		spin_unlock(&rkfs_gi->g_lock);
 		rkfs_bug("Inode %ld (bit %d) is already free\n",
 			 vfs_inode->i_ino, bit);
-		goto unlock_and_out;
+		goto out;
 	}
 
-	rkfs_dsb->s_itable_map[itable_index][1] -= 1;
-	rkfs_debug("Inode count at index: %d is %d\n", itable_index,
-		   rkfs_dsb->s_itable_map[itable_index][1]);
-
-	*res_icount = rkfs_dsb->s_itable_map[itable_index][1];
+	rkfs_gi->g_free_inodes++;
+	*rkfs_itable_count(vfs_sb, rkfs_gi, itable_index) -= 1;
+	*res_icount = *rkfs_itable_count(vfs_sb, rkfs_gi, itable_index);
 	*res_iblkno = blkno;
 
+	/*
+	 * The caller frees the emptied table block; a new inode landing
+	 * in this slot meanwhile allocates a fresh one.
+	 */
 	if (*res_icount == 0)
-		rkfs_dsb->s_itable_map[itable_index][0] = 0;
+		rkfs_set_itable_block(vfs_sb, rkfs_gi, itable_index, 0);
+	spin_unlock(&rkfs_gi->g_lock);
 
-	mark_buffer_dirty(bh);
-	if (vfs_sb->s_flags & MS_SYNCHRONOUS) {
-		ll_rw_block(WRITE, 1, &bh);
-		wait_on_buffer(bh);
-	}
+	percpu_counter_inc(&vfs_sb->u.rkfs_sb.s_freeinodes_counter);
+	rkfs_debug("Inode count at index: %d is %d\n", itable_index,
+		   *res_icount);
+
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_imap_bh);
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_itmap_bh);
+	if (vfs_sb->s_flags & MS_SYNCHRONOUS)
+		rkfs_sync_group(vfs_sb, rkfs_sb_index);
 
-	unlock_super(vfs_sb);
 	rkfs_debug("Inode %ld (bit %d) freed\n", vfs_inode->i_ino, bit);
 	return 0;
 
- unlock_and_out:
-	unlock_super(vfs_sb);
-
  out:
 	FAILED;
 	return err;
 }
 
+/*
+* Pick the group to look for a new inode in first, from the cached
+* group counts only. Top level directories are spread out to a group
+* with more free inodes and blocks than average (the roomiest such), so
+* unrelated trees don't share groups. Everything else stays with its
+* parent while the parent's group has room, or else goes to the next
+* group that has.
+*/
+static unsigned short rkfs_find_group(struct super_block *vfs_sb,
+				      struct inode *vfs_pinode, int mode)
+{
+	struct rkfs_group_info *rkfs_gi = vfs_sb->u.rkfs_sb.s_groups;
+	unsigned short rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
+	unsigned short parent = 0, best = 0, i = 0, index = 0;
+	unsigned long avg_fi = 0, avg_fb = 0;
+
+	parent = rkfs_inode_group(vfs_sb, vfs_pinode->i_ino);
+
+	if (S_ISDIR(mode) && vfs_pinode->i_ino == RKFS_ROOT_INO) {
+		avg_fi = percpu_counter_read_positive(&vfs_sb->u.rkfs_sb.
+						      s_freeinodes_counter) /
+		    rkfs_sb_count;
+		avg_fb = percpu_counter_read_positive(&vfs_sb->u.rkfs_sb.
+						      s_freeblocks_counter) /
+		    rkfs_sb_count;
+
+		best = rkfs_sb_count;
+		for (i = 0; i < rkfs_sb_count; i++) {
+			if (!rkfs_gi[i].g_free_inodes ||
+			    rkfs_gi[i].g_free_inodes < avg_fi ||
+			    rkfs_gi[i].g_free_blocks < avg_fb)
+				continue;
+			if (best == rkfs_sb_count ||
+			    rkfs_gi[i].g_free_blocks > rkfs_gi[best].g_free_blocks)
+				best = i;
+		}
+
+		if (best < rkfs_sb_count)
+			return best;
+	}
+
+	for (i = 0; i < rkfs_sb_count; i++) {
+		index = (parent + i) % rkfs_sb_count;
+		if (rkfs_gi[index].g_free_inodes && rkfs_gi[index].g_free_blocks)
+			return index;
+	}
+
+	return parent;
+}
+
 int rkfs_new_inode(struct inode *vfs_pinode, int mode,
 		   struct inode **vfs_cinode)
 {
 	struct super_block *vfs_sb = NULL;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
-	unsigned short i = 0, blkno = 0, bit = 0, itable_index = 0;
-	unsigned short rkfs_sb_count = 0, rkfs_sb_index = 0;
-	unsigned short fi_found = 0;
-	unsigned long cino = 0;
+	struct rkfs_group_info *rkfs_gi = NULL;
+	struct rkfs_inode_info *rkfs_ii = NULL;
+	unsigned short bit = 0, itable_index = 0;
+	unsigned short rkfs_sb_count = 0, rkfs_sb_index = 0, size = 0;
+	unsigned short fi_found = 0, pass = 0;
+	unsigned long cino = 0, blkno = 0;
 	int err = -EIO;
 
 	rkfs_debug("New inode requested...\n");
@@ -150,106 +209,135 @@ int rkfs_new_inode(struct inode *vfs_pinode, int mode,
 		goto out;
 	}
 
-	lock_super(vfs_sb);
-
 	if (!(*vfs_cinode = new_inode(vfs_sb))) {
 		rkfs_debug("Can't create new empty VFS inode\n");
 		err = -ENOSPC;
-		goto unlock_and_out;
+		goto out;
 	}
 
 	err = -EIO;
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = vfs_pinode->i_ino / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, vfs_pinode->i_ino);
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
 		rkfs_bug("Parent inode %ld is bad (invalid %s sb index)\n",
 			 vfs_pinode->i_ino, RKFS_NAME);
-		goto put_unlock_and_out;
+		goto put_and_out;
 	}
 
-	while (1) {
+	if (!(bh = vfs_sb->u.rkfs_sb.s_sbh[rkfs_sb_index])) {
+		rkfs_bug("%s superblock not in memory\n", RKFS_NAME);
+		goto put_and_out;
+	}
+
+	rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+	bit = rkfs_inode_bit(vfs_sb, vfs_pinode->i_ino);
+	itable_index = bit / rkfs_inodes_per_block(vfs_sb);
+	if (!rkfs_itable_block(vfs_sb, rkfs_gi, itable_index)) {
+		rkfs_bug("Parent inode %ld (bit %d) is bad (no inode blk)\n",
+			 vfs_pinode->i_ino, bit);
+		goto put_and_out;
+	}
+
+	/*
+	 * Start in the group the policy picked and take the first group,
+	 * from there on, that really has a free inode.
+	 *
+	 * The inode bit is claimed, and its inode table slot counted,
+	 * under the group lock. That keeps the table block from being
+	 * freed under us while a new one is allocated without the lock.
+	 */
+	rkfs_sb_index = rkfs_find_group(vfs_sb, vfs_pinode, mode);
+	for (pass = 0; pass < rkfs_sb_count; pass++) {
 		if (!(bh = vfs_sb->u.rkfs_sb.s_sbh[rkfs_sb_index])) {
 			rkfs_bug("%s superblock not in memory\n", RKFS_NAME);
-			goto put_unlock_and_out;
+			goto put_and_out;
 		}
 
 		rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
 		if (rkfs_dsb->s_fsid != RKFS_ID) {
 			rkfs_bug("No valid %s superblock found\n", RKFS_NAME);
-			goto put_unlock_and_out;
+			goto put_and_out;
 		}
 
-		if (!i) {
-			bit = vfs_pinode->i_ino % RKFS_MIN_BLOCKS;
-			itable_index = bit / RKFS_INODES_PER_BLOCK;
-			if (!(blkno = rkfs_dsb->s_itable_map[itable_index][0])) {
-				rkfs_bug
-				    ("Parent inode %ld (bit %d) is bad (no inode blk)\n",
-				     vfs_pinode->i_ino, bit);
-				goto put_unlock_and_out;
+		/*
+		 * Full groups are skipped without scanning their map.
+		 */
+		rkfs_gi = &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index];
+		if (rkfs_gi->g_free_inodes) {
+			size = rkfs_gi->g_inodes;
+			spin_lock(&rkfs_gi->g_lock);
+			bit = rkfs_find_first_zero_bit(rkfs_gi->g_inode_map,
+						       size);
+			if (bit < size &&
+			    bit >= (rkfs_sb_index ? 1 : RKFS_FIRST_INODE)) {
+				rkfs_set_bit(bit, rkfs_gi->g_inode_map);
+				rkfs_gi->g_free_inodes--;
+				itable_index = bit /
+				    rkfs_inodes_per_block(vfs_sb);
+				*rkfs_itable_count(vfs_sb, rkfs_gi,
+						   itable_index) += 1;
+				blkno = rkfs_itable_block(vfs_sb, rkfs_gi,
+							  itable_index);
+				fi_found = 1;
 			}
+			spin_unlock(&rkfs_gi->g_lock);
+			if (fi_found)
+				break;
 		}
 
-		bit = rkfs_find_first_zero_bit(rkfs_dsb->s_inode_map,
-					       RKFS_MIN_BLOCKS);
-
-		if (rkfs_sb_index && bit > 0 && bit < RKFS_MIN_BLOCKS) {
-			fi_found = 1;
-			break;
-		}
-
-		if (!rkfs_sb_index && bit >= RKFS_FIRST_INODE &&
-		    bit < RKFS_MIN_BLOCKS) {
-			fi_found = 1;
-			break;
-		}
-
-		if (!i) {
+		if (++rkfs_sb_index >= rkfs_sb_count)
 			rkfs_sb_index = 0;
-			i++;
-		} else
-			rkfs_sb_index++;
-
-		if (rkfs_sb_index >= rkfs_sb_count)
-			break;
 	}
 
 	if (!fi_found) {
 		rkfs_debug("No free inode found in the device %s\n",
 			   bdevname(vfs_pinode->i_dev));
 		err = -ENOSPC;
-		goto put_unlock_and_out;
+		goto put_and_out;
 	}
 
-	itable_index = bit / RKFS_INODES_PER_BLOCK;
-	if (!(blkno = rkfs_dsb->s_itable_map[itable_index][0])) {
+	percpu_counter_dec(&vfs_sb->u.rkfs_sb.s_freeinodes_counter);
+	cino = bit + rkfs_group_first_inode(vfs_sb, rkfs_sb_index);
+	rkfs_debug("Inode count at index: %d is %d\n", itable_index,
+		   *rkfs_itable_count(vfs_sb, rkfs_gi, itable_index));
+
+	if (!blkno) {
+		/*
+		 * Inode tables go after the packed metadata of the flex
+		 * group, next to those of the other groups in it.
+		 */
 		rkfs_debug("Allocating new inode block...\n");
-		err = rkfs_new_inode_block(vfs_pinode, &blkno);
+		err = rkfs_new_inode_block(vfs_pinode,
+					   rkfs_group_first_block(vfs_sb,
+					   rkfs_flex_first_group(vfs_sb,
+								 rkfs_sb_index)),
+					   &blkno);
 		if (err) {
 			rkfs_debug("Can't get new inode block\n");
-			goto put_unlock_and_out;
+			goto release_and_out;
 		}
-		rkfs_dsb->s_itable_map[itable_index][0] = blkno;
-	}
-
-	cino = bit + (rkfs_sb_index * RKFS_MIN_BLOCKS);
-	if (rkfs_set_bit(bit, rkfs_dsb->s_inode_map)) {
-		rkfs_bug("New inode %ld (bit %d) is already in use\n", cino,
-			 bit);
-		err = -EIO;
-		goto put_unlock_and_out;
-	}
 
-	rkfs_dsb->s_itable_map[itable_index][1] += 1;
-	rkfs_debug("Inode count at index: %d is %d\n", itable_index,
-		   rkfs_dsb->s_itable_map[itable_index][1]);
+		/*
+		 * Another new inode in the same slot may have beaten us
+		 * to it, in which case our block goes back.
+		 */
+		spin_lock(&rkfs_gi->g_lock);
+		if (!rkfs_itable_block(vfs_sb, rkfs_gi, itable_index)) {
+			rkfs_set_itable_block(vfs_sb, rkfs_gi, itable_index,
+					      blkno);
+			blkno = 0;
+		}
+		spin_unlock(&rkfs_gi->g_lock);
 
-	mark_buffer_dirty(bh);
-	if (vfs_sb->s_flags & MS_SYNCHRONOUS) {
-		ll_rw_block(WRITE, 1, &bh);
-		wait_on_buffer(bh);
+		if (blkno)
+			rkfs_free_inode_block(vfs_sb, blkno);
 	}
 
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_imap_bh);
+	rkfs_mark_group_dirty(vfs_sb, rkfs_sb_index, rkfs_gi->g_itmap_bh);
+	if (vfs_sb->s_flags & MS_SYNCHRONOUS)
+		rkfs_sync_group(vfs_sb, rkfs_sb_index);
+
 	(*vfs_cinode)->i_ino = cino;
 	(*vfs_cinode)->i_uid = current->fsuid;
 	(*vfs_cinode)->i_gid = (vfs_pinode->i_mode & S_ISGID) ?
@@ -262,21 +350,44 @@ int rkfs_new_inode(struct inode *vfs_pinode, int mode,
 	(*vfs_cinode)->i_blocks = 0;
 	(*vfs_cinode)->i_blksize = PAGE_SIZE;
 
-	for (i = 0; i < RKFS_N_BLOCKS; i++)
-		(*vfs_cinode)->u.rkfs_i.i_block[i] = 0;
+	rkfs_ii = RKFS_I(*vfs_cinode);
+	memset(rkfs_ii->i_data, 0, sizeof(rkfs_ii->i_data));
+	rkfs_ii->i_prealloc_block = 0;
+	rkfs_ii->i_prealloc_count = 0;
+	rkfs_ii->i_da_start = 0;
+	rkfs_ii->i_da_len = 0;
+	rkfs_ii->i_da_blocks = 0;
+	rkfs_ii->i_da_meta = 0;
+	rkfs_ii->i_map_len = 0;
+	rkfs_ii->i_inline = S_ISREG(mode) && rkfs_has_inline(vfs_sb);
+	rkfs_ii->i_extents = 0;
+	if (S_ISREG(mode) && rkfs_has_extents(vfs_sb) && !rkfs_ii->i_inline)
+		rkfs_ext_init(*vfs_cinode);
 
 	insert_inode_hash(*vfs_cinode);
 	mark_inode_dirty(*vfs_cinode);
 
-	unlock_super(vfs_sb);
 	rkfs_debug("New inode is: %ld\n", (*vfs_cinode)->i_ino);
 	return 0;
 
- put_unlock_and_out:
-	iput(*vfs_cinode);
+ release_and_out:
+	spin_lock(&rkfs_gi->g_lock);
+	rkfs_clear_bit(bit, rkfs_gi->g_inode_map);
+	rkfs_gi->g_free_inodes++;
+	blkno = 0;
+	if (!(*rkfs_itable_count(vfs_sb, rkfs_gi, itable_index) -= 1)) {
+		blkno = rkfs_itable_block(vfs_sb, rkfs_gi, itable_index);
+		rkfs_set_itable_block(vfs_sb, rkfs_gi, itable_index, 0);
+	}
+	spin_unlock(&rkfs_gi->g_lock);
 
- unlock_and_out:
-	unlock_super(vfs_sb);
+	percpu_counter_inc(&vfs_sb->u.rkfs_sb.s_freeinodes_counter);
+	if (blkno)
+		rkfs_free_inode_block(vfs_sb, blkno);
+
+ put_and_out:
+	iput(*vfs_cinode);
+	*vfs_cinode = NULL;
 
  out:
 	FAILED;
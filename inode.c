@@ -12,7 +12,6 @@
 
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
-#include <linux/smp_lock.h>
 #include <linux/sched.h>
 #include <linux/highuid.h>
 #include <linux/quotaops.h>
@@ -24,15 +23,46 @@ MODULE_AUTHOR("R.K.Raja");
 MODULE_DESCRIPTION("RK Floppy Filesystem");
 MODULE_LICENSE("GPL");
 
+/*
+* Start reading the inode table block of inode 'ino' without waiting
+* for it, unless it is 'last', the block of the previous call. Returns
+* the block, 0 if the inode has none.
+*/
+unsigned long rkfs_inode_readahead(struct super_block *vfs_sb,
+				   unsigned long ino, unsigned long last)
+{
+	unsigned long rkfs_sb_index = 0, itable_index = 0, blkno = 0;
+
+	if (ino < RKFS_ROOT_INO)
+		return 0;
+
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, ino);
+	itable_index = rkfs_inode_bit(vfs_sb, ino) /
+	    rkfs_inodes_per_block(vfs_sb);
+	if (rkfs_sb_index >= vfs_sb->u.rkfs_sb.s_sb_count ||
+	    itable_index >= vfs_sb->u.rkfs_sb.s_itable_entries)
+		return 0;
+
+	blkno = rkfs_itable_block(vfs_sb,
+				  &vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index],
+				  itable_index);
+	if (blkno && blkno != last)
+		sb_breadahead(vfs_sb, blkno);
+
+	return blkno;
+}
+
 void rkfs_read_inode(struct inode *vfs_inode)
 {
 	struct super_block *vfs_sb = NULL;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
 	struct rkfs_inode *rkfs_dinode = NULL;
+	struct rkfs_inode32 *rkfs_dinode32 = NULL;
 	char *ptr = NULL;
-	unsigned short rkfs_sb_index = 0, rkfs_sb_count = 0, blkno = 0;
+	unsigned short rkfs_sb_index = 0, rkfs_sb_count = 0;
 	unsigned short itable_index = 0, offset = 0, bit = 0;
+	unsigned long blkno = 0;
 
 	if (!vfs_inode) {
 		rkfs_bug("VFS inode is NULL\n");
@@ -53,7 +83,7 @@ void rkfs_read_inode(struct inode *vfs_inode)
 	}
 
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = vfs_inode->i_ino / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, vfs_inode->i_ino);
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
 		rkfs_bug("Inode %ld is bad (invalid %s sb index)\n",
 			 vfs_inode->i_ino, RKFS_NAME);
@@ -71,29 +101,40 @@ void rkfs_read_inode(struct inode *vfs_inode)
 		goto out;
 	}
 
-	bit = vfs_inode->i_ino % RKFS_MIN_BLOCKS;
-	itable_index = bit / RKFS_INODES_PER_BLOCK;
-	if (itable_index > (RKFS_INODE_TABLES_MAP_SIZE - 1)) {
+	bit = rkfs_inode_bit(vfs_sb, vfs_inode->i_ino);
+	itable_index = bit / rkfs_inodes_per_block(vfs_sb);
+	if (itable_index >= vfs_sb->u.rkfs_sb.s_itable_entries) {
 		rkfs_bug("Inode %ld (bit %d) is bad  (invalid itable index)\n",
 			 vfs_inode->i_ino, bit);
 		goto out;
 	}
 
-	if (!(blkno = rkfs_dsb->s_itable_map[itable_index][0])) {
+	if (!(blkno = rkfs_itable_block(vfs_sb,
+					&vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index],
+					itable_index))) {
 		rkfs_bug("Inode %ld (bit %d) is bad (no inode block)\n",
 			 vfs_inode->i_ino, bit);
 		goto out;
 	}
 
 	if (!(bh = bread(vfs_inode->i_dev, blkno, vfs_sb->s_blocksize))) {
-		rkfs_printk("Unable to read block %d from device %s\n", blkno,
+		rkfs_printk("Unable to read block %lu from device %s\n", blkno,
 			    bdevname(vfs_inode->i_dev));
 		goto out;
 	}
 
-	offset = bit % RKFS_INODES_PER_BLOCK;
-	ptr = (char *)bh->b_data + (offset * RKFS_INODE_SIZE);
+	offset = bit % rkfs_inodes_per_block(vfs_sb);
+
+	/*
+	 * Inodes allocated together are read together: get the next
+	 * inode table block on its way as well.
+	 */
+	rkfs_inode_readahead(vfs_sb, vfs_inode->i_ino +
+			     rkfs_inodes_per_block(vfs_sb) - offset, blkno);
+
+	ptr = (char *)bh->b_data + (offset * rkfs_inode_size(vfs_sb));
 	rkfs_dinode = (struct rkfs_inode *)ptr;
+	rkfs_dinode32 = (struct rkfs_inode32 *)ptr;
 
 	vfs_inode->i_mode = rkfs_dinode->i_mode;
 	vfs_inode->i_nlink = rkfs_dinode->i_links_count;
@@ -104,16 +145,45 @@ void rkfs_read_inode(struct inode *vfs_inode)
 	vfs_inode->i_mtime = rkfs_dinode->i_time;
 	vfs_inode->i_ctime = rkfs_dinode->i_time;
 	vfs_inode->i_blksize = PAGE_SIZE;
-	vfs_inode->i_blocks = rkfs_dinode->i_blocks;
-	for (blkno = 0; blkno < RKFS_N_BLOCKS; blkno++)
-		vfs_inode->u.rkfs_i.i_block[blkno] =
-		    rkfs_dinode->i_block[blkno];
+	memset(RKFS_I(vfs_inode)->i_data, 0, sizeof(RKFS_I(vfs_inode)->i_data));
+	if (rkfs_is_32bit(vfs_sb)) {
+		vfs_inode->i_blocks = rkfs_dinode32->i_blocks;
+		memcpy(RKFS_I(vfs_inode)->i_data, rkfs_dinode32->i_block,
+		       sizeof(rkfs_dinode32->i_block));
+	} else {
+		vfs_inode->i_blocks = rkfs_dinode->i_blocks;
+		memcpy(RKFS_I(vfs_inode)->i_data, rkfs_dinode->i_block,
+		       sizeof(rkfs_dinode->i_block));
+	}
+	RKFS_I(vfs_inode)->i_prealloc_block = 0;
+	RKFS_I(vfs_inode)->i_prealloc_count = 0;
+	RKFS_I(vfs_inode)->i_da_start = 0;
+	RKFS_I(vfs_inode)->i_da_len = 0;
+	RKFS_I(vfs_inode)->i_da_blocks = 0;
+	RKFS_I(vfs_inode)->i_da_meta = 0;
+	RKFS_I(vfs_inode)->i_map_len = 0;
+
+	/*
+	 * The magic only marks inline data on disk, i_inline in core.
+	 */
+	RKFS_I(vfs_inode)->i_inline = 0;
+	ptr = rkfs_ptr_at(vfs_sb, RKFS_I(vfs_inode)->i_data,
+			  rkfs_n_blocks(vfs_sb) - 1);
+	if (rkfs_has_inline(vfs_sb) && !vfs_inode->i_blocks &&
+	    rkfs_get_ptr(vfs_sb, ptr) == RKFS_INLINE_MAGIC) {
+		RKFS_I(vfs_inode)->i_inline = 1;
+		rkfs_set_ptr(vfs_sb, ptr, 0);
+	}
+	RKFS_I(vfs_inode)->i_extents = !RKFS_I(vfs_inode)->i_inline &&
+	    rkfs_has_extents(vfs_sb) &&
+	    ((struct rkfs_extent_header *)RKFS_I(vfs_inode)->i_data)->eh_magic ==
+	    RKFS_EXT_MAGIC;
 
 	if (S_ISREG(vfs_inode->i_mode)) {
 		rkfs_debug("Inode: %ld is a file\n", vfs_inode->i_ino);
 		vfs_inode->i_op = &rkfs_file_inode_operations;
 		vfs_inode->i_fop = &rkfs_file_operations;
-		vfs_inode->i_mapping->a_ops = &rkfs_aops;
+		vfs_inode->i_mapping->a_ops = rkfs_file_aops(vfs_sb);
 	} else if (S_ISDIR(vfs_inode->i_mode)) {
 		rkfs_debug("Inode: %ld is a directory\n", vfs_inode->i_ino);
 		vfs_inode->i_op = &rkfs_dir_inode_operations;
@@ -121,12 +191,15 @@ void rkfs_read_inode(struct inode *vfs_inode)
 		vfs_inode->i_mapping->a_ops = &rkfs_aops;
 	} else if (S_ISLNK(vfs_inode->i_mode)) {
 		rkfs_debug("Inode: %ld is a link\n", vfs_inode->i_ino);
-		vfs_inode->i_op = &page_symlink_inode_operations;
+		vfs_inode->i_op = RKFS_I(vfs_inode)->i_inline ?
+		    &rkfs_fast_symlink_inode_operations :
+		    &page_symlink_inode_operations;
 		vfs_inode->i_mapping->a_ops = &rkfs_aops;
 	} else {
 		rkfs_debug("Inode: %ld is a special file\n", vfs_inode->i_ino);
 		init_special_inode(vfs_inode, vfs_inode->i_mode,
-				   rkfs_dinode->i_block[0]);
+				   rkfs_get_ptr(vfs_sb,
+						RKFS_I(vfs_inode)->i_data));
 	}
 
 	brelse(bh);
@@ -141,15 +214,23 @@ void rkfs_read_inode(struct inode *vfs_inode)
 	return;
 }
 
+/*
+* Copy the inode into its inode table block. Only a sync update writes
+* the block out and waits; otherwise it is left dirty for the normal
+* buffer writeback, which then writes all the inodes of a table block
+* with one I/O.
+*/
 int rkfs_update_inode(struct inode *vfs_inode, int sync)
 {
 	struct super_block *vfs_sb = NULL;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
 	struct rkfs_inode *rkfs_dinode = NULL;
+	struct rkfs_inode32 *rkfs_dinode32 = NULL;
 	char *ptr = NULL;
-	unsigned short rkfs_sb_index = 0, rkfs_sb_count = 0, blkno = 0;
+	unsigned short rkfs_sb_index = 0, rkfs_sb_count = 0;
 	unsigned short itable_index = 0, offset = 0, bit = 0;
+	unsigned long blkno = 0;
 	int err = -EIO;
 
 	if (!vfs_inode) {
@@ -171,7 +252,7 @@ int rkfs_update_inode(struct inode *vfs_inode, int sync)
 	}
 
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = vfs_inode->i_ino / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, vfs_inode->i_ino);
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
 		rkfs_bug("Inode %ld is bad (invalid %s sb index)\n",
 			 vfs_inode->i_ino, RKFS_NAME);
@@ -189,56 +270,89 @@ int rkfs_update_inode(struct inode *vfs_inode, int sync)
 		goto out;
 	}
 
-	bit = vfs_inode->i_ino % RKFS_MIN_BLOCKS;
-	itable_index = bit / RKFS_INODES_PER_BLOCK;
-	if (itable_index > (RKFS_INODE_TABLES_MAP_SIZE - 1)) {
+	bit = rkfs_inode_bit(vfs_sb, vfs_inode->i_ino);
+	itable_index = bit / rkfs_inodes_per_block(vfs_sb);
+	if (itable_index >= vfs_sb->u.rkfs_sb.s_itable_entries) {
 		rkfs_bug("Inode %ld (bit %d) is bad  (invalid itable index)\n",
 			 vfs_inode->i_ino, bit);
 		goto out;
 	}
 
-	if (!(blkno = rkfs_dsb->s_itable_map[itable_index][0])) {
+	if (!(blkno = rkfs_itable_block(vfs_sb,
+					&vfs_sb->u.rkfs_sb.s_groups[rkfs_sb_index],
+					itable_index))) {
 		rkfs_bug("Inode %ld (bit %d) is bad (no inode block)\n",
 			 vfs_inode->i_ino, bit);
 		goto out;
 	}
 
 	if (!(bh = bread(vfs_inode->i_dev, blkno, vfs_sb->s_blocksize))) {
-		rkfs_printk("Unable to read block %d from device %s\n", blkno,
+		rkfs_printk("Unable to read block %lu from device %s\n", blkno,
 			    bdevname(vfs_inode->i_dev));
 		err = -EIO;
 		goto out;
 	}
 
-	offset = bit % RKFS_INODES_PER_BLOCK;
-	ptr = (char *)bh->b_data + (offset * RKFS_INODE_SIZE);
+	offset = bit % rkfs_inodes_per_block(vfs_sb);
+	ptr = (char *)bh->b_data + (offset * rkfs_inode_size(vfs_sb));
 	rkfs_dinode = (struct rkfs_inode *)ptr;
+	rkfs_dinode32 = (struct rkfs_inode32 *)ptr;
 
+	/*
+	 * Allocation and truncate change i_data under i_map_sem held
+	 * exclusive; shared, the copy below sees a consistent block map.
+	 */
+	down_read(&RKFS_I(vfs_inode)->i_map_sem);
 	rkfs_dinode->i_mode = vfs_inode->i_mode;
 	rkfs_dinode->i_links_count = vfs_inode->i_nlink;
 	rkfs_dinode->i_uid = vfs_inode->i_uid;
 	rkfs_dinode->i_gid = vfs_inode->i_gid;
 	rkfs_dinode->i_size = vfs_inode->i_size;
 	rkfs_dinode->i_time = vfs_inode->i_mtime;
-	rkfs_dinode->i_blocks = vfs_inode->i_blocks;
 	if (S_ISCHR(vfs_inode->i_mode) || S_ISBLK(vfs_inode->i_mode))
-		rkfs_dinode->i_block[0] = kdev_t_to_nr(vfs_inode->i_rdev);
-	else
-		for (blkno = 0; blkno < RKFS_N_BLOCKS; blkno++)
-			rkfs_dinode->i_block[blkno] =
-			    vfs_inode->u.rkfs_i.i_block[blkno];
+		rkfs_set_ptr(vfs_sb, RKFS_I(vfs_inode)->i_data,
+			     kdev_t_to_nr(vfs_inode->i_rdev));
+	if (rkfs_is_32bit(vfs_sb)) {
+		rkfs_dinode32->i_blocks = vfs_inode->i_blocks;
+		memcpy(rkfs_dinode32->i_block, RKFS_I(vfs_inode)->i_data,
+		       sizeof(rkfs_dinode32->i_block));
+		if (RKFS_I(vfs_inode)->i_inline)
+			rkfs_dinode32->i_block[RKFS_N_BLOCKS32 - 1] =
+			    RKFS_INLINE_MAGIC;
+	} else {
+		rkfs_dinode->i_blocks = vfs_inode->i_blocks;
+		memcpy(rkfs_dinode->i_block, RKFS_I(vfs_inode)->i_data,
+		       sizeof(rkfs_dinode->i_block));
+		if (RKFS_I(vfs_inode)->i_inline)
+			rkfs_dinode->i_block[RKFS_N_BLOCKS - 1] =
+			    RKFS_INLINE_MAGIC;
+	}
+	up_read(&RKFS_I(vfs_inode)->i_map_sem);
 
 	/*
 	   rkfs_dump_rkfs_inode(rkfs_dinode,"%s: Dumping %s inode (after)...", \
 	   __FUNCTION__,RKFS_NAME);
 	 */
 
-	mark_buffer_dirty(bh);
-	ll_rw_block(WRITE, 1, &bh);
-	wait_on_buffer(bh);
+	/*
+	 * On the inode's buffer list, so that fsync finds the table block
+	 * even once write_inode has left the inode clean.
+	 */
+	err = 0;
+	mark_buffer_dirty_inode(bh, vfs_inode);
+	if (sync) {
+		ll_rw_block(WRITE, 1, &bh);
+		wait_on_buffer(bh);
+		if (buffer_req(bh) && !buffer_uptodate(bh)) {
+			rkfs_printk("I/O error syncing inode %ld on device "
+				    "%s\n", vfs_inode->i_ino,
+				    bdevname(vfs_inode->i_dev));
+			err = -EIO;
+		}
+	}
 
 	brelse(bh);
-	return 0;
+	return err;
 
  out:
 	FAILED;
@@ -254,16 +368,32 @@ void rkfs_write_inode(struct inode *vfs_inode, int sync)
 
 	rkfs_debug("Writing inode: %ld\n", vfs_inode->i_ino);
 
-	lock_kernel();
 	rkfs_update_inode(vfs_inode, sync);
-	unlock_kernel();
+}
+
+/*
+* Writeback after the last close may have opened a new preallocation
+* window; make sure it does not outlive the in-core inode.
+*/
+void rkfs_put_inode(struct inode *vfs_inode)
+{
+	if (!vfs_inode) {
+		rkfs_bug("VFS inode is NULL\n");
+		return;
+	}
+
+	if (atomic_read(&vfs_inode->i_count) != 1)
+		return;
+
+	rkfs_discard_prealloc(vfs_inode);
 }
 
 void rkfs_delete_inode(struct inode *vfs_inode)
 {
 	unsigned short rkfs_sb_count = 0, rkfs_sb_index = 0, bit = 0;
 	struct super_block *vfs_sb = NULL;
-	unsigned short icount = 0, iblkno = 0;
+	unsigned short icount = 0;
+	unsigned long iblkno = 0;
 
 	if (!vfs_inode) {
 		rkfs_bug("VFS inode is NULL\n");
@@ -272,8 +402,6 @@ void rkfs_delete_inode(struct inode *vfs_inode)
 
 	rkfs_debug("Deleting inode: %ld\n", vfs_inode->i_ino);
 
-	lock_kernel();
-
 	if (is_bad_inode(vfs_inode)) {
 		rkfs_debug("Can't delete bad inode\n");
 		goto no_delete;
@@ -285,14 +413,14 @@ void rkfs_delete_inode(struct inode *vfs_inode)
 	}
 
 	rkfs_sb_count = vfs_sb->u.rkfs_sb.s_sb_count;
-	rkfs_sb_index = vfs_inode->i_ino / RKFS_MIN_BLOCKS;
+	rkfs_sb_index = rkfs_inode_group(vfs_sb, vfs_inode->i_ino);
 	if (rkfs_sb_index > (rkfs_sb_count - 1)) {
 		rkfs_bug("Inode %ld is bad (invalid %s sb index)\n",
 			 vfs_inode->i_ino, RKFS_NAME);
 		goto no_delete;
 	}
 
-	bit = vfs_inode->i_ino % RKFS_MIN_BLOCKS;
+	bit = rkfs_inode_bit(vfs_sb, vfs_inode->i_ino);
 	if (rkfs_sb_index) {
 		if (bit == 0) {
 			rkfs_bug
@@ -312,6 +440,8 @@ void rkfs_delete_inode(struct inode *vfs_inode)
 	rkfs_debug("Delete inode: %ld (bit: %d)\n", vfs_inode->i_ino, bit);
 	vfs_inode->i_size = 0;
 
+	rkfs_discard_prealloc(vfs_inode);
+
 	if (vfs_inode->i_blocks)
 		rkfs_truncate(vfs_inode);
 
@@ -320,11 +450,9 @@ void rkfs_delete_inode(struct inode *vfs_inode)
 	if (!icount)
 		rkfs_free_inode_block(vfs_sb, iblkno);
 
-	unlock_kernel();
 	return;
 
  no_delete:
-	unlock_kernel();
 	clear_inode(vfs_inode);
 
  no_inode:
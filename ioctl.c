@@ -0,0 +1,67 @@
+/*
+*
+* ioctl.c
+*
+* R.K.Raja
+* (rajkanna_hcl@yahoo.com, rajark_hcl@yahoo.co.in)
+*
+* (C) Copyright 2002, 2003.
+* All rights reserved.
+*
+*/
+
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+#include <linux/string.h>
+#include <asm/uaccess.h>
+
+#include <rkfs.h>
+
+int rkfs_ioctl(struct inode *vfs_inode, struct file *filp, unsigned int cmd,
+	       unsigned long arg)
+{
+	struct super_block *vfs_sb = vfs_inode->i_sb;
+	struct fstrim_range range;
+	struct rkfs_stats stats;
+	int err = 0;
+
+	rkfs_debug("Inode %ld, cmd 0x%x\n", vfs_inode->i_ino, cmd);
+
+	switch (cmd) {
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		if (copy_from_user(&range, (struct fstrim_range *)arg,
+				   sizeof(range)))
+			return -EFAULT;
+
+		if ((err = rkfs_trim_fs(vfs_sb, &range)))
+			return err;
+
+		if (copy_to_user((struct fstrim_range *)arg, &range,
+				 sizeof(range)))
+			return -EFAULT;
+		return 0;
+
+	case RKFS_IOC_GETSTATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.st_alloc_calls =
+		    atomic_read(&vfs_sb->u.rkfs_sb.s_alloc_calls);
+		stats.st_alloc_groups =
+		    atomic_read(&vfs_sb->u.rkfs_sb.s_alloc_groups);
+		stats.st_alloc_bits = atomic_read(&vfs_sb->u.rkfs_sb.s_alloc_bits);
+		stats.st_map_lookups =
+		    atomic_read(&vfs_sb->u.rkfs_sb.s_map_lookups);
+		stats.st_map_hits = atomic_read(&vfs_sb->u.rkfs_sb.s_map_hits);
+
+		if (copy_to_user((struct rkfs_stats *)arg, &stats,
+				 sizeof(stats)))
+			return -EFAULT;
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
@@ -11,34 +11,35 @@
 */
 
 #include <linux/fs.h>
-#include <linux/smp_lock.h>
 
 #include <rkfs.h>
 
 /*
 * A confusing data-structure for inode tree used by rkfs_get_block,
 * which is parent for address space operations :-)
+*
+* 'p' points at a block pointer in the on-disk width of the filesystem
+* (see rkfs_get_ptr), 'key' holds its value.
 */
-typedef __u16 block_t;
-
 typedef struct Indirect {
-	block_t *p;
-	block_t key;
+	void *p;
+	unsigned long key;
 	struct buffer_head *bh;
 } Indirect;
 
-#define DEPTH 3
-#define DIRECT 39
+#define DEPTH 4			//Triple indirect, 32-bit block numbers only
 
-inline void rkfs_add_chain(Indirect * p, struct buffer_head *bh, block_t * v)
+inline void rkfs_add_chain(struct super_block *sb, Indirect * p,
+			   struct buffer_head *bh, void *v)
 {
-	p->key = *(p->p = v);
+	p->key = rkfs_get_ptr(sb, (p->p = v));
 	p->bh = bh;
 }
 
-inline int rkfs_verify_chain(Indirect * from, Indirect * to)
+inline int rkfs_verify_chain(struct super_block *sb, Indirect * from,
+			     Indirect * to)
 {
-	while ((from <= to) && (from->key == *from->p))
+	while ((from <= to) && (from->key == rkfs_get_ptr(sb, from->p)))
 		from++;
 
 	return ((from > to));
@@ -49,26 +50,29 @@ inline Indirect *rkfs_get_branch(struct inode * vfs_inode,
 				 int *offsets, Indirect chain[DEPTH], int *err)
 {
 	kdev_t dev = vfs_inode->i_dev;
+	struct super_block *sb = vfs_inode->i_sb;
 	Indirect *p = chain;
 	struct buffer_head *bh;
 
 	*err = 0;
 
-	rkfs_add_chain(chain, NULL, vfs_inode->u.rkfs_i.i_block + (*offsets));
+	rkfs_add_chain(sb, chain, NULL,
+		       rkfs_ptr_at(sb, RKFS_I(vfs_inode)->i_data, *offsets));
 	if (!p->key)
 		goto no_block;
 
 	while (--depth) {
-		if (!(bh = bread(dev, p->key, RKFS_BLOCK_SIZE))) {
-			rkfs_debug("Failed to read block %d (bread failed)\n",
+		if (!(bh = bread(dev, p->key, sb->s_blocksize))) {
+			rkfs_debug("Failed to read block %lu (bread failed)\n",
 				   p->key);
 			goto failure;
 		}
 
-		if (!rkfs_verify_chain(chain, p))
+		if (!rkfs_verify_chain(sb, chain, p))
 			goto changed;
 
-		rkfs_add_chain(++p, bh, (block_t *) bh->b_data + (*++offsets));
+		rkfs_add_chain(sb, ++p, bh,
+			       rkfs_ptr_at(sb, bh->b_data, *++offsets));
 		if (!p->key)
 			goto no_block;
 	}
@@ -86,63 +90,171 @@ inline Indirect *rkfs_get_branch(struct inode * vfs_inode,
 	return p;
 }
 
-int rkfs_alloc_branch(struct inode *vfs_inode,
-		      int num, int *offsets, Indirect * branch)
+/*
+* Find a goal for the block missing at 'partial': the block right after
+* the nearest mapped block before it in the same array, else the block
+* right after the indirect block holding the array, else the start of
+* the inode's own group.
+*/
+unsigned long rkfs_find_goal(struct inode *vfs_inode, Indirect * partial)
 {
-	int n = 0, i = 0, err = 0;
-	unsigned short parent = 0, nr = 0;
-	struct buffer_head *bh = NULL;
+	struct super_block *sb = vfs_inode->i_sb;
+	int size = rkfs_ptr_size(sb);
+	char *start = NULL, *p = NULL;
 
-	err = rkfs_new_block(vfs_inode, &parent);
-	if (err)
-		return err;
+	if (partial->bh)
+		start = partial->bh->b_data;
+	else
+		start = (char *)RKFS_I(vfs_inode)->i_data;
+
+	for (p = (char *)partial->p - size; p >= start; p -= size)
+		if (rkfs_get_ptr(sb, p))
+			return rkfs_get_ptr(sb, p) + 1;
+
+	if (partial->bh)
+		return partial->bh->b_blocknr + 1;
+
+	return rkfs_group_first_block(sb, rkfs_inode_group(sb,
+							   vfs_inode->i_ino));
+}
+
+/*
+* End of the block array the last level of a chain points into: the
+* direct blocks of the inode or a whole indirect block.
+*/
+inline char *rkfs_array_end(struct inode *vfs_inode, Indirect * last)
+{
+	struct super_block *sb = vfs_inode->i_sb;
 
-	branch[0].key = parent;
-	for (n = 1; n < num; n++) {
-		err = rkfs_new_block(vfs_inode, &nr);
+	if (!last->bh)
+		return rkfs_ptr_at(sb, RKFS_I(vfs_inode)->i_data,
+				   rkfs_n_direct(sb));
+
+	return last->bh->b_data + sb->s_blocksize;
+}
+
+/*
+* Number of blocks mapped contiguously on disk from 'last' on, at most
+* 'maxblocks' and never beyond the end of its block array.
+*/
+int rkfs_count_mapped(struct inode *vfs_inode, Indirect * last, int maxblocks)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	char *end = rkfs_array_end(vfs_inode, last);
+	int count = 1;
+
+	while ((count < maxblocks) &&
+	       ((char *)rkfs_ptr_at(sb, last->p, count) < end) &&
+	       (rkfs_get_ptr(sb, rkfs_ptr_at(sb, last->p, count)) ==
+		last->key + count))
+		count++;
+
+	return count;
+}
+
+/*
+* Allocate 'indirect_blks' indirect blocks followed by up to 'blks'
+* data blocks, asking the allocator for the whole lot in one go so
+* that they land contiguously (indirect block first, then its data).
+* On success the block numbers go to 'new_blocks' (the data blocks
+* are contiguous from new_blocks[indirect_blks]) and the number of
+* data blocks is returned. 'claim' as for rkfs__new_blocks.
+*/
+int rkfs_alloc_blocks(struct inode *vfs_inode, unsigned long goal,
+		      int indirect_blks, int blks,
+		      unsigned long new_blocks[DEPTH], unsigned long *claim)
+{
+	int target = 0, index = 0, i = 0, err = 0;
+	unsigned long blkno = 0;
+	unsigned short count = 0;
+
+	target = indirect_blks + blks;
+	while (1) {
+		err = rkfs_new_blocks(vfs_inode, goal, target, &blkno, &count,
+				      claim);
 		if (err)
+			goto failed;
+
+		target -= count;
+		while (index < indirect_blks && count) {
+			new_blocks[index++] = blkno++;
+			count--;
+		}
+
+		if (count > 0)
 			break;
 
-		branch[n].key = nr;
+		goal = blkno;
+	}
+
+	new_blocks[index] = blkno;
+	return count;
 
-		bh = getblk(vfs_inode->i_dev, parent, RKFS_BLOCK_SIZE);
+ failed:
+	for (i = 0; i < index; i++)
+		rkfs_free_blocks(vfs_inode, new_blocks[i], 1);
+
+	return err;
+}
+
+int rkfs_alloc_branch(struct inode *vfs_inode, int indirect_blks, int *blks,
+		      unsigned long goal, int *offsets, Indirect * branch,
+		      unsigned long *claim)
+{
+	struct super_block *sb = vfs_inode->i_sb;
+	int n = 0, i = 0, num = 0;
+	unsigned long new_blocks[DEPTH];
+	struct buffer_head *bh = NULL;
+
+	num = rkfs_alloc_blocks(vfs_inode, goal, indirect_blks, *blks,
+				new_blocks, claim);
+	if (num < 0)
+		return num;
+
+	branch[0].key = new_blocks[0];
+	for (n = 1; n <= indirect_blks; n++) {
+		bh = getblk(vfs_inode->i_dev, new_blocks[n - 1],
+			    sb->s_blocksize);
 
 		lock_buffer(bh);
-		memset(bh->b_data, 0, RKFS_BLOCK_SIZE);
+		memset(bh->b_data, 0, sb->s_blocksize);
 		branch[n].bh = bh;
-		branch[n].p = (block_t *) bh->b_data + offsets[n];
-		*branch[n].p = branch[n].key;
+		branch[n].p = rkfs_ptr_at(sb, bh->b_data, offsets[n]);
+		branch[n].key = new_blocks[n];
+		rkfs_set_ptr(sb, branch[n].p, branch[n].key);
+		if (n == indirect_blks)
+			for (i = 1; i < num; i++)
+				rkfs_set_ptr(sb, rkfs_ptr_at(sb, branch[n].p, i),
+					     new_blocks[n] + i);
 		mark_buffer_uptodate(bh, 1);
 		unlock_buffer(bh);
 
 		mark_buffer_dirty_inode(bh, vfs_inode);
-		parent = nr;
 	}
 
-	if (n == num)
-		return 0;
-
-	/*
-	 * Allocation failed, free what we already allocated.
-	 */
-	for (i = 1; i < n; i++)
-		bforget(branch[i].bh);
-
-	for (i = 0; i < n; i++)
-		rkfs_free_blocks(vfs_inode, branch[i].key, 1);
-
-	return err;
+	*blks = num;
+	return 0;
 }
 
-inline int rkfs_splice_branch(struct inode *vfs_inode,
-			      Indirect chain[DEPTH], Indirect * where, int num)
+/*
+* Hook the branch built by rkfs_alloc_branch into the inode. The caller
+* holds i_map_sem exclusive from the lookup of the chain on, so neither
+* the chain nor the free slots it counted after 'where' can change while
+* the allocator sleeps: nothing needs checking again here.
+*/
+inline void rkfs_splice_branch(struct inode *vfs_inode,
+			       Indirect chain[DEPTH], Indirect * where, int num,
+			       int blks)
 {
+	struct super_block *sb = vfs_inode->i_sb;
 	int i = 0;
 
-	if (!rkfs_verify_chain(chain, where - 1) || *where->p)
-		goto changed;
+	if (num == 1)
+		for (i = 1; i < blks; i++)
+			rkfs_set_ptr(sb, rkfs_ptr_at(sb, where->p, i),
+				     where->key + i);
 
-	*where->p = where->key;
+	rkfs_set_ptr(sb, where->p, where->key);
 
 	vfs_inode->i_ctime = CURRENT_TIME;
 
@@ -150,22 +262,13 @@ inline int rkfs_splice_branch(struct inode *vfs_inode,
 		mark_buffer_dirty_inode(where->bh, vfs_inode);
 
 	mark_inode_dirty(vfs_inode);
-	return 0;
-
- changed:
-	for (i = 1; i < num; i++)
-		bforget(where[i].bh);
-
-	for (i = 0; i < num; i++)
-		rkfs_free_blocks(vfs_inode, where[i].key, 1);
-
-	return -EAGAIN;
 }
 
 int rkfs_block_to_path(struct inode *vfs_inode, long blkno, int offsets[DEPTH])
 {
-	int n = 0;
-	unsigned short tb = 0;
+	int n = 0, direct = 0, bits = 0;
+	long ptrs = 0;
+	unsigned long tb = 0;
 	struct super_block *vfs_sb = NULL;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
@@ -191,44 +294,210 @@ int rkfs_block_to_path(struct inode *vfs_inode, long blkno, int offsets[DEPTH])
 		return n;
 	}
 
-	tb = rkfs_dsb->s_total_blocks;
+	tb = vfs_sb->u.rkfs_sb.s_total_blocks;
+	direct = rkfs_n_direct(vfs_sb);
+	bits = rkfs_ptr_bits(vfs_sb);
+	ptrs = 1L << bits;
 
 	if (blkno < 0) {
 		rkfs_debug("Block %ld is bad (<0)\n", blkno);
 	} else if (blkno >= tb) {
-		rkfs_debug("Block %ld is bad (>=%d)\n", blkno, tb);
-	} else if (blkno < (RKFS_N_BLOCKS - 2)) {
+		rkfs_debug("Block %ld is bad (>=%lu)\n", blkno, tb);
+	} else if (blkno < direct) {
 		offsets[n++] = blkno;
-	} else if ((blkno -= (RKFS_N_BLOCKS - 2)) < (RKFS_BLOCK_SIZE / 2)) {
-		offsets[n++] = RKFS_N_BLOCKS - 2;
+	} else if ((blkno -= direct) < ptrs) {
+		offsets[n++] = direct;
 		offsets[n++] = blkno;
+	} else if ((blkno -= ptrs) < (ptrs << bits)) {
+		offsets[n++] = direct + 1;
+		offsets[n++] = blkno >> bits;
+		offsets[n++] = blkno & (ptrs - 1);
+	} else if (rkfs_ind_levels(vfs_sb) == 3) {
+		blkno -= ptrs << bits;
+		offsets[n++] = direct + 2;
+		offsets[n++] = blkno >> (bits * 2);
+		offsets[n++] = (blkno >> bits) & (ptrs - 1);
+		offsets[n++] = blkno & (ptrs - 1);
 	} else {
-		blkno -= RKFS_BLOCK_SIZE / 2;
-		offsets[n++] = RKFS_N_BLOCKS - 1;
-		offsets[n++] = blkno >> 9;
-		offsets[n++] = blkno & ((RKFS_BLOCK_SIZE / 2) - 1);
+		rkfs_debug("Block %ld is beyond the double indirect block\n",
+			   blkno);
 	}
 
 	return n;
 }
 
-inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
-			  struct buffer_head *bh_result, int create)
+/*
+* Mapping cache: the run of blocks around the last block looked up, so
+* that a sequential reader maps most blocks without walking the tree
+* (or the extents). i_map_lock protects it, as readers sharing
+* i_map_sem fill it concurrently. It never reaches past i_size and
+* truncate drops it, so it can't hand out a block truncate is freeing.
+*/
+int rkfs_map_lookup(struct inode *vfs_inode, long blkno,
+		    struct buffer_head *bh_result, int maxblocks)
 {
-	int err = -EIO;
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	struct super_block *sb = vfs_inode->i_sb;
+	unsigned long count = 0, phys = 0;
+
+	atomic_inc(&sb->u.rkfs_sb.s_map_lookups);
+	spin_lock(&rkfs_ii->i_map_lock);
+	if ((unsigned long)blkno - rkfs_ii->i_map_block >= rkfs_ii->i_map_len) {
+		spin_unlock(&rkfs_ii->i_map_lock);
+		return 0;
+	}
+
+	count = rkfs_ii->i_map_len - (blkno - rkfs_ii->i_map_block);
+	phys = rkfs_ii->i_map_phys + (blkno - rkfs_ii->i_map_block);
+	spin_unlock(&rkfs_ii->i_map_lock);
+
+	atomic_inc(&sb->u.rkfs_sb.s_map_hits);
+	if (count > maxblocks)
+		count = maxblocks;
+
+	bh_result->b_dev = vfs_inode->i_dev;
+	bh_result->b_blocknr = phys;
+	bh_result->b_state |= (1UL << BH_Mapped);
+	if (maxblocks > 1)
+		bh_result->b_size = count << vfs_inode->i_blkbits;
+
+	return 1;
+}
+
+/*
+* Remember that 'count' blocks from 'blkno' on map to 'phys' onwards,
+* replacing what the cache held.
+*/
+void rkfs_map_remember(struct inode *vfs_inode, long blkno,
+		       unsigned long phys, unsigned long count)
+{
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	struct super_block *sb = vfs_inode->i_sb;
+	unsigned long last = 0;
+
+	last = (vfs_inode->i_size + sb->s_blocksize - 1) >>
+	    sb->s_blocksize_bits;
+	if (blkno < 0 || blkno >= last)
+		count = 0;
+	else if (blkno + count > last)
+		count = last - blkno;
+
+	spin_lock(&rkfs_ii->i_map_lock);
+	rkfs_ii->i_map_block = blkno;
+	rkfs_ii->i_map_phys = phys;
+	rkfs_ii->i_map_len = count;
+	spin_unlock(&rkfs_ii->i_map_lock);
+}
+
+void rkfs_map_forget(struct inode *vfs_inode)
+{
+	spin_lock(&RKFS_I(vfs_inode)->i_map_lock);
+	RKFS_I(vfs_inode)->i_map_len = 0;
+	spin_unlock(&RKFS_I(vfs_inode)->i_map_lock);
+}
+
+/*
+* Delayed allocation: indirect blocks (or the extent overflow block)
+* writeback may have to allocate for 'blkno'. Levels missing on its
+* path are counted, except those it shares with 'blkno' - 1 when that
+* one is delayed too ('prev'), they are reserved already.
+*/
+int rkfs_da_meta_blocks(struct inode *vfs_inode, long blkno, int prev)
+{
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	int offsets[DEPTH], prev_offsets[DEPTH];
+	Indirect chain[DEPTH];
+	Indirect *partial = NULL, *p = NULL;
+	int depth = 0, prev_depth = 0, first = 0, shared = 0, err = 0;
+
+	if (rkfs_ii->i_extents)
+		return rkfs_ext_da_meta(vfs_inode);
+
+	depth = rkfs_block_to_path(vfs_inode, blkno, offsets);
+	if (depth <= 1)
+		return 0;
+
+	down_read(&rkfs_ii->i_map_sem);
+	partial = rkfs_get_branch(vfs_inode, depth, offsets, chain, &err);
+	first = partial ? partial - chain : depth;
+	for (p = partial ? partial : chain + depth - 1; p > chain; p--)
+		brelse(p->bh);
+	up_read(&rkfs_ii->i_map_sem);
+
+	if (err)
+		first = 0;
+
+	/*
+	 * chain[i] for i < depth - 1 is an indirect block, the one under
+	 * slot offsets[i]; it is the same for 'blkno' - 1 as long as the
+	 * offsets agree up to i.
+	 */
+	if (prev && blkno > 0) {
+		prev_depth = rkfs_block_to_path(vfs_inode, blkno - 1,
+						prev_offsets);
+		if (prev_depth == depth)
+			while (shared < depth - 1 &&
+			       offsets[shared] == prev_offsets[shared])
+				shared++;
+	}
+
+	if (first < shared)
+		first = shared;
+
+	return (first < depth - 1) ? (depth - 1) - first : 0;
+}
+
+/*
+* Map (and with 'create' allocate) logical block 'blkno'. If the caller
+* sets bh_result->b_size to more than one block, as many following
+* blocks as are contiguous on disk (or can be allocated contiguously)
+* are mapped at once and b_size is trimmed to the mapped length.
+*
+* Lookups hold i_map_sem shared; only a lookup that has to allocate
+* retakes it exclusive, as truncate does, and looks again.
+*
+* 'claim' is for delayed allocation writeback: the reserved blocks it
+* may allocate from (see rkfs__new_blocks).
+*/
+int rkfs__get_block(struct inode *vfs_inode, long blkno,
+		    struct buffer_head *bh_result, int create,
+		    unsigned long *claim)
+{
+	struct rkfs_inode_info *rkfs_ii = RKFS_I(vfs_inode);
+	int err = -EIO, write = 0;
 	int offsets[DEPTH];
 	Indirect chain[DEPTH];
 	Indirect *partial = NULL;
-	int left = 0, depth = 0;
+	int left = 0, depth = 0, maxblocks = 0, count = 0;
 
 	rkfs_debug("Inode: %ld, Block: %ld, Create: %d\n", vfs_inode->i_ino,
 		   blkno, create);
 
-	depth = rkfs_block_to_path(vfs_inode, blkno, offsets);
-	if (depth == 0)
+	if (rkfs_ii->i_inline) {
+		rkfs_bug("Inode %ld has inline data, no blocks\n",
+			 vfs_inode->i_ino);
 		goto out;
+	}
 
-	lock_kernel();
+	if (rkfs_ii->i_extents)
+		return rkfs_ext_get_block(vfs_inode, blkno, bh_result, create,
+					  claim);
+
+	maxblocks = bh_result->b_size >> vfs_inode->i_blkbits;
+	if (maxblocks < 1)
+		maxblocks = 1;
+
+	down_read(&rkfs_ii->i_map_sem);
+	if (rkfs_map_lookup(vfs_inode, blkno, bh_result, maxblocks)) {
+		up_read(&rkfs_ii->i_map_sem);
+		return 0;
+	}
+
+	depth = rkfs_block_to_path(vfs_inode, blkno, offsets);
+	if (depth == 0) {
+		up_read(&rkfs_ii->i_map_sem);
+		goto out;
+	}
  reread:
 	partial = rkfs_get_branch(vfs_inode, depth, offsets, chain, &err);
 
@@ -236,12 +505,21 @@ inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
 	 * Simplest case - block found, no allocation needed
 	 */
 	if (!partial) {
+		count = rkfs_count_mapped(vfs_inode, chain + depth - 1,
+					  1 << rkfs_ptr_bits(vfs_inode->i_sb));
+		rkfs_map_remember(vfs_inode, blkno, chain[depth - 1].key,
+				  count);
+		if (count > maxblocks)
+			count = maxblocks;
  got_it:
 		bh_result->b_dev = vfs_inode->i_dev;
 		bh_result->b_blocknr = chain[depth - 1].key;
 		bh_result->b_state |= (1UL << BH_Mapped);
+		if (maxblocks > 1)
+			bh_result->b_size = count << vfs_inode->i_blkbits;
 
-		rkfs_debug("Result block: %ld\n", bh_result->b_blocknr);
+		rkfs_debug("Result block: %ld (count: %d)\n",
+			   bh_result->b_blocknr, count);
 
 		/*
 		 * Clean up and exit
@@ -259,7 +537,10 @@ inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
 			brelse(partial->bh);
 			partial--;
 		}
-		unlock_kernel();
+		if (write)
+			up_write(&rkfs_ii->i_map_sem);
+		else
+			up_read(&rkfs_ii->i_map_sem);
  out:
 		return err;
 	}
@@ -272,15 +553,44 @@ inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
 	if (err == -EAGAIN)
 		goto changed;
 
+	if (!write) {
+		up_read(&rkfs_ii->i_map_sem);
+		down_write(&rkfs_ii->i_map_sem);
+		write = 1;
+		goto changed;
+	}
+
+	/*
+	 * Work out how many data blocks can go in with this branch:
+	 * free slots following the missing one in an existing array,
+	 * or the rest of a new indirect block.
+	 */
 	left = (chain + depth) - partial;
-	err = rkfs_alloc_branch(vfs_inode, left, offsets + (partial - chain),
-				partial);
+	if (left == 1) {
+		struct super_block *sb = vfs_inode->i_sb;
+		char *end = rkfs_array_end(vfs_inode, partial);
+		void *p = NULL;
+
+		for (count = 1; count < maxblocks; count++) {
+			p = rkfs_ptr_at(sb, partial->p, count);
+			if ((char *)p >= end || rkfs_get_ptr(sb, p))
+				break;
+		}
+	} else {
+		count = (1 << rkfs_ptr_bits(vfs_inode->i_sb)) -
+		    offsets[depth - 1];
+		if (count > maxblocks)
+			count = maxblocks;
+	}
+
+	err = rkfs_alloc_branch(vfs_inode, left - 1, &count,
+				rkfs_find_goal(vfs_inode, partial),
+				offsets + (partial - chain), partial, claim);
 	if (err)
 		goto cleanup;
 
-	if (rkfs_splice_branch(vfs_inode, chain, partial, left) < 0)
-		goto changed;
-
+	rkfs_splice_branch(vfs_inode, chain, partial, left, count);
+	rkfs_map_remember(vfs_inode, blkno, chain[depth - 1].key, count);
 	bh_result->b_state |= (1UL << BH_New);
 	goto got_it;
 
@@ -292,40 +602,52 @@ inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
 	goto reread;
 }
 
-int rkfs_all_zeroes(block_t * p, block_t * q)
+inline int rkfs_get_block(struct inode *vfs_inode, long blkno,
+			  struct buffer_head *bh_result, int create)
 {
-	while (p < q)
-		if (*p++)
+	return rkfs__get_block(vfs_inode, blkno, bh_result, create, NULL);
+}
+
+int rkfs_all_zeroes(struct super_block *sb, char *p, char *q)
+{
+	int size = rkfs_ptr_size(sb);
+
+	for (; p < q; p += size)
+		if (rkfs_get_ptr(sb, p))
 			return 0;
 
 	return 1;
 }
 
+/*
+* 'top' gets the detached subtree root, in on-disk width like any other
+* block pointer array so that rkfs_free_branches can walk it.
+*/
 Indirect *rkfs_find_shared(struct inode * inode, int depth, int offsets[DEPTH],
-			   Indirect chain[DEPTH], block_t * top)
+			   Indirect chain[DEPTH], void *top)
 {
+	struct super_block *sb = inode->i_sb;
 	Indirect *partial = NULL, *p = NULL;
 	int k = 0, err = 0;
 
-	*top = 0;
+	rkfs_set_ptr(sb, top, 0);
 	for (k = depth; (k > 1 && !offsets[k - 1]); k--) ;
 
 	partial = rkfs_get_branch(inode, k, offsets, chain, &err);
 	if (!partial)
 		partial = chain + k - 1;
 
-	if (!partial->key && *partial->p)
+	if (!partial->key && rkfs_get_ptr(sb, partial->p))
 		goto no_top;
 
 	for (p = partial;
-	     (p > chain && rkfs_all_zeroes((block_t *) p->bh->b_data, p->p));
-	     p--) ;
+	     (p > chain && rkfs_all_zeroes(sb, p->bh->b_data, p->p)); p--) ;
 
 	if ((p == chain + k - 1) && (p > chain)) {
-		p->p--;
+		p->p = (char *)p->p - rkfs_ptr_size(sb);
 	} else {
-		*top = *p->p;
-		*p->p = 0;
+		rkfs_set_ptr(sb, top, rkfs_get_ptr(sb, p->p));
+		rkfs_set_ptr(sb, p->p, 0);
 	}
 
 	while (partial > p) {
@@ -337,26 +659,29 @@ Indirect *rkfs_find_shared(struct inode * inode, int depth, int offsets[DEPTH],
 	return partial;
 }
 
-void rkfs_free_data(struct inode *inode, block_t * p, block_t * q)
+void rkfs_free_data(struct inode *inode, char *p, char *q)
 {
-	unsigned short blk_to_free = 0, count = 0, blkno = 0;
+	struct super_block *sb = inode->i_sb;
+	int size = rkfs_ptr_size(sb);
+	unsigned long blk_to_free = 0, blkno = 0;
+	unsigned short count = 0;
 
 	while (p < q) {
-		blkno = *p;
+		blkno = rkfs_get_ptr(sb, p);
 
 		if (blkno) {
-			*p = 0;
+			rkfs_set_ptr(sb, p, 0);
 
 			if (count == 0) {
 				blk_to_free = blkno;
 				count++;
-				p++;
+				p += size;
 				continue;
 			}
 
 			if (blkno == blk_to_free + count) {
 				count++;
-				p++;
+				p += size;
 				continue;
 			}
 
@@ -365,7 +690,7 @@ void rkfs_free_data(struct inode *inode, block_t * p, block_t * q)
 			blk_to_free = blkno;
 			count = 1;
 		}
-		p++;
+		p += size;
 	}
 
 	if (count > 0) {
@@ -374,30 +699,29 @@ void rkfs_free_data(struct inode *inode, block_t * p, block_t * q)
 	}
 }
 
-void rkfs_free_branches(struct inode *inode, block_t * p, block_t * q,
-			int depth)
+void rkfs_free_branches(struct inode *inode, char *p, char *q, int depth)
 {
+	struct super_block *sb = inode->i_sb;
+	int size = rkfs_ptr_size(sb);
 	struct buffer_head *bh = NULL;
-	unsigned short blkno = 0;
+	unsigned long blkno = 0;
 
 	if (depth--) {
-		for (; p < q; p++) {
-			blkno = *p;
+		for (; p < q; p += size) {
+			blkno = rkfs_get_ptr(sb, p);
 			if (!blkno)
 				continue;
 
-			*p = 0;
-			if (!(bh = bread(inode->i_dev, blkno, BLOCK_SIZE))) {
+			rkfs_set_ptr(sb, p, 0);
+			if (!(bh = bread(inode->i_dev, blkno, sb->s_blocksize))) {
 				rkfs_printk
-				    ("Failed to read block %d from the device %s\n",
+				    ("Failed to read block %lu from the device %s\n",
 				     blkno, bdevname(inode->i_dev));
 				continue;
 			}
 
-			rkfs_free_branches(inode, (block_t *) bh->b_data,
-					   (block_t *) (bh->b_data +
-							RKFS_BLOCK_SIZE),
-					   depth);
+			rkfs_free_branches(inode, bh->b_data,
+					   bh->b_data + sb->s_blocksize, depth);
 
 			bforget(bh);
 			rkfs_free_blocks(inode, blkno, 1);
@@ -409,11 +733,14 @@ void rkfs_free_branches(struct inode *inode, block_t * p, block_t * q,
 
 void rkfs_truncate(struct inode *inode)
 {
-	block_t *idata = inode->u.rkfs_i.i_block;
+	struct super_block *sb = inode->i_sb;
+	char *idata = (char *)RKFS_I(inode)->i_data;
+	int direct = rkfs_n_direct(sb), size = rkfs_ptr_size(sb);
 	int offsets[DEPTH];
 	Indirect chain[DEPTH];
 	Indirect *partial = NULL;
-	block_t nr = 0;
+	__u32 nr = 0;
+	void *p = NULL;
 	int n = 0, first_whole = 0, i = 0;
 	long iblock = 0;
 
@@ -428,40 +755,82 @@ void rkfs_truncate(struct inode *inode)
 		return;
 	}
 
+	/*
+	 * Inline data only has to be cut back, unless the file grows past
+	 * it; then the data goes to a block and the usual truncate follows.
+	 * If that fails the file can't grow: it stays inline, at most as
+	 * big as i_data holds (only zeroes are lost).
+	 */
+	if (RKFS_I(inode)->i_inline) {
+		if (inode->i_size > rkfs_inline_size(sb) &&
+		    rkfs_inline_to_block(inode)) {
+			rkfs_printk("Inode %ld can't grow past its inline data\n",
+				    inode->i_ino);
+			inode->i_size = rkfs_inline_size(sb);
+		}
+
+		if (RKFS_I(inode)->i_inline) {
+			memset(idata + inode->i_size, 0,
+			       rkfs_inline_size(sb) - inode->i_size);
+			inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+			mark_inode_dirty(inode);
+			return;
+		}
+	}
+
+	rkfs_discard_prealloc(inode);
+	spin_lock(&RKFS_I(inode)->i_da_lock);
+	RKFS_I(inode)->i_da_len = 0;
+	spin_unlock(&RKFS_I(inode)->i_da_lock);
+
+	/*
+	 * block_truncate_page maps through rkfs_get_block, so it goes
+	 * before i_map_sem is taken.
+	 */
+	block_truncate_page(inode->i_mapping, inode->i_size, rkfs_get_block);
+	down_write(&RKFS_I(inode)->i_map_sem);
+	rkfs_map_forget(inode);
+
+	if (RKFS_I(inode)->i_extents) {
+		rkfs_ext_truncate(inode);
+		goto out;
+	}
+
 	for (i = 0; i < DEPTH; i++)
 		offsets[i] = 0;
 
 	memset(chain, 0, (sizeof(chain) / sizeof(chain[0])));
 
-	iblock = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	block_truncate_page(inode->i_mapping, inode->i_size, rkfs_get_block);
+	iblock = (inode->i_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
 
 	n = rkfs_block_to_path(inode, iblock, offsets);
-	if (!n)
+	if (!n) {
+		up_write(&RKFS_I(inode)->i_map_sem);
 		return;
+	}
 
 	if (n == 1) {
-		rkfs_free_data(inode, (idata + offsets[0]), (idata + DIRECT));
+		rkfs_free_data(inode, idata + offsets[0] * size,
+			       idata + direct * size);
 		first_whole = 0;
 		goto do_indirects;
 	}
 
-	first_whole = offsets[0] + 1 - DIRECT;
+	first_whole = offsets[0] + 1 - direct;
 	partial = rkfs_find_shared(inode, n, offsets, chain, &nr);
-	if (nr) {
+	if (rkfs_get_ptr(sb, &nr)) {
 		if (partial == chain)
 			mark_inode_dirty(inode);
 		else
 			mark_buffer_dirty_inode(partial->bh, inode);
 
-		rkfs_free_branches(inode, &nr, &nr + 1,
+		rkfs_free_branches(inode, (char *)&nr, (char *)&nr + size,
 				   ((chain + n - 1) - partial));
 	}
 
 	while (partial > chain) {
-		rkfs_free_branches(inode, (partial->p + 1),
-				   (block_t *) (partial->bh->b_data +
-						RKFS_BLOCK_SIZE),
+		rkfs_free_branches(inode, (char *)partial->p + size,
+				   partial->bh->b_data + sb->s_blocksize,
 				   ((chain + n - 1) - partial));
 
 		mark_buffer_dirty_inode(partial->bh, inode);
@@ -476,17 +845,21 @@ void rkfs_truncate(struct inode *inode)
 	}
 
  do_indirects:
-	while (first_whole < (DEPTH - 1)) {
-		nr = idata[DIRECT + first_whole];
-		if (nr) {
-			idata[DIRECT + first_whole] = 0;
+	while (first_whole < rkfs_ind_levels(sb)) {
+		p = rkfs_ptr_at(sb, idata, direct + first_whole);
+		if (rkfs_get_ptr(sb, p)) {
+			rkfs_set_ptr(sb, &nr, rkfs_get_ptr(sb, p));
+			rkfs_set_ptr(sb, p, 0);
 			mark_inode_dirty(inode);
-			rkfs_free_branches(inode, &nr, &nr + 1,
+			rkfs_free_branches(inode, (char *)&nr,
+					   (char *)&nr + size,
 					   (first_whole + 1));
 		}
 		first_whole++;
 	}
 
+ out:
+	up_write(&RKFS_I(inode)->i_map_sem);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME;
 	mark_inode_dirty(inode);
 }
@@ -48,7 +48,7 @@ struct dentry *rkfs_lookup(struct inode *dir, struct dentry *dentry)
 	struct inode *inode = NULL;
 	ino_t ino = 0;
 
-	if (dentry->d_name.len >= RKFS_MAX_FILENAME_LEN)
+	if (dentry->d_name.len >= rkfs_max_filename_len(dir->i_sb))
 		return ERR_PTR(-ENAMETOOLONG);
 
 	ino = rkfs_inode_by_name(dir, dentry);
@@ -75,7 +75,7 @@ int rkfs_create(struct inode *dir, struct dentry *dentry, int mode)
 	if (!IS_ERR(inode)) {
 		inode->i_op = &rkfs_file_inode_operations;
 		inode->i_fop = &rkfs_file_operations;
-		inode->i_mapping->a_ops = &rkfs_aops;
+		inode->i_mapping->a_ops = rkfs_file_aops(dir->i_sb);
 
 		mark_inode_dirty(inode);
 		err = rkfs_add_nondir(dentry, inode);
@@ -125,11 +125,21 @@ int rkfs_symlink(struct inode *dir, struct dentry *dentry, const char *sname)
 	if (IS_ERR(inode))
 		goto out;
 
-	inode->i_op = &page_symlink_inode_operations;
-	inode->i_mapping->a_ops = &rkfs_aops;
-	err = block_symlink(inode, sname, len);
-	if (err)
-		goto out_fail;
+	/*
+	 * Fast symlink: a target that fits, with its NUL, stays in i_data.
+	 */
+	if (rkfs_has_inline(sb) && len <= rkfs_inline_size(sb)) {
+		inode->i_op = &rkfs_fast_symlink_inode_operations;
+		RKFS_I(inode)->i_inline = 1;
+		memcpy(RKFS_I(inode)->i_data, sname, len);
+		inode->i_size = len - 1;
+	} else {
+		inode->i_op = &page_symlink_inode_operations;
+		inode->i_mapping->a_ops = &rkfs_aops;
+		err = block_symlink(inode, sname, len);
+		if (err)
+			goto out_fail;
+	}
 
 	mark_inode_dirty(inode);
 	err = rkfs_add_nondir(dentry, inode);
@@ -282,11 +292,11 @@ int rkfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			goto out_old;
 		kaddr = page_address(dir_page);
 		de = (struct rkfs_dir_entry *)kaddr;
-		if (!de->de_name_len) {
+		if (!rkfs_de_name_len(old_inode->i_sb, de)) {
 			err = -EINVAL;
 			goto out_old;
 		}
-		rec_len = RKFS_DIR_ENTRY_LEN(de->de_name_len);
+		rec_len = rkfs_de_rec_len(old_inode->i_sb, de);
 		dir_de = (struct rkfs_dir_entry *)(((char *)de) + rec_len);
 	}
 
@@ -349,6 +359,22 @@ int rkfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	return err;
 }
 
+static int rkfs_readlink(struct dentry *dentry, char *buffer, int buflen)
+{
+	return vfs_readlink(dentry, buffer, buflen,
+			    (char *)RKFS_I(dentry->d_inode)->i_data);
+}
+
+static int rkfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+	return vfs_follow_link(nd, (char *)RKFS_I(dentry->d_inode)->i_data);
+}
+
+struct inode_operations rkfs_fast_symlink_inode_operations = {
+ readlink:rkfs_readlink,
+ follow_link:rkfs_follow_link,
+};
+
 struct inode_operations rkfs_dir_inode_operations = {
  create:rkfs_create,
  lookup:rkfs_lookup,
@@ -15,6 +15,7 @@
 
 #include <linux/statfs.h>
 #include "rkfs_sb.h"
+#include "rkfs_i.h"
 
 /*
 * Following are inode related constants.
@@ -45,6 +46,64 @@ struct rkfs_inode {
 	__u16 i_block[RKFS_N_BLOCKS];	//Data blocks
 };
 
+/*
+* Inode of a filesystem with 32-bit block numbers (RKFS_FEATURE_32BIT).
+* Same size as the 16-bit one: 17 direct blocks, then single, double
+* and triple indirect.
+*/
+#define RKFS_N_BLOCKS32      20
+
+struct rkfs_inode32 {
+	__u16 i_uid;		//User id
+	__u16 i_gid;		//Group id
+	__u16 i_mode;		//Type/access rights
+	__u16 i_links_count;	//Number of childs
+	__u32 i_time;		//Create/access/modification/del time
+	__u32 i_size;		//Size in bytes
+	__u32 i_blocks;		//Number of blocks
+	__u32 i_block[RKFS_N_BLOCKS32];	//Data blocks
+};
+
+/*
+* Inline data (RKFS_FEATURE_INLINE_DATA): a regular file or symlink of
+* no more than RKFS_INLINE_SIZE (RKFS_INLINE_SIZE32) bytes keeps them in
+* i_block instead of a data block. Such an inode has no blocks and
+* RKFS_INLINE_MAGIC in the last i_block slot, which the data never
+* reaches; an inode without blocks otherwise has all its slots zero.
+*/
+#define RKFS_INLINE_MAGIC    0x4c49
+#define RKFS_INLINE_SIZE     ((RKFS_N_BLOCKS - 1) * sizeof(__u16))
+#define RKFS_INLINE_SIZE32   ((RKFS_N_BLOCKS32 - 1) * sizeof(__u32))
+
+/*
+* Extent-mapped inode (RKFS_FEATURE_EXTENTS): i_block holds a header and
+* up to RKFS_EXT_ROOT_MAX extents sorted by ee_block. Once they don't
+* fit, eh_depth is 1 and they move to one overflow block, headed the
+* same way, whose number is the ee_start of the only entry in i_block.
+* A file needing more extents than that gets -EFBIG.
+* The magic can't be a block pointer: in a 16-bit first slot it reads
+* as RKFS_SUPER_BLOCK, in a 32-bit one it is past any block.
+*/
+struct rkfs_extent_header {
+	__u32 eh_magic;		//RKFS_EXT_MAGIC
+	__u16 eh_entries;	//Extents in use
+	__u16 eh_depth;		//0 or 1 (overflow block)
+};
+
+struct rkfs_extent {
+	__u32 ee_block;		//First logical block
+	__u32 ee_start;		//First physical block
+	__u16 ee_len;		//Blocks
+	__u16 ee_unused;
+};
+
+#define RKFS_EXT_MAGIC       0xe7e00001
+#define RKFS_EXT_ROOT_MAX    6	//Extents in i_block
+#define RKFS_EXT_MAX_LEN     0xffff
+#define RKFS_EXT_BLOCK_MAX(bsize) \
+        (((bsize) - sizeof(struct rkfs_extent_header)) / \
+         sizeof(struct rkfs_extent))
+
 /*
 * Super Block / Inode related constants
 */
@@ -58,7 +117,9 @@ struct rkfs_inode {
 #define RKFS_MIN_BLOCKS 1440	//1.4MB
 #define RKFS_MAX_BLOCKS 65535	//64MB
 
-#define RKFS_BLOCK_SIZE 1024
+#define RKFS_BLOCK_SIZE 1024	//v1, and the smallest v2 block size
+#define RKFS_MAX_BLOCK_SIZE 4096
+#define RKFS_MAX_LOG_BLOCK_SIZE 2	//log2(RKFS_MAX_BLOCK_SIZE/RKFS_BLOCK_SIZE)
 
 #define RKFS_BLOCK_MAP_SIZE ((RKFS_MIN_BLOCKS/8)/2)
 #define RKFS_INODE_MAP_SIZE RKFS_BLOCK_MAP_SIZE
@@ -95,6 +156,100 @@ struct rkfs_super_block {
 	__u16 s_total_blocks;	//Total blocks
 };
 
+/*
+* Version 2 layout. The group superblock only describes the group; its
+* block bitmap, inode bitmap and inode table map (same format as the v1
+* s_itable_map) sit in blocks of their own, so allocations never dirty
+* the superblock. mkrkfs puts them right after the group superblock:
+* group 0 is boot block, superblock, maps, first inode table and root
+* dir block; every other group is superblock and maps.
+*
+* The block size may be 1, 2 or 4 KB (s_log_block_size). Everything is
+* counted in blocks of that size; the superblock is still block
+* RKFS_SUPER_BLOCK.
+*
+* The geometry is chosen by mkrkfs and recorded in every group
+* superblock: s_blocks_per_group and s_inodes_per_group (each at most
+* 8 * block size, the bits of one map block) and s_inode_size (at least
+* RKFS_INODE_SIZE, 0 means RKFS_INODE_SIZE, and small enough for the
+* reserved inodes and the root to share the first inode table block).
+* Inode numbers are group * s_inodes_per_group + bit. An inode table
+* block holds block size / s_inode_size inodes, and the inode table map
+* has one entry per inode table block of the group; it must fit in its
+* block.
+*/
+#define RKFS_VER2      200	//Version 2 layout
+
+#define RKFS_V2_BLOCK_MAP_OFFSET     1	//From the group superblock
+#define RKFS_V2_INODE_MAP_OFFSET     2
+#define RKFS_V2_ITABLE_MAP_OFFSET    3
+#define RKFS_V2_GROUP_META_BLOCKS    4	//Superblock + maps
+#define RKFS_V2_FIRST_INODE_TABLE_BLOCK 5
+#define RKFS_V2_ROOT_DIR_BLOCK       6
+#define RKFS_V2_FIRST_BLOCK          7
+
+/*
+* Flex groups (s_log_groups_per_flex = n > 0): the superblocks and maps
+* of 2^n consecutive groups are packed at the start of the first one,
+* a RKFS_V2_GROUP_META_BLOCKS slot per group in group order, and the
+* other groups of the flex group hold data only (s_first_block 0). In
+* group 0 the packed area starts at RKFS_SUPER_BLOCK, and the first
+* inode table and root dir block follow it: the RKFS_V2_*_BLOCK numbers
+* above move up by RKFS_V2_FLEX_SHIFT(groups in the first flex group).
+*/
+#define RKFS_MAX_LOG_GROUPS_PER_FLEX 10
+#define RKFS_V2_FLEX_SHIFT(groups) (((groups) - 1) * RKFS_V2_GROUP_META_BLOCKS)
+
+struct rkfs_super_block2 {
+	__u16 s_fsid;		//Filesystem ID
+	__u16 s_fsver;		//Filesystem version (RKFS_VER2)
+	__u16 s_state;		//Filesystem state
+	__u16 s_group;		//Group this superblock describes
+	__u32 s_total_blocks;	//Total blocks
+	__u32 s_blocks_per_group;	//Blocks per group
+	__u32 s_inodes_per_group;	//Inodes per group
+	__u32 s_block_map;	//Block bitmap block of the group
+	__u32 s_inode_map;	//Inode bitmap block of the group
+	__u32 s_itable_map;	//Inode table map block of the group
+	__u32 s_first_block;	//First allocatable bit of the group
+	__u32 s_free_blocks;	//Free blocks in the group (as of umount)
+	__u32 s_free_inodes;	//Free inodes in the group (as of umount)
+	__u32 s_features;	//RKFS_FEATURE_*
+	__u32 s_log_block_size;	//Block size is RKFS_BLOCK_SIZE << this
+	__u32 s_inode_size;	//Bytes per on-disk inode
+	__u32 s_log_groups_per_flex;	//Groups per flex group is 1 << this
+};
+
+#define RKFS_MAX_GROUP_BITS(bsize) ((bsize) * 8)	//Per group, either map
+
+/*
+* v2 features (s_features). RKFS_FEATURE_32BIT widens block numbers,
+* in inodes and indirect blocks, and inode numbers, in directory
+* entries, to 32 bits. Such a filesystem is limited by the number of
+* groups instead. RKFS_FEATURE_INLINE_DATA allows inline data (see
+* RKFS_INLINE_MAGIC), RKFS_FEATURE_EXTENTS extent-mapped regular files
+* (see rkfs_extent_header).
+*/
+#define RKFS_FEATURE_32BIT   0x0001
+#define RKFS_FEATURE_INLINE_DATA 0x0002
+#define RKFS_FEATURE_EXTENTS 0x0004
+#define RKFS_FEATURES \
+        (RKFS_FEATURE_32BIT | RKFS_FEATURE_INLINE_DATA | \
+         RKFS_FEATURE_EXTENTS)	//Known to this version
+
+#define RKFS_MAX_GROUPS      65535
+#define RKFS_MAX_INODES      65536	//Without RKFS_FEATURE_32BIT
+
+/*
+* Inode table map block of a RKFS_FEATURE_32BIT filesystem, with 'n'
+* entries (inode table blocks per group): __u32 it_block[n], the inode
+* table blocks, which may lie in any group, then __u16 it_count[n], the
+* inodes in use in each. Without the feature the map is __u16 [n][2],
+* block and count, like the v1 s_itable_map.
+*/
+#define RKFS_ITABLE_ENTRY_SIZE(is32) ((is32) ? 6 : 4)
+#define rkfs_itable_map32_count(map,n) ((__u16 *)((__u32 *)(map) + (n)))
+
 /*
 * Directory entry related constants
 */
@@ -123,6 +278,34 @@ struct rkfs_dir_entry {
 
 #define RKFS_DIR_ENTRY_PER_BLOCK (RKFS_BLOCK_SIZE/RKFS_DIR_ENTRY_SIZE)
 
+/*
+* Directory entry with a 32-bit inode number (RKFS_FEATURE_32BIT).
+*/
+#define RKFS_MAX_FILENAME_LEN32 250
+#define RKFS_DIR_ENTRY32_LEN(nlen) (nlen + 6)
+
+struct rkfs_dir_entry32 {
+	__u32 de_inode;		//File inode number
+	__u16 de_name_len;	//File name len
+	char de_name[RKFS_MAX_FILENAME_LEN32];	//File name
+};
+
+/*
+* Allocator and mapping cache statistics of a mounted filesystem
+* (RKFS_IOC_GETSTATS on any file or directory in it). st_alloc_bits
+* counts bitmap scans only; groups answered from their free extent
+* index add nothing to it.
+*/
+struct rkfs_stats {
+	__u32 st_alloc_calls;	//Block allocator searches
+	__u32 st_alloc_groups;	//Groups searched
+	__u32 st_alloc_bits;	//Bitmap bits scanned
+	__u32 st_map_lookups;	//rkfs_get_block calls
+	__u32 st_map_hits;	//Of those, served by the mapping cache
+};
+
+#define RKFS_IOC_GETSTATS    _IOR('r', 1, struct rkfs_stats)
+
 #ifdef __KERNEL__
 /*
 * Following are required for rkfs in linux kernel.
@@ -135,6 +318,23 @@ struct rkfs_dir_entry {
 #define RKFS_BUF_SIZE     256
 #define RKFS_BIG_BUF_SIZE 1024
 
+/*
+* Per-inode preallocation window (blocks), 'prealloc=' mount option.
+*/
+#define RKFS_DEFAULT_PREALLOC        8
+#define RKFS_MAX_PREALLOC            256
+
+/*
+* Group metadata buffers submitted together by rkfs_write_super.
+*/
+#define RKFS_WRITE_BATCH             16
+
+/*
+* Directory entries past a looked up name whose inode table blocks are
+* read ahead.
+*/
+#define RKFS_STATAHEAD_ENTRIES       32
+
 /*
 * Bit operations.
 * In conventions these macros are defined in asm/bitops.h
@@ -143,11 +343,191 @@ struct rkfs_dir_entry {
 #define rkfs_clear_bit               __test_and_clear_bit
 #define rkfs_test_bit                test_bit
 #define rkfs_find_first_zero_bit     find_first_zero_bit
+#define rkfs_find_next_zero_bit      find_next_zero_bit
+#define rkfs_find_next_bit           find_next_bit
+
+/*
+* Block pointers, in the inode and in indirect blocks, and inode numbers
+* in directory entries are 16 bits wide, or 32 bits with
+* RKFS_FEATURE_32BIT. The in-core inode keeps its pointers in the
+* on-disk width too, so every block pointer array is read and written
+* through these.
+*/
+#define rkfs_is_32bit(sb)       ((sb)->u.rkfs_sb.s_features & RKFS_FEATURE_32BIT)
+#define rkfs_ptr_size(sb)       (rkfs_is_32bit(sb) ? 4 : 2)
+#define rkfs_ptr_at(sb,p,n)     ((void *)((char *)(p) + ((n) * rkfs_ptr_size(sb))))
+#define rkfs_n_blocks(sb)       (rkfs_is_32bit(sb) ? RKFS_N_BLOCKS32 : RKFS_N_BLOCKS)
+#define rkfs_ind_levels(sb)     (rkfs_is_32bit(sb) ? 3 : 2)
+#define rkfs_n_direct(sb)       (rkfs_n_blocks(sb) - rkfs_ind_levels(sb))
+#define rkfs_ptr_bits(sb) \
+        ((sb)->s_blocksize_bits - (rkfs_is_32bit(sb) ? 2 : 1))	//Per block
+#define rkfs_has_inline(sb) \
+        ((sb)->u.rkfs_sb.s_features & RKFS_FEATURE_INLINE_DATA)
+#define rkfs_inline_size(sb) \
+        (rkfs_is_32bit(sb) ? RKFS_INLINE_SIZE32 : RKFS_INLINE_SIZE)
+#define rkfs_has_extents(sb) \
+        ((sb)->u.rkfs_sb.s_features & RKFS_FEATURE_EXTENTS)
+
+/*
+* Group geometry, from the superblock on v2 (see rkfs_super_block2).
+*/
+#define rkfs_blocks_per_group(sb)  ((sb)->u.rkfs_sb.s_blocks_per_group)
+#define rkfs_inodes_per_group(sb)  ((sb)->u.rkfs_sb.s_inodes_per_group)
+#define rkfs_inode_size(sb)        ((sb)->u.rkfs_sb.s_inode_size)
+#define rkfs_inodes_per_block(sb)  ((sb)->u.rkfs_sb.s_inodes_per_block)
+#define rkfs_block_group(sb,blkno) ((blkno) / rkfs_blocks_per_group(sb))
+#define rkfs_block_bit(sb,blkno)   ((blkno) % rkfs_blocks_per_group(sb))
+#define rkfs_inode_group(sb,ino)   ((ino) / rkfs_inodes_per_group(sb))
+#define rkfs_inode_bit(sb,ino)     ((ino) % rkfs_inodes_per_group(sb))
+#define rkfs_group_first_block(sb,index) \
+        ((unsigned long)(index) * rkfs_blocks_per_group(sb))
+#define rkfs_group_first_inode(sb,index) \
+        ((unsigned long)(index) * rkfs_inodes_per_group(sb))
+
+/*
+* Returned by the group bitmap searches when nothing was found.
+*/
+#define RKFS_NO_BIT                  0xffff
+
+static inline struct rkfs_inode_info *RKFS_I(struct inode *inode)
+{
+	return container_of(inode, struct rkfs_inode_info, vfs_inode);
+}
+
+static inline unsigned long rkfs_get_ptr(struct super_block *sb, void *p)
+{
+	if (rkfs_is_32bit(sb))
+		return *(__u32 *) p;
+	return *(__u16 *) p;
+}
+
+static inline void rkfs_set_ptr(struct super_block *sb, void *p,
+				unsigned long blkno)
+{
+	if (rkfs_is_32bit(sb))
+		*(__u32 *) p = blkno;
+	else
+		*(__u16 *) p = blkno;
+}
+
+/*
+* Inode table map entries, in the format of the filesystem.
+*/
+static inline unsigned long rkfs_itable_block(struct super_block *sb,
+					      struct rkfs_group_info *gi,
+					      int index)
+{
+	if (rkfs_is_32bit(sb))
+		return ((__u32 *)gi->g_itable_map)[index];
+	return ((__u16 (*)[2])gi->g_itable_map)[index][0];
+}
+
+static inline void rkfs_set_itable_block(struct super_block *sb,
+					 struct rkfs_group_info *gi,
+					 int index, unsigned long blkno)
+{
+	if (rkfs_is_32bit(sb))
+		((__u32 *)gi->g_itable_map)[index] = blkno;
+	else
+		((__u16 (*)[2])gi->g_itable_map)[index][0] = blkno;
+}
+
+static inline __u16 *rkfs_itable_count(struct super_block *sb,
+				       struct rkfs_group_info *gi, int index)
+{
+	if (rkfs_is_32bit(sb))
+		return rkfs_itable_map32_count(gi->g_itable_map,
+					       sb->u.rkfs_sb.s_itable_entries) +
+		    index;
+	return &((__u16 (*)[2])gi->g_itable_map)[index][1];
+}
+
+#define rkfs_max_filename_len(sb) \
+        (rkfs_is_32bit(sb) ? RKFS_MAX_FILENAME_LEN32 : RKFS_MAX_FILENAME_LEN)
+#define rkfs_dir_entry_len(sb,nlen) \
+        (rkfs_is_32bit(sb) ? RKFS_DIR_ENTRY32_LEN(nlen) : RKFS_DIR_ENTRY_LEN(nlen))
+
+static inline unsigned long rkfs_de_inode(struct super_block *sb,
+					  struct rkfs_dir_entry *de)
+{
+	if (rkfs_is_32bit(sb))
+		return ((struct rkfs_dir_entry32 *)de)->de_inode;
+	return de->de_inode;
+}
+
+static inline void rkfs_de_set_inode(struct super_block *sb,
+				     struct rkfs_dir_entry *de,
+				     unsigned long ino)
+{
+	if (rkfs_is_32bit(sb))
+		((struct rkfs_dir_entry32 *)de)->de_inode = ino;
+	else
+		de->de_inode = ino;
+}
+
+static inline unsigned short rkfs_de_name_len(struct super_block *sb,
+					      struct rkfs_dir_entry *de)
+{
+	if (rkfs_is_32bit(sb))
+		return ((struct rkfs_dir_entry32 *)de)->de_name_len;
+	return de->de_name_len;
+}
+
+static inline void rkfs_de_set_name_len(struct super_block *sb,
+					struct rkfs_dir_entry *de,
+					unsigned short len)
+{
+	if (rkfs_is_32bit(sb))
+		((struct rkfs_dir_entry32 *)de)->de_name_len = len;
+	else
+		de->de_name_len = len;
+}
+
+#define rkfs_de_rec_len(sb,de) \
+        rkfs_dir_entry_len(sb, rkfs_de_name_len(sb, de))
+
+static inline char *rkfs_de_name(struct super_block *sb,
+				 struct rkfs_dir_entry *de)
+{
+	if (rkfs_is_32bit(sb))
+		return ((struct rkfs_dir_entry32 *)de)->de_name;
+	return de->de_name;
+}
 
 /*
 * Some useful macros....
 */
-#define rkfs_max_file_size(tb,sb_count) (((tb - (sb_count * 2)) - 2) * 1024)
+#define rkfs_max_file_size(tb,sb_count,bsize) \
+        ((loff_t)(((tb) - ((sb_count) * 2)) - 2) * (bsize))
+#define RKFS_MAX_FILE_SIZE32         0xffffffffULL	//i_size is 32 bits
+
+/*
+* First group of the flex group of group 'index', block of the
+* superblock of group 'index' (in the packed area of its flex group on
+* v2, see RKFS_V2_FLEX_SHIFT), number of blocks in a group (the last one
+* may be partial) and, for v1, the first allocatable bit of a group
+* (group 0 keeps boot sector, superblock, first inode table & root dir
+* block; others keep their superblock).
+*/
+#define rkfs_flex_first_group(sb,index) \
+        (((index) >> (sb)->u.rkfs_sb.s_log_groups_per_flex) << \
+         (sb)->u.rkfs_sb.s_log_groups_per_flex)
+
+static inline unsigned long rkfs_group_sb_block(struct super_block *sb,
+						unsigned long index)
+{
+	unsigned long first = rkfs_flex_first_group(sb, index);
+
+	return (first ? rkfs_group_first_block(sb, first) : RKFS_SUPER_BLOCK) +
+	    (index - first) * RKFS_V2_GROUP_META_BLOCKS;
+}
+
+#define RKFS_GROUP_FIRST_BIT(index) ((index) ? 1 : RKFS_FIRST_BLOCK)
+#define rkfs_group_blocks(sb,index) \
+        (((sb)->u.rkfs_sb.s_total_blocks - \
+          rkfs_group_first_block(sb, index) > rkfs_blocks_per_group(sb)) ? \
+         rkfs_blocks_per_group(sb) : \
+         ((sb)->u.rkfs_sb.s_total_blocks - rkfs_group_first_block(sb, index)))
 
 #define rkfs_printk(f,a...) \
         do { \
@@ -201,12 +581,29 @@ void rkfs_dump_rkfs_dir_entry(const struct rkfs_dir_entry *rkfs_de,
 /*
 * rkf/bitmap.c
 */
-unsigned short rkfs_count_free(void *map, unsigned short offset,
-			       unsigned short total_blocks);
+unsigned short rkfs_count_free(void *map, unsigned short nbits);
+
+/*
+* rkf/freeext.c
+*/
+int rkfs_init_free_extents(void);
+void rkfs_destroy_free_extents(void);
+int rkfs_fe_build(struct rkfs_group_info *rkfs_gi);
+void rkfs_fe_release(struct rkfs_group_info *rkfs_gi);
+void rkfs_fe_remove(struct rkfs_group_info *rkfs_gi, unsigned short bit,
+		    unsigned short len);
+void rkfs_fe_insert(struct rkfs_group_info *rkfs_gi, unsigned short bit,
+		    unsigned short len);
+unsigned short rkfs_fe_find(struct rkfs_group_info *rkfs_gi,
+			    unsigned short start, unsigned short count,
+			    unsigned short *res_len);
 
 /*
 * rkf/super.c
 */
+void rkfs_mark_group_dirty(struct super_block *vfs_sb, unsigned short index,
+			   struct buffer_head *bh);
+void rkfs_sync_group(struct super_block *vfs_sb, unsigned short index);
 void rkfs_write_super(struct super_block *vfs_sb);
 void rkfs_put_super(struct super_block *vfs_sb);
 int rkfs_statfs(struct super_block *vfs_sb, struct statfs *sbuf);
@@ -217,6 +614,8 @@ struct super_block *rkfs_read_super(struct super_block *vfs_sb,
 * rkf/inode.c
 */
 void rkfs_read_inode(struct inode *vfs_inode);
+unsigned long rkfs_inode_readahead(struct super_block *vfs_sb,
+				   unsigned long ino, unsigned long last);
 int rkfs_update_inode(struct inode *vfs_inode, int sync);
 void rkfs_write_inode(struct inode *vfs_inode, int sync);
 void rkfs_put_inode(struct inode *vfs_inode);
@@ -229,34 +628,85 @@ void rkfs_clear_inode(struct inode *vfs_inode);
 */
 int rkfs__free_blocks(struct super_block *vfs_sb,
 		      struct inode *vfs_inode,
-		      unsigned short blkno, unsigned short count);
-int rkfs_free_blocks(struct inode *vfs_inode, unsigned short blkno,
+		      unsigned long blkno, unsigned short count);
+int rkfs_free_blocks(struct inode *vfs_inode, unsigned long blkno,
 		     unsigned short count);
-int rkfs_free_inode_block(struct super_block *vfs_sb, unsigned short iblkno);
+int rkfs_free_inode_block(struct super_block *vfs_sb, unsigned long iblkno);
+int rkfs__new_blocks(struct super_block *vfs_sb,
+		     struct inode *vfs_inode, unsigned long goal,
+		     unsigned short count, unsigned long *res_blkno,
+		     unsigned short *res_count, unsigned long *claim);
 int rkfs__new_block(struct super_block *vfs_sb,
-		    struct inode *vfs_inode, unsigned short *res_blkno);
-int rkfs_new_block(struct inode *vfs_inode, unsigned short *res_blkno);
-int rkfs_new_inode_block(struct inode *vfs_inode, unsigned short *res_blkno);
+		    struct inode *vfs_inode, unsigned long goal,
+		    unsigned long *res_blkno);
+int rkfs_new_blocks(struct inode *vfs_inode, unsigned long goal,
+		    unsigned short count, unsigned long *res_blkno,
+		    unsigned short *res_count, unsigned long *claim);
+int rkfs_new_block(struct inode *vfs_inode, unsigned long goal,
+		   unsigned long *res_blkno);
+int rkfs_new_inode_block(struct inode *vfs_inode, unsigned long goal,
+			 unsigned long *res_blkno);
+unsigned short rkfs__prealloc(struct super_block *vfs_sb,
+			      unsigned long blkno, unsigned short window);
+void rkfs_discard_prealloc(struct inode *vfs_inode);
+int rkfs_reserve_blocks(struct inode *vfs_inode, unsigned long count,
+			unsigned long meta);
+void rkfs_release_blocks(struct inode *vfs_inode, unsigned long count);
+unsigned long rkfs_da_claim_meta(struct inode *vfs_inode);
+void rkfs_da_allocated(struct inode *vfs_inode, unsigned long count,
+		       unsigned long used, unsigned long meta, int err);
+void rkfs_flush_discards(struct super_block *vfs_sb);
+int rkfs_trim_fs(struct super_block *vfs_sb, struct fstrim_range *range);
 
 /*
 * rkf/ialloc.c
 */
 int rkfs_free_inode(struct inode *vfs_inode,
-		    unsigned short *res_icount, unsigned short *res_iblkno);
+		    unsigned short *res_icount, unsigned long *res_iblkno);
 int rkfs_new_inode(struct inode *vfs_pinode, int mode,
 		   struct inode **vfs_cinode);
 
+/*
+* rkf/ioctl.c
+*/
+int rkfs_ioctl(struct inode *vfs_inode, struct file *filp, unsigned int cmd,
+	       unsigned long arg);
+
 /*
 * rkf/asops.c
 */
 extern struct address_space_operations rkfs_aops;
+extern struct address_space_operations rkfs_da_aops;
+int rkfs_inline_to_block(struct inode *vfs_inode);
+
+#define rkfs_file_aops(sb) \
+        (rkfs_test_opt(sb, DELALLOC) ? &rkfs_da_aops : &rkfs_aops)
 
 /*
 * rkf/itree.c
 */
 extern int rkfs_get_block(struct inode *vfs_inode, long blkno,
 			  struct buffer_head *bh_result, int create);
+int rkfs__get_block(struct inode *vfs_inode, long blkno,
+		    struct buffer_head *bh_result, int create,
+		    unsigned long *claim);
 extern void rkfs_truncate(struct inode *vfs_inode);
+int rkfs_map_lookup(struct inode *vfs_inode, long blkno,
+		    struct buffer_head *bh_result, int maxblocks);
+void rkfs_map_remember(struct inode *vfs_inode, long blkno,
+		       unsigned long phys, unsigned long count);
+void rkfs_map_forget(struct inode *vfs_inode);
+int rkfs_da_meta_blocks(struct inode *vfs_inode, long blkno, int prev);
+
+/*
+* rkf/extents.c
+*/
+void rkfs_ext_init(struct inode *vfs_inode);
+int rkfs_ext_get_block(struct inode *vfs_inode, long blkno,
+		       struct buffer_head *bh_result, int create,
+		       unsigned long *claim);
+void rkfs_ext_truncate(struct inode *vfs_inode);
+int rkfs_ext_da_meta(struct inode *vfs_inode);
 
 /*
 * rkf/file.c
@@ -265,11 +715,13 @@ extern struct file_operations rkfs_file_operations;
 extern struct inode_operations rkfs_file_inode_operations;
 extern int rkfs_sync_file(struct file *file, struct dentry *dentry,
 			  int datasync);
+extern int rkfs_release_file(struct inode *vfs_inode, struct file *filp);
 
 /*
 * rkf/namei.c
 */
 extern struct inode_operations rkfs_dir_inode_operations;
+extern struct inode_operations rkfs_fast_symlink_inode_operations;
 struct dentry *rkfs_lookup(struct inode *dir, struct dentry *dentry);
 int rkfs_create(struct inode *dir, struct dentry *dentry, int mode);
 int rkfs_mknod(struct inode *dir, struct dentry *dentry, int mode, int rdev);
@@ -13,8 +13,33 @@
 #ifndef __RKFS_I_H__
 #define __RKFS_I_H__
 
+#include <linux/fs.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+
+/*
+* In-core rkfs inode, allocated from rkfs_inode_cachep with the VFS
+* inode embedded at its end (see rkfs_alloc_inode & RKFS_I).
+*/
 struct rkfs_inode_info {
-	__u16 i_block[41];
+	__u32 i_data[21];	//41 16-bit or 20 32-bit block pointers
+	spinlock_t i_prealloc_lock;	//Protects the window below
+	__u32 i_prealloc_block;	//Next block of the preallocation window
+	__u16 i_prealloc_count;	//Blocks left in the window
+	spinlock_t i_da_lock;	//Protects the delayed range below
+	__u32 i_da_start;	//First block of the delayed range
+	__u32 i_da_len;		//Blocks in the delayed range
+	__u32 i_da_blocks;	//Delayed data blocks reserved
+	__u32 i_da_meta;	//Reserved for their indirect/extent blocks
+	__u16 i_inline;		//i_data holds the data (see RKFS_INLINE_MAGIC)
+	__u16 i_extents;	//i_data holds extents (see RKFS_EXT_MAGIC)
+	struct rw_semaphore i_map_sem;	//Shared to map blocks, exclusive
+					//to allocate or truncate them
+	spinlock_t i_map_lock;	//Protects the mapping cache below
+	__u32 i_map_block;	//Mapping cache (see rkfs_map_lookup):
+	__u32 i_map_phys;	//i_map_len blocks from i_map_block
+	__u32 i_map_len;	//on map to i_map_phys on
+	struct inode vfs_inode;
 };
 
 #endif
@@ -13,9 +13,90 @@
 #ifndef __RKFS_SB_H__
 #define __RKFS_SB_H__
 
+#include <linux/spinlock.h>
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
+#include <linux/list.h>
+#include <asm/atomic.h>
+
+/*
+* In-memory summary of a group, kept in sync with its bitmaps by the
+* allocators so that full groups can be skipped without a bitmap scan.
+* g_lock covers the group's bitmaps, inode table map and counts, and
+* the free extent index (see freeext.c).
+*
+* The maps are reached through g_block_map/g_inode_map/g_itable_map
+* whatever the layout: on v1 they point into the group superblock
+* buffer, on v2 into the map blocks, which the g_*_bh hold. The inode
+* table map is only accessed through rkfs_itable_block/count.
+*/
+#define RKFS_FREE_BUCKETS 16	//fls(largest group: 8 * 4 KB bits)
+
+struct rkfs_group_info {
+	spinlock_t g_lock;
+	struct buffer_head *g_bmap_bh;	//Buffer of the block bitmap
+	struct buffer_head *g_imap_bh;	//Buffer of the inode bitmap
+	struct buffer_head *g_itmap_bh;	//Buffer of the inode table map
+	void *g_block_map;
+	void *g_inode_map;
+	void *g_itable_map;	//__u16 [][2], or __u32 [] + __u16 []
+	unsigned short g_blocks;	//Blocks in the group
+	unsigned short g_inodes;	//Inodes in the group
+	unsigned short g_first_bit;	//First allocatable bit
+	unsigned short g_free_blocks;
+	unsigned short g_free_inodes;
+	unsigned short g_last_bit;	//Next-fit hint: end of last allocation
+	unsigned short g_free_valid;	//Free extent index usable
+	struct rb_root g_free_root;	//Free runs by start
+	struct list_head g_free_size[RKFS_FREE_BUCKETS];	//By log2 length
+};
+
+/*
+* Range of freed blocks waiting to be discarded ('discard' mount option).
+*/
+struct rkfs_discard_range {
+	struct list_head dr_list;
+	unsigned long dr_blkno;
+	unsigned short dr_count;
+};
+
 struct rkfs_sb_info {
+	unsigned short s_version;	//RKFS_VER or RKFS_VER2
+	unsigned long s_features;	//RKFS_FEATURE_*, v2 only
+	unsigned long s_total_blocks;
 	unsigned short s_sb_count;
+	unsigned short s_blocks_per_group;
+	unsigned short s_inodes_per_group;
+	unsigned short s_inode_size;	//On-disk inode size
+	unsigned short s_inodes_per_block;
+	unsigned short s_itable_entries;	//Inode table map entries
+	unsigned short s_log_groups_per_flex;	//0 on v1
 	struct buffer_head **s_sbh;
+	struct rkfs_group_info *s_groups;
+	unsigned long *s_dirty_groups;	//Groups to write at write_super
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	unsigned short s_prealloc_window;
+	unsigned long s_mount_opt;
+	spinlock_t s_reserve_lock;
+	unsigned long s_reserved_blocks;	//Delayed allocation reservations
+	spinlock_t s_discard_lock;
+	struct list_head s_discard_list;	//Freed ranges to discard
+	unsigned short s_last_group;	//Group of the last block allocation
+	atomic_t s_alloc_calls;	//Statistics, see RKFS_IOC_GETSTATS
+	atomic_t s_alloc_groups;
+	atomic_t s_alloc_bits;
+	atomic_t s_map_lookups;
+	atomic_t s_map_hits;
 };
 
+/*
+* Mount flags (s_mount_opt)
+*/
+#define RKFS_MOUNT_DELALLOC 0x0001
+#define RKFS_MOUNT_DISCARD  0x0002
+#define RKFS_MOUNT_TIMING   0x0004
+
+#define rkfs_test_opt(sb,opt) ((sb)->u.rkfs_sb.s_mount_opt & RKFS_MOUNT_##opt)
+
 #endif
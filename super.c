@@ -15,24 +15,134 @@
 #include <linux/slab.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
 
 #include "rkfs.h"
 
+static struct kmem_cache *rkfs_inode_cachep;
+
+static struct inode *rkfs_alloc_inode(struct super_block *vfs_sb)
+{
+	struct rkfs_inode_info *rkfs_ii = NULL;
+
+	if (!(rkfs_ii = kmem_cache_alloc(rkfs_inode_cachep, GFP_KERNEL)))
+		return NULL;
+
+	return &rkfs_ii->vfs_inode;
+}
+
+static void rkfs_destroy_inode(struct inode *vfs_inode)
+{
+	kmem_cache_free(rkfs_inode_cachep, RKFS_I(vfs_inode));
+}
+
+/*
+* Slab constructor: what stays valid across reuse of a cached inode is
+* set up once here, the rest by rkfs_read_inode/rkfs_new_inode.
+*/
+static void rkfs_init_once(void *foo)
+{
+	struct rkfs_inode_info *rkfs_ii = foo;
+
+	spin_lock_init(&rkfs_ii->i_prealloc_lock);
+	spin_lock_init(&rkfs_ii->i_da_lock);
+	init_rwsem(&rkfs_ii->i_map_sem);
+	spin_lock_init(&rkfs_ii->i_map_lock);
+	inode_init_once(&rkfs_ii->vfs_inode);
+}
+
+static int rkfs_init_inodecache(void)
+{
+	rkfs_inode_cachep = kmem_cache_create("rkfs_inode_cache",
+					      sizeof(struct rkfs_inode_info),
+					      0, SLAB_RECLAIM_ACCOUNT |
+					      SLAB_MEM_SPREAD, rkfs_init_once);
+	if (rkfs_inode_cachep == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void rkfs_destroy_inodecache(void)
+{
+	kmem_cache_destroy(rkfs_inode_cachep);
+}
+
 static const struct super_operations rkfs_sops = {
+	.alloc_inode = rkfs_alloc_inode,
+	.destroy_inode = rkfs_destroy_inode,
 	.put_super = rkfs_put_super,
 	.write_super = rkfs_write_super,
 	.statfs = rkfs_statfs,
 	.read_inode = rkfs_read_inode,
 	.write_inode = rkfs_write_inode,
+	.put_inode = rkfs_put_inode,
 	.delete_inode = rkfs_delete_inode,
 };
 
+/*
+* Record that 'bh', one of the metadata buffers of group 'index', was
+* modified, for the next rkfs_write_super.
+*/
+void rkfs_mark_group_dirty(struct super_block *vfs_sb, unsigned short index,
+			   struct buffer_head *bh)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+
+	mark_buffer_dirty(bh);
+	set_bit(index, rkfs_sbi->s_dirty_groups);
+	vfs_sb->s_dirt = 1;
+}
+
+/*
+* The buffers the allocators modify in a group, each one once: the
+* group superblock on v1, the map blocks on v2.
+*/
+static int rkfs_group_buffers(struct rkfs_group_info *rkfs_gi,
+			      struct buffer_head **bhs)
+{
+	int n = 0;
+
+	bhs[n++] = rkfs_gi->g_bmap_bh;
+	if (rkfs_gi->g_imap_bh != rkfs_gi->g_bmap_bh)
+		bhs[n++] = rkfs_gi->g_imap_bh;
+	if (rkfs_gi->g_itmap_bh != rkfs_gi->g_bmap_bh &&
+	    rkfs_gi->g_itmap_bh != rkfs_gi->g_imap_bh)
+		bhs[n++] = rkfs_gi->g_itmap_bh;
+
+	return n;
+}
+
+/*
+* Write the modified metadata buffers of group 'index' and wait for
+* them (synchronous mounts).
+*/
+void rkfs_sync_group(struct super_block *vfs_sb, unsigned short index)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+	struct buffer_head *bhs[3];
+	int i = 0, n = 0;
+
+	n = rkfs_group_buffers(&rkfs_sbi->s_groups[index], bhs);
+	ll_rw_block(WRITE, n, bhs);
+	for (i = 0; i < n; i++)
+		wait_on_buffer(bhs[i]);
+}
+
+/*
+* Write out the metadata of the groups changed since the last call.
+* Dirty buffers are submitted RKFS_WRITE_BATCH at a time and waited for
+* once at the end, rather than one round trip per group.
+*/
 void rkfs_write_super(struct super_block *vfs_sb)
 {
-	unsigned short i = 0, rkfs_sb_count = 0;
+	unsigned short i = 0, n = 0, rkfs_sb_count = 0;
 	struct rkfs_sb_info *rkfs_sbi = NULL;
 	struct buffer_head *bh = NULL;
+	struct buffer_head *bhs[RKFS_WRITE_BATCH], *gbhs[3];
 	struct rkfs_super_block *rkfs_dsb = NULL;
+	int j = 0, nr = 0;
 
 	if (vfs_sb == NULL) {
 		rkfs_bug("VFS superblock is NULL\n");
@@ -41,10 +151,12 @@ void rkfs_write_super(struct super_block *vfs_sb)
 
 	rkfs_sbi = vfs_sb->s_fs_info;
 	rkfs_sb_count = rkfs_sbi->s_sb_count;
-	rkfs_debug("Number of %s superblocks to write: %d\n", RKFS_NAME,
-		   rkfs_sb_count);
+	vfs_sb->s_dirt = 0;
 
 	for (i = 0; i < rkfs_sb_count; i++) {
+		if (!test_and_clear_bit(i, rkfs_sbi->s_dirty_groups))
+			continue;
+
 		if (!(bh = rkfs_sbi->s_sbh[i])) {
 			rkfs_bug("No %s superblock in memory\n", RKFS_NAME);
 			goto out;
@@ -56,12 +168,33 @@ void rkfs_write_super(struct super_block *vfs_sb)
 			goto out;
 		}
 
-		mark_buffer_dirty(bh);
-		ll_rw_block(WRITE, 1, &bh);
-		wait_on_buffer(bh);
+		nr = rkfs_group_buffers(&rkfs_sbi->s_groups[i], gbhs);
+		for (j = 0; j < nr; j++) {
+			if (!buffer_dirty(gbhs[j]))
+				continue;
+
+			bhs[n++] = gbhs[j];
+			if (n == RKFS_WRITE_BATCH) {
+				ll_rw_block(WRITE, n, bhs);
+				n = 0;
+			}
+		}
 	}
 
-	vfs_sb->s_dirt = 0;
+	if (n)
+		ll_rw_block(WRITE, n, bhs);
+
+	for (i = 0; i < rkfs_sb_count; i++) {
+		nr = rkfs_group_buffers(&rkfs_sbi->s_groups[i], gbhs);
+		for (j = 0; j < nr; j++)
+			wait_on_buffer(gbhs[j]);
+	}
+
+	rkfs_debug("Wrote dirty %s group metadata\n", RKFS_NAME);
+
+	if (rkfs_test_opt(vfs_sb, DISCARD))
+		rkfs_flush_discards(vfs_sb);
+
 	return;
 
  out:
@@ -69,6 +202,69 @@ void rkfs_write_super(struct super_block *vfs_sb)
 	return;
 }
 
+/*
+* Drop the v2 map block buffers of the groups (v1 maps live in the group
+* superblock buffers, which are released with those).
+*/
+static void rkfs_release_group_maps(struct rkfs_sb_info *rkfs_sbi)
+{
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned short i = 0;
+
+	if (rkfs_sbi->s_version != RKFS_VER2)
+		return;
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		rkfs_gi = &rkfs_sbi->s_groups[i];
+		brelse(rkfs_gi->g_bmap_bh);
+		brelse(rkfs_gi->g_imap_bh);
+		brelse(rkfs_gi->g_itmap_bh);
+		rkfs_gi->g_bmap_bh = rkfs_gi->g_imap_bh = NULL;
+		rkfs_gi->g_itmap_bh = NULL;
+	}
+}
+
+/*
+* Undo rkfs_init_groups().
+*/
+static void rkfs_destroy_groups(struct rkfs_sb_info *rkfs_sbi)
+{
+	unsigned short i = 0;
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++)
+		rkfs_fe_release(&rkfs_sbi->s_groups[i]);
+	rkfs_release_group_maps(rkfs_sbi);
+	percpu_counter_destroy(&rkfs_sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&rkfs_sbi->s_freeinodes_counter);
+	kfree(rkfs_sbi->s_dirty_groups);
+	kfree(rkfs_sbi->s_groups);
+}
+
+/*
+* The v2 group superblocks carry the free counts of their group for the
+* tools. The allocators never touch them, they are brought up to date
+* at umount only.
+*/
+static void rkfs_write_group_counts(struct super_block *vfs_sb)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+	struct rkfs_super_block2 *rkfs_dsb2 = NULL;
+	struct buffer_head *bh = NULL;
+	unsigned short i = 0;
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		bh = rkfs_sbi->s_sbh[i];
+		rkfs_dsb2 = (struct rkfs_super_block2 *)((char *)bh->b_data);
+		rkfs_dsb2->s_free_blocks = rkfs_sbi->s_groups[i].g_free_blocks;
+		rkfs_dsb2->s_free_inodes = rkfs_sbi->s_groups[i].g_free_inodes;
+		mark_buffer_dirty(bh);
+		ll_rw_block(WRITE, 1, &bh);
+	}
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++)
+		wait_on_buffer(rkfs_sbi->s_sbh[i]);
+}
+
 void rkfs_put_super(struct super_block *vfs_sb)
 {
 	unsigned short i = 0, rkfs_sb_count = 0;
@@ -85,6 +281,11 @@ void rkfs_put_super(struct super_block *vfs_sb)
 	rkfs_debug("Number of %s superblocks to put: %d\n", RKFS_NAME,
 		   rkfs_sb_count);
 
+	rkfs_flush_discards(vfs_sb);
+	if (rkfs_sbi->s_version == RKFS_VER2 &&
+	    !(vfs_sb->s_flags & MS_RDONLY))
+		rkfs_write_group_counts(vfs_sb);
+
 	for (i = 0; i < rkfs_sb_count; i++) {
 		if (!(bh = rkfs_sbi->s_sbh[i])) {
 			rkfs_bug("No %s superblock in memory\n", RKFS_NAME);
@@ -95,6 +296,7 @@ void rkfs_put_super(struct super_block *vfs_sb)
 	}
 
 	kfree(rkfs_sbi->s_sbh);
+	rkfs_destroy_groups(rkfs_sbi);
 	rkfs_sbi->s_sb_count = 0;
 	return;
 
@@ -107,8 +309,7 @@ int rkfs_statfs(struct super_block *vfs_sb, struct statfs *sbuf)
 {
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
-	unsigned short i = 0, rkfs_sb_count = 0;
-	unsigned short offset = 0, tb = 0, fb = 0, fi = 0;
+	unsigned long fb = 0, fi = 0;
 	int err = -EIO;
 	struct rkfs_sb_info *rkfs_sbi = NULL;
 
@@ -124,33 +325,36 @@ int rkfs_statfs(struct super_block *vfs_sb, struct statfs *sbuf)
 
 	sbuf->f_type = RKFS_ID;
 	sbuf->f_bsize = vfs_sb->s_blocksize;
-	sbuf->f_namelen = RKFS_MAX_FILENAME_LEN;
+	sbuf->f_namelen = rkfs_max_filename_len(vfs_sb);
 
 	rkfs_sbi = vfs_sb->s_fs_info;
-	rkfs_sb_count = rkfs_sbi->s_sb_count;
-	for (i = 0; i < rkfs_sb_count; i++) {
-		if (!(bh = rkfs_sbi->s_sbh[i])) {
-			rkfs_bug("No %s superblock in memory\n", RKFS_NAME);
-			goto out;
-		}
-
-		rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
-		if (rkfs_dsb->s_fsid != RKFS_ID) {
-			rkfs_bug("No valid %s superblock found\n", RKFS_NAME);
-			goto out;
-		}
+	if (!(bh = rkfs_sbi->s_sbh[0])) {
+		rkfs_bug("No %s superblock in memory\n", RKFS_NAME);
+		goto out;
+	}
 
-		tb = rkfs_dsb->s_total_blocks;
-		fb += rkfs_count_free(rkfs_dsb->s_block_map, offset, tb);
-		fi += rkfs_count_free(rkfs_dsb->s_inode_map, offset, tb);
-		offset += RKFS_MIN_BLOCKS;
+	rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
+	if (rkfs_dsb->s_fsid != RKFS_ID) {
+		rkfs_bug("No valid %s superblock found\n", RKFS_NAME);
+		goto out;
 	}
 
-	sbuf->f_blocks = tb;
+	/*
+	 * Free counts are maintained by the allocators, no bitmap walk.
+	 * Blocks reserved by delayed allocation are not free any more.
+	 */
+	fb = percpu_counter_read_positive(&rkfs_sbi->s_freeblocks_counter);
+	if (fb > rkfs_sbi->s_reserved_blocks)
+		fb -= rkfs_sbi->s_reserved_blocks;
+	else
+		fb = 0;
+	fi = percpu_counter_read_positive(&rkfs_sbi->s_freeinodes_counter);
+
+	sbuf->f_blocks = rkfs_sbi->s_total_blocks;
 	sbuf->f_bfree = sbuf->f_bavail = fb;
 
 	if (fi > fb) {
-		rkfs_debug("Too many free inodes (%d) (> avail free blocks)\n",
+		rkfs_debug("Too many free inodes (%ld) (> avail free blocks)\n",
 			   fi);
 		fi = fb;
 	}
@@ -160,8 +364,8 @@ int rkfs_statfs(struct super_block *vfs_sb, struct statfs *sbuf)
 	rkfs_debug("Optimal transfer block size: %ld\n", sbuf->f_bsize);
 	rkfs_debug("Maximum filename length: %ld\n", sbuf->f_namelen);
 	rkfs_debug("Total blocks in fs: %ld\n", sbuf->f_blocks);
-	rkfs_debug("Free blocks in fs: %d\n", fb);
-	rkfs_debug("Free inodes in fs: %d\n", fi);
+	rkfs_debug("Free blocks in fs: %ld\n", fb);
+	rkfs_debug("Free inodes in fs: %ld\n", fi);
 
 	return 0;
 
@@ -170,18 +374,350 @@ int rkfs_statfs(struct super_block *vfs_sb, struct statfs *sbuf)
 	return err;
 }
 
+/*
+* Point every group at its maps. v1 keeps them in the group superblock;
+* v2 has them in blocks of their own, all of which are read ahead before
+* the first one is waited for.
+*/
+static int rkfs_load_group_maps(struct super_block *vfs_sb)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+	struct rkfs_group_info *rkfs_gi = NULL;
+	struct rkfs_super_block *rkfs_dsb = NULL;
+	struct rkfs_super_block2 *rkfs_dsb2 = NULL;
+	unsigned long tb = rkfs_sbi->s_total_blocks;
+	unsigned short i = 0;
+
+	/*
+	 * v1 groups have as many inodes as blocks, the last one too; v2
+	 * groups all have s_inodes_per_group.
+	 */
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		rkfs_gi = &rkfs_sbi->s_groups[i];
+		rkfs_gi->g_blocks = rkfs_group_blocks(vfs_sb, i);
+		if (rkfs_sbi->s_version == RKFS_VER2) {
+			rkfs_gi->g_inodes = rkfs_sbi->s_inodes_per_group;
+			continue;
+		}
+
+		rkfs_gi->g_inodes = rkfs_gi->g_blocks;
+
+		rkfs_dsb = (struct rkfs_super_block *)
+		    ((char *)rkfs_sbi->s_sbh[i]->b_data);
+		rkfs_gi->g_bmap_bh = rkfs_sbi->s_sbh[i];
+		rkfs_gi->g_imap_bh = rkfs_sbi->s_sbh[i];
+		rkfs_gi->g_itmap_bh = rkfs_sbi->s_sbh[i];
+		rkfs_gi->g_block_map = rkfs_dsb->s_block_map;
+		rkfs_gi->g_inode_map = rkfs_dsb->s_inode_map;
+		rkfs_gi->g_itable_map = rkfs_dsb->s_itable_map;
+		rkfs_gi->g_first_bit = RKFS_GROUP_FIRST_BIT(i);
+	}
+
+	if (rkfs_sbi->s_version != RKFS_VER2)
+		return 0;
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		rkfs_dsb2 = (struct rkfs_super_block2 *)
+		    ((char *)rkfs_sbi->s_sbh[i]->b_data);
+		if (rkfs_dsb2->s_group != i ||
+		    rkfs_dsb2->s_block_map >= tb ||
+		    rkfs_dsb2->s_inode_map >= tb ||
+		    rkfs_dsb2->s_itable_map >= tb ||
+		    (rkfs_flex_first_group(vfs_sb, i) == i &&
+		     !rkfs_dsb2->s_first_block) ||
+		    rkfs_dsb2->s_first_block > rkfs_sbi->s_groups[i].g_blocks) {
+			rkfs_printk("Bad %s superblock for group %d\n",
+				    RKFS_NAME, i);
+			return -EINVAL;
+		}
+
+		sb_breadahead(vfs_sb, rkfs_dsb2->s_block_map);
+		sb_breadahead(vfs_sb, rkfs_dsb2->s_inode_map);
+		sb_breadahead(vfs_sb, rkfs_dsb2->s_itable_map);
+	}
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		rkfs_gi = &rkfs_sbi->s_groups[i];
+		rkfs_dsb2 = (struct rkfs_super_block2 *)
+		    ((char *)rkfs_sbi->s_sbh[i]->b_data);
+		if (!(rkfs_gi->g_bmap_bh = sb_bread(vfs_sb,
+						     rkfs_dsb2->s_block_map)) ||
+		    !(rkfs_gi->g_imap_bh = sb_bread(vfs_sb,
+						     rkfs_dsb2->s_inode_map)) ||
+		    !(rkfs_gi->g_itmap_bh = sb_bread(vfs_sb,
+						      rkfs_dsb2->s_itable_map))) {
+			rkfs_printk("Unable to read the maps of group %d\n",
+				    i);
+			return -EIO;
+		}
+
+		rkfs_gi->g_block_map = rkfs_gi->g_bmap_bh->b_data;
+		rkfs_gi->g_inode_map = rkfs_gi->g_imap_bh->b_data;
+		rkfs_gi->g_itable_map = (__u16 (*)[2])rkfs_gi->g_itmap_bh->b_data;
+		rkfs_gi->g_first_bit = rkfs_dsb2->s_first_block;
+	}
+
+	return 0;
+}
+
+/*
+* Build the per-group free block/inode counts from the group maps. Done
+* once at mount, the allocators keep them current.
+*/
+static int rkfs_init_groups(struct super_block *vfs_sb)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+	struct rkfs_group_info *rkfs_gi = NULL;
+	unsigned short i = 0;
+	unsigned long fb = 0, fi = 0;
+	int err = -ENOMEM;
+
+	rkfs_sbi->s_groups = kzalloc(rkfs_sbi->s_sb_count *
+				     sizeof(struct rkfs_group_info),
+				     GFP_KERNEL);
+	if (rkfs_sbi->s_groups == NULL) {
+		rkfs_printk("Not enough memory for %s group info\n",
+			    RKFS_NAME);
+		return -ENOMEM;
+	}
+
+	rkfs_sbi->s_dirty_groups = kzalloc(BITS_TO_LONGS(rkfs_sbi->s_sb_count) *
+					   sizeof(unsigned long), GFP_KERNEL);
+	if (rkfs_sbi->s_dirty_groups == NULL) {
+		rkfs_printk("Not enough memory for %s group info\n",
+			    RKFS_NAME);
+		kfree(rkfs_sbi->s_groups);
+		return -ENOMEM;
+	}
+
+	if ((err = rkfs_load_group_maps(vfs_sb)))
+		goto release_groups;
+
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++) {
+		rkfs_gi = &rkfs_sbi->s_groups[i];
+		spin_lock_init(&rkfs_gi->g_lock);
+		rkfs_gi->g_last_bit = 0;
+		/*
+		 * Without an index the group is searched through its
+		 * bitmap, so running short of memory here is no error.
+		 */
+		if (rkfs_fe_build(rkfs_gi))
+			rkfs_printk("No free extent index for group %d\n", i);
+		rkfs_gi->g_free_blocks =
+		    rkfs_count_free(rkfs_gi->g_block_map, rkfs_gi->g_blocks);
+		rkfs_gi->g_free_inodes =
+		    rkfs_count_free(rkfs_gi->g_inode_map, rkfs_gi->g_inodes);
+
+		fb += rkfs_gi->g_free_blocks;
+		fi += rkfs_gi->g_free_inodes;
+	}
+
+	err = -ENOMEM;
+
+	/*
+	 * Per-cpu counters keep the totals off the allocators' hot path.
+	 * statfs and the allocation hints make do with the approximate
+	 * value; block reservations sum them exactly (see
+	 * rkfs_free_blocks_exact).
+	 */
+	if (percpu_counter_init(&rkfs_sbi->s_freeblocks_counter, fb))
+		goto release_groups;
+	if (percpu_counter_init(&rkfs_sbi->s_freeinodes_counter, fi)) {
+		percpu_counter_destroy(&rkfs_sbi->s_freeblocks_counter);
+		goto release_groups;
+	}
+	spin_lock_init(&rkfs_sbi->s_reserve_lock);
+	spin_lock_init(&rkfs_sbi->s_discard_lock);
+	INIT_LIST_HEAD(&rkfs_sbi->s_discard_list);
+	rkfs_sbi->s_last_group = 0;
+	atomic_set(&rkfs_sbi->s_alloc_calls, 0);
+	atomic_set(&rkfs_sbi->s_alloc_groups, 0);
+	atomic_set(&rkfs_sbi->s_alloc_bits, 0);
+	atomic_set(&rkfs_sbi->s_map_lookups, 0);
+	atomic_set(&rkfs_sbi->s_map_hits, 0);
+
+	rkfs_debug("Free blocks: %ld, free inodes: %ld\n", fb, fi);
+	return 0;
+
+ release_groups:
+	for (i = 0; i < rkfs_sbi->s_sb_count; i++)
+		rkfs_fe_release(&rkfs_sbi->s_groups[i]);
+	rkfs_release_group_maps(rkfs_sbi);
+	kfree(rkfs_sbi->s_dirty_groups);
+	kfree(rkfs_sbi->s_groups);
+	rkfs_sbi->s_groups = NULL;
+	return err;
+}
+
+/*
+* Mount options:
+* prealloc=<n> - per-inode preallocation window in blocks (0 disables)
+* delalloc     - allocate data blocks at writeback instead of write(2)
+* discard      - discard freed blocks on the device, in batches
+* mount_timing - log how long the stages of the mount took
+*/
+static int rkfs_parse_options(char *options, struct rkfs_sb_info *rkfs_sbi)
+{
+	char *p = NULL, *value = NULL, *end = NULL;
+	unsigned long n = 0;
+
+	rkfs_sbi->s_prealloc_window = RKFS_DEFAULT_PREALLOC;
+	rkfs_sbi->s_mount_opt = 0;
+	rkfs_sbi->s_reserved_blocks = 0;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		if ((value = strchr(p, '=')) != NULL)
+			*value++ = 0;
+
+		if (!strcmp(p, "prealloc")) {
+			if (!value || !*value)
+				goto bad_value;
+			n = simple_strtoul(value, &end, 0);
+			if (*end || n > RKFS_MAX_PREALLOC)
+				goto bad_value;
+			rkfs_sbi->s_prealloc_window = n;
+		} else if (!strcmp(p, "delalloc")) {
+			if (value)
+				goto bad_value;
+			rkfs_sbi->s_mount_opt |= RKFS_MOUNT_DELALLOC;
+		} else if (!strcmp(p, "discard")) {
+			if (value)
+				goto bad_value;
+			rkfs_sbi->s_mount_opt |= RKFS_MOUNT_DISCARD;
+		} else if (!strcmp(p, "mount_timing")) {
+			if (value)
+				goto bad_value;
+			rkfs_sbi->s_mount_opt |= RKFS_MOUNT_TIMING;
+		} else {
+			rkfs_printk("Unrecognized mount option %s\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+
+ bad_value:
+	rkfs_printk("Bad value for mount option %s\n", p);
+	return -EINVAL;
+}
+
+/*
+ * v1 filesystems always use RKFS_BLOCK_SIZE blocks, v2 ones record the
+ * size in s_log_block_size. The group 0 superblock sits at block
+ * RKFS_SUPER_BLOCK in units of that size, so try each supported size
+ * the device can do and take the first one whose superblock agrees.
+ * On success the VFS superblock is left at that block size.
+ */
+static struct buffer_head *rkfs_find_super(struct super_block *vfs_sb)
+{
+	int size = 0, min_size = vfs_sb->s_blocksize;
+	struct buffer_head *bh = NULL;
+	struct rkfs_super_block *rkfs_dsb = NULL;
+	struct rkfs_super_block2 *rkfs_dsb2 = NULL;
+
+	for (size = RKFS_BLOCK_SIZE; size <= RKFS_MAX_BLOCK_SIZE; size <<= 1) {
+		if (size < min_size)
+			continue;
+
+		if (sb_set_blocksize(vfs_sb, size) != size)
+			continue;
+
+		if (!(bh = sb_bread(vfs_sb, RKFS_SUPER_BLOCK)))
+			continue;
+
+		rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
+		if (rkfs_dsb->s_fsid == RKFS_ID) {
+			if (rkfs_dsb->s_fsver != RKFS_VER2) {
+				if (size == RKFS_BLOCK_SIZE)
+					return bh;
+			} else {
+				rkfs_dsb2 = (struct rkfs_super_block2 *)rkfs_dsb;
+				if (rkfs_dsb2->s_log_block_size <=
+				    RKFS_MAX_LOG_BLOCK_SIZE &&
+				    (RKFS_BLOCK_SIZE <<
+				     rkfs_dsb2->s_log_block_size) == size)
+					return bh;
+			}
+		}
+		brelse(bh);
+	}
+
+	return NULL;
+}
+
+/*
+* Take the group geometry of a v2 filesystem from its superblock, after
+* checking that the maps fit in their blocks and the inode numbers in
+* the directory entries. Zero if it is usable.
+*/
+static int rkfs_check_geometry(struct super_block *vfs_sb,
+			       struct rkfs_super_block2 *rkfs_dsb2)
+{
+	struct rkfs_sb_info *rkfs_sbi = vfs_sb->s_fs_info;
+	unsigned long bsize = vfs_sb->s_blocksize;
+	unsigned long bpg = 0, ipg = 0, isize = 0, ipb = 0, entries = 0;
+	unsigned long groups = 0, log_flex = 0;
+
+	bpg = rkfs_dsb2->s_blocks_per_group;
+	ipg = rkfs_dsb2->s_inodes_per_group;
+	isize = rkfs_dsb2->s_inode_size ? rkfs_dsb2->s_inode_size :
+	    RKFS_INODE_SIZE;
+	if (bpg <= RKFS_V2_FIRST_BLOCK || bpg > RKFS_MAX_GROUP_BITS(bsize) ||
+	    ipg <= RKFS_FIRST_INODE || ipg > RKFS_MAX_GROUP_BITS(bsize) ||
+	    isize < RKFS_INODE_SIZE || isize > bsize / RKFS_FIRST_INODE)
+		return -EINVAL;
+
+	/* The packed metadata of a flex group must fit in its first group */
+	log_flex = rkfs_dsb2->s_log_groups_per_flex;
+	if (log_flex > RKFS_MAX_LOG_GROUPS_PER_FLEX ||
+	    RKFS_V2_FLEX_SHIFT(1UL << log_flex) + RKFS_V2_FIRST_BLOCK >= bpg)
+		return -EINVAL;
+
+	ipb = bsize / isize;
+	entries = (ipg + ipb - 1) / ipb;
+	if (entries * RKFS_ITABLE_ENTRY_SIZE(rkfs_is_32bit(vfs_sb)) > bsize)
+		return -EINVAL;
+
+	groups = (rkfs_dsb2->s_total_blocks + bpg - 1) / bpg;
+	if (groups > RKFS_MAX_GROUPS)
+		return -EINVAL;
+	if (!rkfs_is_32bit(vfs_sb) &&
+	    (rkfs_dsb2->s_total_blocks > RKFS_MAX_BLOCKS ||
+	     groups * ipg > RKFS_MAX_INODES))
+		return -EINVAL;
+
+	rkfs_sbi->s_blocks_per_group = bpg;
+	rkfs_sbi->s_inodes_per_group = ipg;
+	rkfs_sbi->s_inode_size = isize;
+	rkfs_sbi->s_inodes_per_block = ipb;
+	rkfs_sbi->s_itable_entries = entries;
+	rkfs_sbi->s_log_groups_per_flex = log_flex;
+	return 0;
+}
+
 static int rkfs_fill_super(struct super_block *vfs_sb, void *data, int silent)
 {
 	int blk_size = 0;
 	dev_t dev;
-	unsigned short offset = 0, rkfs_sb_count = 0, tb = 0;
+	unsigned short rkfs_sb_count = 0, state = 0;
 	unsigned short i = 0, j = 0, loaded_sb = 0;
+	unsigned long offset = 0, tb = 0, features = 0;
 	struct buffer_head *bh = NULL;
 	struct rkfs_super_block *rkfs_dsb = NULL;
+	struct rkfs_super_block2 *rkfs_dsb2 = NULL;
 	struct inode *vfs_root_inode = NULL;
 	struct rkfs_sb_info *rkfs_sbi = NULL;
 	int ret = -EINVAL;
 	char b[BDEVNAME_SIZE];
+	ktime_t t_start, t_sb;
+
+	t_start = ktime_get();
 
 	if (vfs_sb == NULL) {
 		rkfs_bug("VFS superblock is NULL\n");
@@ -189,56 +725,80 @@ static int rkfs_fill_super(struct super_block *vfs_sb, void *data, int silent)
 	}
 
 	dev = vfs_sb->s_dev;
-	blk_size = vfs_sb->s_blocksize;
-	if (blk_size > RKFS_BLOCK_SIZE) {
-		rkfs_printk("Block size (%d) too big for %s\n", blk_size,
-			    RKFS_NAME);
+	if (!(bh = rkfs_find_super(vfs_sb))) {
+		rkfs_printk("Can't find valid %s filesystem on device %s\n",
+			    RKFS_NAME, __bdevname(dev, b));
 		goto out;
 	}
 
-	blk_size = RKFS_BLOCK_SIZE;
-	if (sb_set_blocksize(vfs_sb, blk_size) < 0) {
-		rkfs_printk("Unable to set blocksize for device %s to %d\n",
-			    __bdevname(dev, b), blk_size);
-		goto out;
-	}
+	blk_size = vfs_sb->s_blocksize;
+	rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
 
-	if (!(bh = sb_bread(vfs_sb, blk_size))) {
-		rkfs_printk("Unable to read the %s superblock at offset %d\n",
-			    RKFS_NAME, RKFS_SUPER_BLOCK);
-		goto out;
-	}
+	/*
+	 * Both layouts keep s_fsid/s_fsver up front; the rest of the
+	 * superblock depends on the version.
+	 */
+	rkfs_sbi = vfs_sb->s_fs_info;
+	if (rkfs_dsb->s_fsver == RKFS_VER2) {
+		rkfs_dsb2 = (struct rkfs_super_block2 *)rkfs_dsb;
+		features = rkfs_dsb2->s_features;
+		if (features & ~RKFS_FEATURES) {
+			rkfs_printk("Unsupported %s features (0x%lx) on "
+				    "device %s\n", RKFS_NAME,
+				    features & ~RKFS_FEATURES,
+				    __bdevname(dev, b));
+			goto release_and_out;
+		}
 
-	if (bh->b_size != blk_size) {
-		rkfs_printk
-		    ("Conflict in blocksize between buffer cache (%ld) and %s\n",
-		     bh->b_size, RKFS_NAME);
-		goto release_and_out;
-	}
+		rkfs_sbi->s_version = RKFS_VER2;
+		rkfs_sbi->s_features = features;
+		if (rkfs_check_geometry(vfs_sb, rkfs_dsb2)) {
+			rkfs_printk("Unsupported %s geometry on device %s\n",
+				    RKFS_NAME, __bdevname(dev, b));
+			goto release_and_out;
+		}
 
-	rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
-	if (rkfs_dsb->s_fsid != RKFS_ID) {
-		rkfs_printk("Can't find valid %s filesystem on device %s\n",
-			    RKFS_NAME, __bdevname(dev, b));
-		goto release_and_out;
+		tb = rkfs_dsb2->s_total_blocks;
+		state = rkfs_dsb2->s_state;
+	} else {
+		rkfs_sbi->s_version = RKFS_VER;
+		rkfs_sbi->s_features = 0;
+		rkfs_sbi->s_blocks_per_group = RKFS_MIN_BLOCKS;
+		rkfs_sbi->s_inodes_per_group = RKFS_MIN_BLOCKS;
+		rkfs_sbi->s_inode_size = RKFS_INODE_SIZE;
+		rkfs_sbi->s_inodes_per_block = RKFS_INODES_PER_BLOCK;
+		rkfs_sbi->s_itable_entries = RKFS_INODE_TABLES_MAP_SIZE;
+		rkfs_sbi->s_log_groups_per_flex = 0;
+		tb = rkfs_dsb->s_total_blocks;
+		state = rkfs_dsb->s_state;
 	}
 
-	if (rkfs_dsb->s_state != RKFS_VALID_FS)
+	if (state != RKFS_VALID_FS)
 		rkfs_printk("Mounting unchecked file system\n");
 
-	if (rkfs_dsb->s_state == RKFS_ERROR_FS)
+	if (state == RKFS_ERROR_FS)
 		rkfs_printk("Mounting filesystem with errors\n");
 
-	tb = rkfs_dsb->s_total_blocks;
-	rkfs_sb_count = (tb + RKFS_MIN_BLOCKS - 1) / RKFS_MIN_BLOCKS;
-	rkfs_sbi = vfs_sb->s_fs_info;
+	rkfs_sbi->s_total_blocks = tb;
+	rkfs_sb_count = (tb + rkfs_sbi->s_blocks_per_group - 1) /
+	    rkfs_sbi->s_blocks_per_group;
+	if (rkfs_parse_options((char *)data, rkfs_sbi))
+		goto release_and_out;
+
+	if (rkfs_test_opt(vfs_sb, DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(vfs_sb->s_bdev))) {
+		rkfs_printk("Device %s doesn't support discard, ignored\n",
+			    __bdevname(dev, b));
+		rkfs_sbi->s_mount_opt &= ~RKFS_MOUNT_DISCARD;
+	}
+
 	rkfs_sbi->s_sb_count = rkfs_sb_count;
 	rkfs_debug("Total superblocks in filesystem: %d\n", rkfs_sb_count);
 
-	vfs_sb->s_blocksize_bits = 10;
-	vfs_sb->s_blocksize = RKFS_BLOCK_SIZE;
 	vfs_sb->s_magic = rkfs_dsb->s_fsid;
-	vfs_sb->s_maxbytes = rkfs_max_file_size(tb, rkfs_sb_count);
+	vfs_sb->s_maxbytes = rkfs_max_file_size(tb, rkfs_sb_count, blk_size);
+	if (vfs_sb->s_maxbytes > RKFS_MAX_FILE_SIZE32)
+		vfs_sb->s_maxbytes = RKFS_MAX_FILE_SIZE32;
 	vfs_sb->s_op = &rkfs_sops;
 
 	rkfs_sbi->s_sbh = kmalloc(rkfs_sb_count *
@@ -249,13 +809,32 @@ static int rkfs_fill_super(struct super_block *vfs_sb, void *data, int silent)
 		goto release_and_out;
 	}
 
+	/*
+	 * Start reading all the other group superblocks, and the blocks
+	 * the root inode lookup needs, before waiting for any of them:
+	 * one I/O latency for the whole lot instead of one per group.
+	 */
+	for (i = 1; i < rkfs_sb_count; i++)
+		sb_breadahead(vfs_sb, rkfs_group_sb_block(vfs_sb, i));
+	if (rkfs_sbi->s_version == RKFS_VER2) {
+		offset = 1UL << rkfs_sbi->s_log_groups_per_flex;
+		if (offset > rkfs_sb_count)
+			offset = rkfs_sb_count;
+		offset = RKFS_V2_FLEX_SHIFT(offset);
+		sb_breadahead(vfs_sb, RKFS_V2_FIRST_INODE_TABLE_BLOCK + offset);
+		sb_breadahead(vfs_sb, RKFS_V2_ROOT_DIR_BLOCK + offset);
+	} else {
+		sb_breadahead(vfs_sb, RKFS_FIRST_INODE_TABLE_BLOCK);
+		sb_breadahead(vfs_sb, RKFS_ROOT_DIR_BLOCK);
+	}
+
 	rkfs_sbi->s_sbh[0] = bh;
-	offset += RKFS_MIN_BLOCKS;
 	for (i = 1; i < rkfs_sb_count; i++) {
+		offset = rkfs_group_sb_block(vfs_sb, i);
 		loaded_sb = i;
-		if (!(bh = sb_bread(vfs_sb, blk_size))) {
+		if (!(bh = sb_bread(vfs_sb, offset))) {
 			rkfs_printk
-			    ("Unable to read %s superblock at offset %d\n",
+			    ("Unable to read %s superblock at offset %lu\n",
 			     RKFS_NAME, offset);
 			goto cleanup_loaded_sb;
 		}
@@ -263,24 +842,29 @@ static int rkfs_fill_super(struct super_block *vfs_sb, void *data, int silent)
 		rkfs_dsb = (struct rkfs_super_block *)((char *)bh->b_data);
 		if (rkfs_dsb->s_fsid != RKFS_ID) {
 			rkfs_printk
-			    ("Invalid %s superblock found at offset %d\n",
+			    ("Invalid %s superblock found at offset %lu\n",
 			     RKFS_NAME, offset);
+			brelse(bh);
 			goto cleanup_loaded_sb;
 		}
 
 		rkfs_sbi->s_sbh[i] = bh;
-		offset += RKFS_MIN_BLOCKS;
 	}
+	loaded_sb = rkfs_sb_count;
+	t_sb = ktime_get();
+
+	if (rkfs_init_groups(vfs_sb))
+		goto cleanup_loaded_sb;
 
 	if (!(vfs_root_inode = iget(vfs_sb, RKFS_ROOT_INO))) {
 		rkfs_printk("Unable to get root inode\n");
-		goto cleanup_loaded_sb;
+		goto cleanup_groups;
 	}
 
 	if (!(vfs_sb->s_root = d_alloc_root(vfs_root_inode))) {
 		rkfs_printk("Root inode corrupted\n");
 		iput(vfs_root_inode);
-		goto cleanup_loaded_sb;
+		goto cleanup_groups;
 	}
 
 	if (!S_ISDIR(vfs_sb->s_root->d_inode->i_mode) ||
@@ -289,11 +873,20 @@ static int rkfs_fill_super(struct super_block *vfs_sb, void *data, int silent)
 		dput(vfs_sb->s_root);
 		vfs_sb->s_root = NULL;
 		rkfs_printk("Root inode corrupted\n");
-		goto cleanup_loaded_sb;
+		goto cleanup_groups;
 	}
 
+	if (rkfs_test_opt(vfs_sb, TIMING))
+		rkfs_printk("Mounted %s: %d superblocks in %lld us, "
+			    "total %lld us\n", __bdevname(dev, b), rkfs_sb_count,
+			    ktime_us_delta(t_sb, t_start),
+			    ktime_us_delta(ktime_get(), t_start));
+
 	return 0;
 
+ cleanup_groups:
+	rkfs_destroy_groups(rkfs_sbi);
+
  cleanup_loaded_sb:
 	for (j = 0; j < loaded_sb; j++)
 		brelse(rkfs_sbi->s_sbh[j]);
@@ -326,11 +919,28 @@ static struct file_system_type rkfs_type = {
 
 static int __init init_rkfs(void)
 {
+	int err = 0;
+
 	rkfs_debug("========================\n");
 	rkfs_debug("Registering %s ...\n", RKFS_NAME);
 	rkfs_debug("========================\n");
 
-	return register_filesystem(&rkfs_type);
+	if ((err = rkfs_init_inodecache()))
+		return err;
+
+	if ((err = rkfs_init_free_extents()))
+		goto destroy_inodecache;
+
+	if ((err = register_filesystem(&rkfs_type)))
+		goto destroy_free_extents;
+
+	return 0;
+
+ destroy_free_extents:
+	rkfs_destroy_free_extents();
+ destroy_inodecache:
+	rkfs_destroy_inodecache();
+	return err;
 }
 
 static void __exit exit_rkfs(void)
@@ -338,6 +948,8 @@ static void __exit exit_rkfs(void)
 	rkfs_debug("Unregistering %s ...\n", RKFS_NAME);
 
 	unregister_filesystem(&rkfs_type);
+	rkfs_destroy_free_extents();
+	rkfs_destroy_inodecache();
 }
 
 EXPORT_NO_SYMBOLS;
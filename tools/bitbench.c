@@ -0,0 +1,221 @@
+/*
+*
+* bitbench.c
+*
+* Microbenchmark of the bitmap counting and searching code, on random
+* group maps of RKFS_MIN_BLOCKS bits:
+*
+* - counting the free bits of 1 to 45 groups, as statfs did: the old
+*   bit at a time rkfs_count_free, the word-wise (hweight16) one that
+*   replaced it in the kernel, and the plain, SSE2 and AVX2 versions of
+*   count_zero_bits() of the tools;
+* - find_first_zero_bit() of the tools on one random and one full map.
+*
+* All versions are checked to agree. Times are ns per call.
+*
+* Usage: bitbench [iterations]
+*
+*/
+
+#include "globals.h"
+#include "rkfs.h"
+#include "utils.h"
+
+#define MAX_GROUPS 45
+#define MAP_BYTES (RKFS_MIN_BLOCKS / 8)
+
+boolean quiet = FALSE;
+boolean verbose = TRUE;
+uint block_size = RKFS_BLOCK_SIZE;
+
+static const char *ops[] = { "plain", "sse2", "avx2" };
+
+#define NR_OPS (sizeof(ops) / sizeof(ops[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+* xorshift64: every bit of the maps equally likely set, unlike rand()
+* whose low bits are poor on some libcs.
+*/
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+static unsigned char rnd_byte(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state >> 56;
+}
+
+/*
+* The rkfs_count_free of the original bitmap.c: one bit test per block.
+*/
+static ushort count_free_old(void *map, ushort offset, ushort total_blocks)
+{
+	ushort sum = 0, i = 0, blkno = 0;
+
+	for (i = 0; i < RKFS_MIN_BLOCKS; i++) {
+		blkno = offset + i;
+		if (blkno > (total_blocks - 1))
+			return sum;
+		if (!test_bit(i, map))
+			sum += 1;
+	}
+
+	return sum;
+}
+
+/*
+* The rkfs_count_free of bitmap.c now: 16 bits at a time.
+*/
+static ushort count_free_word(void *map, ushort nbits)
+{
+	__u16 *word = map;
+	ushort sum = 0, i = 0, tail = 0;
+
+	for (i = 0; i < (nbits / 16); i++)
+		sum += 16 - __builtin_popcount(word[i]);
+
+	if ((tail = nbits % 16))
+		sum += tail - __builtin_popcount(word[i] & ((1 << tail) - 1));
+
+	return sum;
+}
+
+/*
+* Free bits of 'groups' maps with counter 'how': -2 old, -1 word-wise,
+* else the count_zero_bits() currently selected.
+*/
+static ulong count_groups(int how, unsigned char *maps, uint groups)
+{
+	ulong sum = 0;
+	uint g = 0;
+
+	for (g = 0; g < groups; g++) {
+		if (how == -2)
+			sum += count_free_old(maps + g * MAP_BYTES,
+					      g * RKFS_MIN_BLOCKS,
+					      groups * RKFS_MIN_BLOCKS);
+		else if (how == -1)
+			sum += count_free_word(maps + g * MAP_BYTES,
+					       RKFS_MIN_BLOCKS);
+		else
+			sum += count_zero_bits(maps + g * MAP_BYTES,
+					       RKFS_MIN_BLOCKS);
+	}
+
+	return sum;
+}
+
+static double time_count(int how, unsigned char *maps, uint groups,
+			 ulong iters, ulong *res)
+{
+	double start = 0;
+	ulong i = 0, sum = 0;
+
+	start = now();
+	for (i = 0; i < iters; i++)
+		sum += count_groups(how, maps, groups);
+	*res = sum / iters;
+
+	return (now() - start) * 1e9 / iters;
+}
+
+static double time_first(unsigned char *map, ulong iters, ulong *res)
+{
+	double start = 0;
+	ulong i = 0, sum = 0;
+
+	start = now();
+	for (i = 0; i < iters; i++)
+		sum += find_first_zero_bit(map, RKFS_MIN_BLOCKS);
+	*res = sum / iters;
+
+	return (now() - start) * 1e9 / iters;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char maps[MAX_GROUPS * MAP_BYTES], full[MAP_BYTES];
+	int have[NR_OPS];
+	ulong iters = 5000, ref = 0, res = 0, first = 0, last = 0;
+	double t = 0;
+	uint groups = 0, i = 0;
+
+	if (argc > 1)
+		iters = strtoul(argv[1], NULL, 0);
+	if (!iters) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(maps); i++)
+		maps[i] = rnd_byte();
+	memset(full, 0xff, sizeof(full));
+	full[(RKFS_MIN_BLOCKS - 1) >> 3] &= ~(1 << ((RKFS_MIN_BLOCKS - 1) & 7));
+
+	for (i = 0; i < NR_OPS; i++)
+		have[i] = (set_bitmap_ops(ops[i]) == 0);
+
+	printf("Counting free bits of N random %d bit group maps, "
+	       "%lu iterations (ns per call)\n", RKFS_MIN_BLOCKS, iters);
+	printf("%6s %10s %10s", "groups", "old", "word");
+	for (i = 0; i < NR_OPS; i++)
+		printf(" %10s", ops[i]);
+	printf("\n");
+
+	for (groups = 1; groups <= MAX_GROUPS; groups++) {
+		printf("%6u", groups);
+		printf(" %10.0f", time_count(-2, maps, groups, iters, &ref));
+		printf(" %10.0f", time_count(-1, maps, groups, iters, &res));
+		if (res != ref)
+			goto disagree;
+
+		for (i = 0; i < NR_OPS; i++) {
+			if (!have[i]) {
+				printf(" %10s", "-");
+				continue;
+			}
+			set_bitmap_ops(ops[i]);
+			t = time_count(i, maps, groups, iters, &res);
+			if (res != ref)
+				goto disagree;
+			printf(" %10.0f", t);
+		}
+		printf("\n");
+	}
+
+	printf("\nfind_first_zero_bit on one %d bit map, %lu iterations "
+	       "(ns per call)\n", RKFS_MIN_BLOCKS, iters * 10);
+	printf("%6s %10s %10s\n", "ops", "random", "full");
+	for (i = 0; i < NR_OPS; i++) {
+		if (!have[i]) {
+			printf("%6s %10s\n", ops[i], "unsupported");
+			continue;
+		}
+		set_bitmap_ops(ops[i]);
+		printf("%6s", ops[i]);
+		printf(" %10.1f", time_first(maps, iters * 10, &res));
+		if (i && res != first)
+			goto disagree;
+		first = res;
+		printf(" %10.1f\n", time_first(full, iters * 10, &res));
+		if (i && res != last)
+			goto disagree;
+		last = res;
+	}
+
+	return 0;
+
+ disagree:
+	printf("\n");
+	fprintf(stderr, "%s: results disagree (got %lu)\n", argv[0], res);
+	return 1;
+}
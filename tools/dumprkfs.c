@@ -16,72 +16,205 @@
 
 boolean quiet = FALSE;
 boolean verbose = TRUE;
+uint block_size = RKFS_BLOCK_SIZE;
 
 void print_usage(const char *prg_name)
 {
 	fprintf(stderr, "%s <device name>", prg_name);
 }
 
-int print_superblock(void *buf)
+void print_map(const char *name, void *map, uint nbits)
 {
-	struct rkfs_super_block *sb;
 	register int i = 0;
 
-	sb = (struct rkfs_super_block *)buf;
-
-	if (sb->s_fsid != RKFS_ID) {
-		print_emsg("\nNot a valid %s filesystem found.", RKFS_NAME);
-		return -1;
-	}
-
-	print_msg("\nFilesystem ID: %d", sb->s_fsid);
-	print_msg("\nFilesystem Ver: %d", sb->s_fsver);
-
-	print_msg("\nUsed blocks:\n");
-	for (i = 0; i < (RKFS_BLOCK_MAP_SIZE * sizeof(__u16) * 8); i++) {
-		if (test_bit(i, sb->s_block_map)) {
+	print_msg("\nUsed %s:\n", name);
+	for (i = 0; i < nbits; i++) {
+		if (test_bit(i, map)) {
 			print_msg("%d ", i);
 			if (i && !(i % 16))
 				print_msg("\n");
 		}
 	}
+}
 
-	print_msg("\nUsed inodes:\n");
-	for (i = 0; i < (RKFS_INODE_MAP_SIZE * sizeof(__u16) * 8); i++) {
-		if (test_bit(i, sb->s_inode_map)) {
-			print_msg("%d ", i);
-			if (i && !(i % 16))
-				print_msg("\n");
-		}
-	}
+void print_itable_map(__u16 (*itable_map)[2], uint entries)
+{
+	register int i = 0;
 
 	print_msg("\nInode table map:");
-	for (i = 0; i < RKFS_INODE_TABLES_MAP_SIZE; i++) {
-		if (sb->s_itable_map[i][0] != 0)
+	for (i = 0; i < entries; i++) {
+		if (itable_map[i][0] != 0)
 			print_msg("\n\tIndex: %d, Block: %d, Count: %d", i,
-				  sb->s_itable_map[i][0],
-				  sb->s_itable_map[i][1]);
+				  itable_map[i][0], itable_map[i][1]);
+	}
+}
+
+void print_itable_map32(__u32 *itable_map, uint entries)
+{
+	register int i = 0;
+
+	print_msg("\nInode table map:");
+	for (i = 0; i < entries; i++) {
+		if (itable_map[i] != 0)
+			print_msg("\n\tIndex: %d, Block: %u, Count: %d", i,
+				  itable_map[i],
+				  rkfs_itable_map32_count(itable_map,
+							  entries)[i]);
 	}
+}
 
-	if (sb->s_state == RKFS_VALID_FS)
+void print_state(__u16 state)
+{
+	if (state == RKFS_VALID_FS)
 		print_msg("\nSuper block state: Valid");
 	else {
-		if (sb->s_state == RKFS_ERROR_FS)
+		if (state == RKFS_ERROR_FS)
 			print_msg("\nSuper block state: Error");
 		else
 			print_msg("\nSuper block state: Unknown");
 	}
+}
+
+void print_free(void *block_map, uint nbits, void *inode_map, uint ibits)
+{
+	print_msg("\nFree blocks in group: %u (first free bit: %u)",
+		  count_zero_bits(block_map, nbits),
+		  find_first_zero_bit(block_map, nbits));
+	print_msg("\nFree inodes in group: %u (first free bit: %u)",
+		  count_zero_bits(inode_map, ibits),
+		  find_first_zero_bit(inode_map, ibits));
+}
+
+int print_superblock(void *buf, uint offset)
+{
+	struct rkfs_super_block *sb;
+	uint nbits = 0;
+
+	sb = (struct rkfs_super_block *)buf;
+
+	if (sb->s_fsid != RKFS_ID) {
+		print_emsg("\nNot a valid %s filesystem found.", RKFS_NAME);
+		return -1;
+	}
+
+	print_msg("\nFilesystem ID: %d", sb->s_fsid);
+	print_msg("\nFilesystem Ver: %d", sb->s_fsver);
+
+	print_map("blocks", sb->s_block_map,
+		  RKFS_BLOCK_MAP_SIZE * sizeof(__u16) * 8);
+	print_map("inodes", sb->s_inode_map,
+		  RKFS_INODE_MAP_SIZE * sizeof(__u16) * 8);
+	print_itable_map(sb->s_itable_map, RKFS_INODE_TABLES_MAP_SIZE);
+	print_state(sb->s_state);
 
 	print_msg("\nTotal blocks: %d", sb->s_total_blocks);
 
+	nbits = sb->s_total_blocks - offset;
+	if (nbits > RKFS_MIN_BLOCKS)
+		nbits = RKFS_MIN_BLOCKS;
+	print_free(sb->s_block_map, nbits, sb->s_inode_map, nbits);
+
 	return 0;
 }
 
+/*
+* Version 2 superblock: the maps are read from their own blocks.
+*/
+int print_superblock2(register int fd, void *buf, uint offset)
+{
+	struct rkfs_super_block2 *sb;
+	__u16 block_map[RKFS_MAX_BLOCK_SIZE / sizeof(__u16)];
+	__u16 inode_map[RKFS_MAX_BLOCK_SIZE / sizeof(__u16)];
+	__u16 itable_map[RKFS_MAX_BLOCK_SIZE / (2 * sizeof(__u16))][2];
+	uint nbits = 0, isize = 0, entries = 0;
+
+	sb = (struct rkfs_super_block2 *)buf;
+
+	if (sb->s_fsid != RKFS_ID || sb->s_fsver != RKFS_VER2) {
+		print_emsg("\nNot a valid %s filesystem found.", RKFS_NAME);
+		return -1;
+	}
+
+	print_msg("\nFilesystem ID: %d", sb->s_fsid);
+	print_msg("\nFilesystem Ver: %d", sb->s_fsver);
+	print_msg("\nGroup: %d", sb->s_group);
+	print_msg("\nBlock size: %u", RKFS_BLOCK_SIZE << sb->s_log_block_size);
+	print_msg("\nBlocks per group: %u", sb->s_blocks_per_group);
+	print_msg("\nInodes per group: %u", sb->s_inodes_per_group);
+	isize = sb->s_inode_size ? sb->s_inode_size : RKFS_INODE_SIZE;
+	print_msg("\nInode size: %u", isize);
+	print_msg("\nGroups per flex group: %u",
+		  1 << sb->s_log_groups_per_flex);
+	print_msg("\nBlock map: %u, Inode map: %u, Inode table map: %u",
+		  sb->s_block_map, sb->s_inode_map, sb->s_itable_map);
+	print_msg("\nFirst data bit: %u", sb->s_first_block);
+	print_msg("\nFeatures: 0x%x%s%s%s", sb->s_features,
+		  (sb->s_features & RKFS_FEATURE_32BIT) ? " (32-bit)" : "",
+		  (sb->s_features & RKFS_FEATURE_INLINE_DATA) ?
+		  " (inline data)" : "",
+		  (sb->s_features & RKFS_FEATURE_EXTENTS) ? " (extents)" : "");
+
+	if (read_block(fd, sb->s_block_map, block_map) != 0 ||
+	    read_block(fd, sb->s_inode_map, inode_map) != 0 ||
+	    read_block(fd, sb->s_itable_map, itable_map) != 0)
+		return -1;
+
+	nbits = sb->s_total_blocks - offset;
+	if (nbits > sb->s_blocks_per_group)
+		nbits = sb->s_blocks_per_group;
+
+	print_map("blocks", block_map, nbits);
+	print_map("inodes", inode_map, sb->s_inodes_per_group);
+	entries = (sb->s_inodes_per_group + (block_size / isize) - 1) /
+	    (block_size / isize);
+	if (sb->s_features & RKFS_FEATURE_32BIT)
+		print_itable_map32((__u32 *)itable_map, entries);
+	else
+		print_itable_map(itable_map, entries);
+	print_state(sb->s_state);
+
+	print_msg("\nTotal blocks: %u", sb->s_total_blocks);
+	print_msg("\nFree blocks/inodes as of last umount: %u/%u",
+		  sb->s_free_blocks, sb->s_free_inodes);
+	print_free(block_map, nbits, inode_map, sb->s_inodes_per_group);
+
+	return 0;
+}
+
+/*
+* Find the block size the filesystem was made with: the group 0
+* superblock is at RKFS_SUPER_BLOCK in units of that size. Same probe
+* order as the kernel.
+*/
+int find_block_size(register int fd, void *buf)
+{
+	struct rkfs_super_block2 *sb = buf;
+
+	for (block_size = RKFS_BLOCK_SIZE; block_size <= RKFS_MAX_BLOCK_SIZE;
+	     block_size <<= 1) {
+		if (read_block(fd, RKFS_SUPER_BLOCK, buf) != 0)
+			break;
+		if (sb->s_fsid != RKFS_ID)
+			continue;
+		if (sb->s_fsver != RKFS_VER2) {
+			if (block_size == RKFS_BLOCK_SIZE)
+				return 0;
+		} else if (sb->s_log_block_size <= RKFS_MAX_LOG_BLOCK_SIZE &&
+			   (RKFS_BLOCK_SIZE << sb->s_log_block_size) ==
+			   block_size)
+			return 0;
+	}
+
+	block_size = RKFS_BLOCK_SIZE;
+	return -1;
+}
+
 int dumprkfs(const char *device)
 {
-	char buf[RKFS_BLOCK_SIZE];
+	struct rkfs_super_block2 *sb;
+	char buf[RKFS_MAX_BLOCK_SIZE];
 	register int rc = 0, fd = 0;
-	uint offset = 0, blkno = 0;
+	uint offset = 0, blkno = 0, bpg = 0, log_flex = 0;
 	ulong total_blocks = 0;
 
 	disable_stream_buffering(stdout);
@@ -89,15 +222,21 @@ int dumprkfs(const char *device)
 
 	if ((total_blocks = get_total_device_blocks(device)) == -1)
 		return -1;
-	print_msg("Device %s has %u blocks.", device, total_blocks);
+	print_msg("Device %s has %lu blocks.", device, total_blocks);
 
 	if ((fd = open_device(device, O_RDONLY)) < 0)
 		return -1;
 
+	if (find_block_size(fd, buf) != 0)
+		print_emsg("\nNo %s superblock found at any block size.",
+			   RKFS_NAME);
+
 	offset = 0;
 	do {
-		memset(buf, 0, RKFS_BLOCK_SIZE);
-		if (!offset)
+		memset(buf, 0, sizeof(buf));
+		if (bpg)
+			blkno = group_sb_block(offset / bpg, bpg, log_flex);
+		else if (!offset)
 			blkno = RKFS_SUPER_BLOCK;
 		else
 			blkno = offset;
@@ -106,11 +245,22 @@ int dumprkfs(const char *device)
 			goto error_exit;
 		}
 
-		print_msg("\n\n***Superblock at offset: %d\n", offset);
-		if (print_superblock(buf) != 0)
+		print_msg("\n\n***Superblock at offset: %u\n", offset);
+		sb = (struct rkfs_super_block2 *)buf;
+		if (sb->s_fsid == RKFS_ID && sb->s_fsver == RKFS_VER2) {
+			if (print_superblock2(fd, buf, offset) != 0)
+				break;
+			total_blocks = sb->s_total_blocks;
+			if (!offset) {
+				bpg = sb->s_blocks_per_group;
+				log_flex = sb->s_log_groups_per_flex;
+			}
+			offset += sb->s_blocks_per_group;
+		} else if (print_superblock(buf, offset) != 0)
 			break;
+		else
+			offset += RKFS_MIN_BLOCKS;
 
-		offset += RKFS_MIN_BLOCKS;
 		if (offset < (total_blocks - 1))
 			continue;
 
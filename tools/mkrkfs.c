@@ -34,6 +34,16 @@ void print_usage(const char *prg_name)
 	fprintf(stderr, "\n'-v'   - Verbose");
 	fprintf(stderr, "\n'-q'   - Quiet");
 	fprintf(stderr, "\n'-s'   - Skip badblocks");
+	fprintf(stderr, "\n'-2'   - Version 2 layout (bitmaps in own blocks)");
+	fprintf(stderr, "\n'-L'   - 32-bit block & inode numbers (implies -2)");
+	fprintf(stderr, "\n'-D'   - Inline data for tiny files & symlinks "
+		"(implies -2)");
+	fprintf(stderr, "\n'-E'   - Extent-mapped files (implies -2)");
+	fprintf(stderr, "\n'-b n' - Block size: 1024, 2048 or 4096 (implies -2)");
+	fprintf(stderr, "\n'-i n' - Bytes per inode (implies -2)");
+	fprintf(stderr, "\n'-I n' - Inode size in bytes (implies -2)");
+	fprintf(stderr, "\n'-G n' - Groups per flex group, a power of 2 "
+		"(implies -2)");
 	fprintf(stderr, "\n'-V'   - Version\n");
 
 	exit(1);
@@ -45,7 +55,8 @@ void print_usage(const char *prg_name)
 char *parse_args(int argc, char *argv[])
 {
 	register int c = 0;
-	const char *options = "vqsV";
+	const char *options = "vqsV2LDEb:i:I:G:";
+	extern char *optarg;
 	extern int optind, opterr;
 	static char device[255];
 
@@ -71,6 +82,67 @@ char *parse_args(int argc, char *argv[])
 		case 's':
 			skip_badblocks = TRUE;
 			break;
+		case '2':
+			layout_v2 = TRUE;
+			break;
+		case 'L':
+			layout_v2 = TRUE;
+			blocks_32bit = TRUE;
+			break;
+		case 'D':
+			layout_v2 = TRUE;
+			inline_data = TRUE;
+			break;
+		case 'E':
+			layout_v2 = TRUE;
+			extents = TRUE;
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			if (block_size != 1024 && block_size != 2048 &&
+			    block_size != 4096) {
+				fprintf(stderr,
+					"Block size must be 1024, 2048 or 4096.\n");
+				print_usage(argv[0]);
+			}
+			if (block_size != RKFS_BLOCK_SIZE)
+				layout_v2 = TRUE;
+			break;
+		case 'i':
+			bytes_per_inode = atoi(optarg);
+			if (bytes_per_inode < RKFS_BLOCK_SIZE) {
+				fprintf(stderr,
+					"Bytes per inode must be at least %d.\n",
+					RKFS_BLOCK_SIZE);
+				print_usage(argv[0]);
+			}
+			layout_v2 = TRUE;
+			break;
+		case 'I':
+			inode_size = atoi(optarg);
+			if (inode_size < RKFS_INODE_SIZE || inode_size % 4) {
+				fprintf(stderr,
+					"Inode size must be a multiple of 4, "
+					"at least %d.\n", RKFS_INODE_SIZE);
+				print_usage(argv[0]);
+			}
+			layout_v2 = TRUE;
+			break;
+		case 'G':
+			c = atoi(optarg);
+			log_groups_per_flex = 0;
+			while (log_groups_per_flex < RKFS_MAX_LOG_GROUPS_PER_FLEX
+			       && (1 << log_groups_per_flex) < c)
+				log_groups_per_flex++;
+			if (c < 1 || c != (1 << log_groups_per_flex)) {
+				fprintf(stderr,
+					"Groups per flex group must be a power "
+					"of 2, at most %d.\n",
+					1 << RKFS_MAX_LOG_GROUPS_PER_FLEX);
+				print_usage(argv[0]);
+			}
+			layout_v2 = TRUE;
+			break;
 		case 'V':
 			if (quiet) {
 				fprintf(stderr,
@@ -112,12 +184,28 @@ char *parse_args(int argc, char *argv[])
 /*
 * Function to create new directory block template.
 */
-char *create_new_dir_block_template(ushort pinode, ushort cinode)
+char *create_new_dir_block_template(uint pinode, uint cinode)
 {
-	static char buf[RKFS_BLOCK_SIZE];
+	static char buf[RKFS_MAX_BLOCK_SIZE];
 	struct rkfs_dir_entry *dir_entry;
+	struct rkfs_dir_entry32 *dir_entry32;
+
+	memset(buf, 0, sizeof(buf));
+
+	if (blocks_32bit) {
+		dir_entry32 = (struct rkfs_dir_entry32 *)buf;
+		dir_entry32->de_inode = cinode;
+		dir_entry32->de_name_len = 1;
+		strcat(dir_entry32->de_name, ".");
 
-	memset(buf, 0, RKFS_BLOCK_SIZE);
+		dir_entry32 = (struct rkfs_dir_entry32 *)
+		    (buf + RKFS_DIR_ENTRY32_LEN(1));
+		dir_entry32->de_inode = pinode;
+		dir_entry32->de_name_len = 2;
+		strcat(dir_entry32->de_name, "..");
+
+		return buf;
+	}
 
 	dir_entry = (struct rkfs_dir_entry *)buf;
 	dir_entry->de_inode = cinode;
@@ -132,20 +220,44 @@ char *create_new_dir_block_template(ushort pinode, ushort cinode)
 	return buf;
 }
 
+/*
+* Inode table map entries, in the format selected by -L.
+*/
+uint get_itable_block(void *itable_map, ushort index)
+{
+	if (blocks_32bit)
+		return ((__u32 *)itable_map)[index];
+	return ((__u16 (*)[2])itable_map)[index][0];
+}
+
+void set_itable_entry(void *itable_map, ushort index, uint blkno,
+		      ushort count)
+{
+	if (blocks_32bit) {
+		((__u32 *)itable_map)[index] = blkno;
+		rkfs_itable_map32_count(itable_map, itable_entries)[index] =
+		    count;
+	} else {
+		((__u16 (*)[2])itable_map)[index][0] = blkno;
+		((__u16 (*)[2])itable_map)[index][1] = count;
+	}
+}
+
 /*
 * Function to write root inode
 */
-int write_inode(register int fd, struct rkfs_super_block *sb,
-		ushort ino, struct rkfs_inode *inode)
+int write_inode(register int fd, void *itable_map, ushort ino,
+		const void *inode)
 {
 	const char *this = "write_inode:";
-	char blk_buf[RKFS_BLOCK_SIZE];
-	ushort blkno = 0, offset = 0, itable_index = 0;
+	char blk_buf[RKFS_MAX_BLOCK_SIZE];
+	ushort offset = 0, itable_index = 0;
+	uint blkno = 0;
 	char *ptr = NULL;
 
-	itable_index = ino / RKFS_INODES_PER_BLOCK;
-	offset = ino % RKFS_INODES_PER_BLOCK;
-	blkno = sb->s_itable_map[itable_index][0];
+	itable_index = ino / (block_size / inode_size);
+	offset = ino % (block_size / inode_size);
+	blkno = get_itable_block(itable_map, itable_index);
 
 	if (!blkno) {
 		print_emsg("\n%s No valid inode block found for inode %d.",
@@ -153,18 +265,18 @@ int write_inode(register int fd, struct rkfs_super_block *sb,
 		return -1;
 	}
 
-	memset(blk_buf, 0, RKFS_BLOCK_SIZE);
+	memset(blk_buf, 0, sizeof(blk_buf));
 	if (read_block(fd, blkno, &blk_buf) < 0) {
-		print_emsg("\n%s Error while reading the block %d.", this,
+		print_emsg("\n%s Error while reading the block %u.", this,
 			   blkno);
 		return -1;
 	}
 
-	ptr = (char *)(blk_buf + (offset * RKFS_INODE_SIZE));
-	memcpy((struct rkfs_inode *)ptr, inode, RKFS_INODE_SIZE);
+	ptr = (char *)(blk_buf + (offset * inode_size));
+	memcpy(ptr, inode, RKFS_INODE_SIZE);
 
 	if (write_block(fd, blkno, &blk_buf) < 0) {
-		print_emsg("\n%s Error while writing the block %d.", this,
+		print_emsg("\n%s Error while writing the block %u.", this,
 			   blkno);
 		return -1;
 	}
@@ -173,13 +285,16 @@ int write_inode(register int fd, struct rkfs_super_block *sb,
 }
 
 /*
-* Function to create '/' directory
+* Function to create '/' directory in block 'dir_blkno'
 */
-int create_root_directory(register int fd, struct rkfs_super_block *sb)
+int create_root_directory(register int fd, void *itable_map,
+			  void *block_map, ushort dir_blkno)
 {
 	const char *this = "create_root_directory:";
 	struct rkfs_inode pinode;
+	struct rkfs_inode32 pinode32;
 	char *blk_ptr = NULL;
+	void *inode = &pinode;
 
 	blk_ptr = create_new_dir_block_template(RKFS_ROOT_INO, RKFS_ROOT_INO);
 
@@ -189,23 +304,36 @@ int create_root_directory(register int fd, struct rkfs_super_block *sb)
 	pinode.i_mode = S_IFDIR | 0755;
 	pinode.i_time = time(NULL);
 	pinode.i_links_count = 2;
-	pinode.i_size = RKFS_BLOCK_SIZE;
-	pinode.i_blocks = RKFS_BLOCK_SIZE / 512;
-	pinode.i_block[0] = RKFS_ROOT_DIR_BLOCK;
+	pinode.i_size = block_size;
+	pinode.i_blocks = block_size / 512;
+	pinode.i_block[0] = dir_blkno;
+
+	if (blocks_32bit) {
+		memset(&pinode32, 0, RKFS_INODE_SIZE);
+		pinode32.i_uid = pinode.i_uid;
+		pinode32.i_gid = pinode.i_gid;
+		pinode32.i_mode = pinode.i_mode;
+		pinode32.i_time = pinode.i_time;
+		pinode32.i_links_count = pinode.i_links_count;
+		pinode32.i_size = pinode.i_size;
+		pinode32.i_blocks = pinode.i_blocks;
+		pinode32.i_block[0] = dir_blkno;
+		inode = &pinode32;
+	}
 
-	if (write_block(fd, RKFS_ROOT_DIR_BLOCK, blk_ptr) < 0) {
+	if (write_block(fd, dir_blkno, blk_ptr) < 0) {
 		print_emsg("\n%s Error while writing the block %d.", this,
-			   RKFS_ROOT_DIR_BLOCK);
+			   dir_blkno);
 		return -1;
 	}
 
-	if (write_inode(fd, sb, RKFS_ROOT_INO, &pinode) < 0) {
+	if (write_inode(fd, itable_map, RKFS_ROOT_INO, inode) < 0) {
 		print_emsg("\n%s Error while writing the inode %d.", this,
 			   RKFS_ROOT_INO);
 		return -1;
 	}
 
-	set_bit(RKFS_ROOT_DIR_BLOCK, sb->s_block_map);
+	set_bit(dir_blkno, block_map);
 
 	return 0;
 }
@@ -213,27 +341,27 @@ int create_root_directory(register int fd, struct rkfs_super_block *sb)
 /*
 * Function to mark the bad blocks as used.
 */
-int mark_badblocks(register int fd, struct rkfs_super_block *sb,
-		   ushort total_blocks, uint offset, ushort * total_bad_blocks)
+int mark_badblocks(register int fd, void *block_map,
+		   uint total_blocks, uint offset, uint * total_bad_blocks)
 {
-	char blk_buf[RKFS_BLOCK_SIZE];
+	char blk_buf[RKFS_MAX_BLOCK_SIZE];
 	register int i = 0;
-	ushort blkno = 0;
+	uint blkno = 0;
 
 	if (!skip_badblocks)
 		return 0;
 
 	print_msg("\n");
-	memset(blk_buf, 0, RKFS_BLOCK_SIZE);
-	for (i = 0; i < RKFS_MIN_BLOCKS; i++) {
+	memset(blk_buf, 0, sizeof(blk_buf));
+	for (i = 0; i < blocks_per_group; i++) {
 		blkno = offset + i;
 		if (blkno > (total_blocks - 1))
 			break;
 		if (read_block(fd, blkno, blk_buf) < 0) {
 			print_msg
-			    ("\n*** Block %d is bad. Marking it as used...\n",
+			    ("\n*** Block %u is bad. Marking it as used...\n",
 			     blkno);
-			set_bit(i, sb->s_block_map);
+			set_bit(i, block_map);
 			*total_bad_blocks += 1;
 		}
 	}
@@ -241,83 +369,282 @@ int mark_badblocks(register int fd, struct rkfs_super_block *sb,
 	return 0;
 }
 
+/*
+* Write the v2 superblock of 'group' and its map blocks, which follow it
+* in the packed metadata area of the flex group. 'first_block' is the
+* first bit of the group not taken by metadata.
+*/
+int write_group_v2(register int fd, uint total_blocks, uint group,
+		   uint first_block, void *block_map, void *inode_map,
+		   void *itable_map)
+{
+	struct rkfs_super_block2 *sb;
+	char blk_buf[RKFS_MAX_BLOCK_SIZE];
+	uint blkno = 0, offset = 0;
+	uint nbits = 0;
+
+	offset = group * blocks_per_group;
+	blkno = group_sb_block(group, blocks_per_group, log_groups_per_flex);
+	nbits = total_blocks - offset;
+	if (nbits > blocks_per_group)
+		nbits = blocks_per_group;
+
+	memset(blk_buf, 0, sizeof(blk_buf));
+	sb = (struct rkfs_super_block2 *)blk_buf;
+	sb->s_fsid = RKFS_ID;
+	sb->s_fsver = RKFS_VER2;
+	sb->s_state = RKFS_VALID_FS;
+	sb->s_group = group;
+	sb->s_total_blocks = total_blocks;
+	sb->s_blocks_per_group = blocks_per_group;
+	sb->s_inodes_per_group = inodes_per_group;
+	sb->s_inode_size = inode_size;
+	sb->s_log_groups_per_flex = log_groups_per_flex;
+	sb->s_block_map = blkno + RKFS_V2_BLOCK_MAP_OFFSET;
+	sb->s_inode_map = blkno + RKFS_V2_INODE_MAP_OFFSET;
+	sb->s_itable_map = blkno + RKFS_V2_ITABLE_MAP_OFFSET;
+	sb->s_first_block = first_block;
+	sb->s_free_blocks = count_zero_bits(block_map, nbits);
+	sb->s_free_inodes = count_zero_bits(inode_map, inodes_per_group);
+	sb->s_features = blocks_32bit ? RKFS_FEATURE_32BIT : 0;
+	if (inline_data)
+		sb->s_features |= RKFS_FEATURE_INLINE_DATA;
+	if (extents)
+		sb->s_features |= RKFS_FEATURE_EXTENTS;
+	while ((RKFS_BLOCK_SIZE << sb->s_log_block_size) < block_size)
+		sb->s_log_block_size++;
+
+	if (write_block(fd, blkno, blk_buf) != 0 ||
+	    write_block(fd, sb->s_block_map, block_map) != 0 ||
+	    write_block(fd, sb->s_inode_map, inode_map) != 0 ||
+	    write_block(fd, sb->s_itable_map, itable_map) != 0) {
+		print_emsg("\nError while writing the superblock.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+* With blocks bigger than 1 KB the superblock moves out of the 1 KB
+* block at RKFS_SUPER_BLOCK. Wipe what used to be there (everything in
+* block 0 past the boot sector) so the kernel, which probes the small
+* sizes first, can't pick up a stale superblock from an older mkrkfs.
+*/
+int clear_boot_block_tail(register int fd)
+{
+	char blk_buf[RKFS_MAX_BLOCK_SIZE];
+
+	if (block_size == RKFS_BLOCK_SIZE)
+		return 0;
+
+	if (read_block(fd, 0, blk_buf) != 0) {
+		print_emsg("\nError while reading the boot block.");
+		return -1;
+	}
+
+	memset(blk_buf + RKFS_BLOCK_SIZE, 0, block_size - RKFS_BLOCK_SIZE);
+	if (write_block(fd, 0, blk_buf) != 0) {
+		print_emsg("\nError while writing the boot block.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+* Pick the v2 group geometry for a device of 'total_blocks' blocks.
+* Small devices keep RKFS_MIN_BLOCKS long groups with an inode per
+* block, like v1; bigger ones get groups as long as a block bitmap block
+* allows, with an inode per DEFAULT_BYTES_PER_INODE. -i overrides the
+* inode density. Inodes per group are rounded to whole inode table
+* blocks and capped by the inode bitmap, the inode table map block and,
+* without -L, 16-bit inode numbers. The packed metadata of a -G flex
+* group must fit in its first group.
+*/
+int choose_geometry(ulong total_blocks)
+{
+	ulong max_bits = 0, ipb = 0, ipg = 0, min_ipg = 0, groups = 0;
+
+	max_bits = block_size * 8;
+	ipb = block_size / inode_size;
+	if (ipb < RKFS_FIRST_INODE) {
+		print_emsg("\nInode size %u is too big for %u byte blocks.",
+			   inode_size, block_size);
+		return -1;
+	}
+
+	blocks_per_group = RKFS_MIN_BLOCKS;
+	if (total_blocks >= (8 * max_bits) ||
+	    (total_blocks + RKFS_MIN_BLOCKS - 1) / RKFS_MIN_BLOCKS >
+	    RKFS_MAX_GROUPS)
+		blocks_per_group = max_bits;
+
+	groups = (total_blocks + blocks_per_group - 1) / blocks_per_group;
+	if (groups > RKFS_MAX_GROUPS) {
+		print_emsg("\nToo many groups (%lu).", groups);
+		return -1;
+	}
+
+	if (RKFS_V2_FLEX_SHIFT(1 << log_groups_per_flex) +
+	    RKFS_V2_FIRST_BLOCK >= blocks_per_group) {
+		print_emsg("\nFlex groups of %u groups don't fit in groups "
+			   "of %u blocks.", 1 << log_groups_per_flex,
+			   blocks_per_group);
+		return -1;
+	}
+
+	if (!bytes_per_inode)
+		bytes_per_inode = (blocks_per_group == RKFS_MIN_BLOCKS) ?
+		    block_size : DEFAULT_BYTES_PER_INODE;
+
+	ipg = ((ulong) blocks_per_group * block_size) / bytes_per_inode;
+	ipg = ((ipg + ipb - 1) / ipb) * ipb;
+
+	if (ipg > max_bits)
+		ipg = (max_bits / ipb) * ipb;
+	if (ipg > (block_size / RKFS_ITABLE_ENTRY_SIZE(blocks_32bit)) * ipb)
+		ipg = (block_size / RKFS_ITABLE_ENTRY_SIZE(blocks_32bit)) * ipb;
+	if (!blocks_32bit && groups * ipg > RKFS_MAX_INODES)
+		ipg = ((RKFS_MAX_INODES / groups) / ipb) * ipb;
+
+	min_ipg = ((RKFS_FIRST_INODE + ipb) / ipb) * ipb;
+	if (ipg < min_ipg)
+		ipg = min_ipg;
+	if (!blocks_32bit && groups * ipg > RKFS_MAX_INODES) {
+		print_emsg("\nToo many inodes for 16-bit inode numbers.");
+		return -1;
+	}
+
+	inodes_per_group = ipg;
+	itable_entries = ipg / ipb;
+
+	print_msg("\n%u blocks and %u inodes per group, %u byte inodes.",
+		  blocks_per_group, inodes_per_group, inode_size);
+	if (log_groups_per_flex)
+		print_msg("\n%u groups per flex group.",
+			  1 << log_groups_per_flex);
+	return 0;
+}
+
 /*
 * Core function that actually creates the filesystem.
 */
-int create_rkfs(const char *device, ushort total_blocks)
+int create_rkfs(const char *device, uint total_blocks)
 {
 	struct rkfs_super_block sb;
+	__u16 block_map[RKFS_MAX_BLOCK_SIZE / sizeof(__u16)];
+	__u16 inode_map[RKFS_MAX_BLOCK_SIZE / sizeof(__u16)];
+	__u32 itable_map[RKFS_MAX_BLOCK_SIZE / sizeof(__u32)];
 	register int rc = 0, fd = 0;
-	ushort blkno = 0, j = 0, offset = 0, total_bad_blocks = 0;
-	char blk_buf[RKFS_BLOCK_SIZE];
+	uint blkno = 0, offset = 0, total_bad_blocks = 0;
+	uint group = 0, groups = 0, flex_groups = 0, itable_block = 0;
+	ushort j = 0, meta_blocks = 0, root_dir_block = 0, tail = 0;
+	char blk_buf[RKFS_MAX_BLOCK_SIZE];
 
 	print_msg("Creating %s filesystem on the device %s", RKFS_NAME, device);
 	if (skip_badblocks)
 		print_msg("\nThis may take few minutes, please wait...");
-	print_msg("\nDevice %s has %d blocks.", device, total_blocks);
+	print_msg("\nDevice %s has %u blocks of %u bytes.", device,
+		  total_blocks, block_size);
+
+	/*
+	 * A v2 group needs room for its superblock and maps; a trailing
+	 * group too small for that is left out of the filesystem.
+	 */
+	tail = total_blocks % blocks_per_group;
+	if (layout_v2 && tail && tail <= RKFS_V2_GROUP_META_BLOCKS) {
+		total_blocks -= tail;
+		print_msg("\nLast %d blocks are not used.", tail);
+	}
+
+	/*
+	 * Group 0's first inode table and root directory follow the
+	 * packed metadata of its whole flex group.
+	 */
+	groups = (total_blocks + blocks_per_group - 1) / blocks_per_group;
+	flex_groups = 1 << log_groups_per_flex;
+	if (layout_v2) {
+		j = RKFS_V2_FLEX_SHIFT(groups < flex_groups ? groups :
+				       flex_groups);
+		itable_block = RKFS_V2_FIRST_INODE_TABLE_BLOCK + j;
+		root_dir_block = RKFS_V2_ROOT_DIR_BLOCK + j;
+	} else {
+		itable_block = RKFS_FIRST_INODE_TABLE_BLOCK;
+		root_dir_block = RKFS_ROOT_DIR_BLOCK;
+	}
 
 	if ((fd = open_device(device, O_RDWR)) < 0) {
 		print_emsg("\nError while opening the device %s.", device);
 		return -1;
 	}
 
+	if (clear_boot_block_tail(fd) != 0) {
+		rc = -1;
+		goto error_exit;
+	}
+
 	offset = 0;
 	do {
-		memset(&sb, 0, sizeof(struct rkfs_super_block));
-		sb.s_fsid = RKFS_ID;
-		sb.s_fsver = RKFS_VER;
-		sb.s_state = RKFS_VALID_FS;
-		sb.s_total_blocks = total_blocks;
-		if (!offset) {
-			sb.s_itable_map[0][0] = RKFS_FIRST_INODE_TABLE_BLOCK;
-			sb.s_itable_map[0][1] = 4;
-		} else
-			sb.s_itable_map[0][1] = 0;
+		group = offset / blocks_per_group;
+		memset(block_map, 0, sizeof(block_map));
+		memset(inode_map, 0, sizeof(inode_map));
+		memset(itable_map, 0, sizeof(itable_map));
+		if (!offset)
+			set_itable_entry(itable_map, 0, itable_block, 4);
 
 		if (mark_badblocks
-		    (fd, &sb, total_blocks, offset, &total_bad_blocks) < 0) {
+		    (fd, block_map, total_blocks, offset,
+		     &total_bad_blocks) < 0) {
 			rc = -1;
 			goto error_exit;
 		}
 
-		if (total_bad_blocks > ((total_blocks * 75) / 100)) {
-			print_emsg("\nDevice %s has too many bad blocks (%d).",
+		if (total_bad_blocks > (total_blocks - (total_blocks / 4))) {
+			print_emsg("\nDevice %s has too many bad blocks (%u).",
 				   device, total_bad_blocks);
 			rc = -1;
 			goto error_exit;
 		}
 
-		if (!offset) {
-			for (j = 0; j < RKFS_ROOT_DIR_BLOCK; j++) {
-				if (test_bit(j, &sb.s_block_map)) {
-					print_emsg
-					    ("\nBlock %d is marked as bad.", j);
-					rc = -1;
-					goto error_exit;
-				}
-				set_bit(j, &sb.s_block_map);
+		/*
+		 * Metadata blocks in front of the group; in group 0 they
+		 * run up to the root directory block. On v2 the first
+		 * group of a flex group holds the metadata of all of its
+		 * groups and the others none.
+		 */
+		if (!offset)
+			meta_blocks = root_dir_block;
+		else if (!layout_v2)
+			meta_blocks = 1;
+		else if (group % flex_groups)
+			meta_blocks = 0;
+		else
+			meta_blocks = RKFS_V2_GROUP_META_BLOCKS *
+			    (groups - group < flex_groups ? groups - group :
+			     flex_groups);
+
+		for (j = 0; j < meta_blocks; j++) {
+			if (test_bit(j, block_map)) {
+				print_emsg("\nBlock %u is marked as bad.",
+					   (offset + j));
+				rc = -1;
+				goto error_exit;
 			}
+			set_bit(j, block_map);
+		}
 
+		if (!offset) {
 			for (j = 0; j < RKFS_FIRST_INODE; j++)
-				set_bit(j, &sb.s_inode_map);
+				set_bit(j, inode_map);
 		} else {
-			for (j = 0; j < 1; j++) {
-				if (test_bit(j, sb.s_block_map)) {
-					print_emsg
-					    ("\nBlock %d is marked as bad.",
-					     (offset + j));
-					rc = -1;
-					goto error_exit;
-				}
-				set_bit(j, sb.s_block_map);
-			}
-
 			for (j = 0; j < 1; j++)
-				set_bit(j, &sb.s_inode_map);
+				set_bit(j, inode_map);
 		}
 
 		if (!offset) {
-			if (create_root_directory(fd, &sb) < 0) {
+			if (create_root_directory(fd, itable_map, block_map,
+						  root_dir_block) < 0) {
 				print_emsg
 				    ("\nError while creating the root directory.");
 				rc = -1;
@@ -325,20 +652,43 @@ int create_rkfs(const char *device, ushort total_blocks)
 			}
 		}
 
-		if (!offset)
-			blkno = RKFS_SUPER_BLOCK;
-		else
-			blkno = offset;
-
-		memset(blk_buf, 0, RKFS_BLOCK_SIZE);
-		memcpy(blk_buf, &sb, sizeof(struct rkfs_super_block));
-		if (write_block(fd, blkno, blk_buf) != 0) {
-			print_emsg("\nError while writing the superblock.");
-			rc = -1;
-			goto error_exit;
+		if (layout_v2) {
+			if (write_group_v2(fd, total_blocks, group,
+					   offset ? meta_blocks :
+					   root_dir_block + 1, block_map,
+					   inode_map, itable_map) != 0) {
+				rc = -1;
+				goto error_exit;
+			}
+		} else {
+			memset(&sb, 0, sizeof(struct rkfs_super_block));
+			sb.s_fsid = RKFS_ID;
+			sb.s_fsver = RKFS_VER;
+			sb.s_state = RKFS_VALID_FS;
+			sb.s_total_blocks = total_blocks;
+			memcpy(sb.s_block_map, block_map,
+			       sizeof(sb.s_block_map));
+			memcpy(sb.s_inode_map, inode_map,
+			       sizeof(sb.s_inode_map));
+			memcpy(sb.s_itable_map, itable_map,
+			       sizeof(sb.s_itable_map));
+
+			if (!offset)
+				blkno = RKFS_SUPER_BLOCK;
+			else
+				blkno = offset;
+
+			memset(blk_buf, 0, sizeof(blk_buf));
+			memcpy(blk_buf, &sb, sizeof(struct rkfs_super_block));
+			if (write_block(fd, blkno, blk_buf) != 0) {
+				print_emsg
+				    ("\nError while writing the superblock.");
+				rc = -1;
+				goto error_exit;
+			}
 		}
 
-		offset += RKFS_MIN_BLOCKS;
+		offset += blocks_per_group;
 
 		if (offset > (total_blocks - 1))
 			break;
@@ -390,18 +740,26 @@ int main(int argc, char *argv[])
 		     device);
 		goto error_exit;
 	}
+	tb /= block_size / RKFS_BLOCK_SIZE;
 
 	if (tb < RKFS_MIN_BLOCKS) {
-		print_emsg("\nDevice %s has too few blocks (%u).", device, tb);
+		print_emsg("\nDevice %s has too few blocks (%lu).", device, tb);
 		goto error_exit;
 	}
 
-	if (tb > RKFS_MAX_BLOCKS) {
-		print_emsg("\nDevice %s has too many blocks (%u).", device, tb);
+	/*
+	* Only 32-bit block numbers reach past RKFS_MAX_BLOCKS.
+	*/
+	if (!blocks_32bit && tb > RKFS_MAX_BLOCKS) {
+		print_emsg("\nDevice %s has too many blocks (%lu). Try -L.",
+			   device, tb);
 		goto error_exit;
 	}
 
-	if (create_rkfs(device, (ushort) tb) != 0)
+	if (layout_v2 && choose_geometry(tb) != 0)
+		goto error_exit;
+
+	if (create_rkfs(device, (uint) tb) != 0)
 		goto error_exit;
 
 	exit(0);
@@ -17,16 +17,42 @@ boolean verbose = FALSE;
 boolean quiet = FALSE;
 boolean skip_badblocks = FALSE;
 boolean version = FALSE;
+boolean layout_v2 = FALSE;
+boolean blocks_32bit = FALSE;
+boolean inline_data = FALSE;
+boolean extents = FALSE;
+uint block_size = RKFS_BLOCK_SIZE;
+
+/*
+* Group geometry. v1 always has the defaults; for v2 choose_geometry()
+* picks it from the device size, -i and -I.
+*/
+#define DEFAULT_BYTES_PER_INODE 8192	//Big groups, without -i
+
+uint blocks_per_group = RKFS_MIN_BLOCKS;
+uint inodes_per_group = RKFS_MIN_BLOCKS;
+uint inode_size = RKFS_INODE_SIZE;
+uint bytes_per_inode = 0;	//-i, 0 for the default
+uint itable_entries = RKFS_INODE_TABLES_MAP_SIZE;
+uint log_groups_per_flex = 0;	//-G, groups per flex group is 1 << this
 
 void print_version();
 void print_usage(const char *prg_name);
 char *parse_args(int argc, char *argv[]);
-char *create_new_dir_block_template(ushort pinode, ushort cinode);
-int write_inode(register int fd, struct rkfs_super_block *sb,
-		ushort ino, struct rkfs_inode *inode);
-int create_root_directory(register int fd, struct rkfs_super_block *sb);
-int mark_badblocks(register int fd, struct rkfs_super_block *sb,
-		   ushort total_blocks, uint offset, ushort * total_bad_blocks);
-int create_rkfs(const char *device, ushort total_blocks);
+char *create_new_dir_block_template(uint pinode, uint cinode);
+uint get_itable_block(void *itable_map, ushort index);
+void set_itable_entry(void *itable_map, ushort index, uint blkno,
+		      ushort count);
+int write_inode(register int fd, void *itable_map, ushort ino,
+		const void *inode);
+int create_root_directory(register int fd, void *itable_map,
+			  void *block_map, ushort dir_blkno);
+int mark_badblocks(register int fd, void *block_map,
+		   uint total_blocks, uint offset, uint * total_bad_blocks);
+int write_group_v2(register int fd, uint total_blocks, uint group,
+		   uint first_block, void *block_map, void *inode_map, void *itable_map);
+int clear_boot_block_tail(register int fd);
+int choose_geometry(ulong total_blocks);
+int create_rkfs(const char *device, uint total_blocks);
 
 #endif
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# readbench.sh
+#
+# Parallel read throughput of rkfs on a loop-mounted image: 1, 2, 4 ...
+# readers, each on its own file and then all on the same file, with the
+# page cache dropped before every run. Needs root, the rkfs module
+# loaded and mkrkfs built in this directory.
+#
+# Usage: readbench.sh [image size MB] [file size MB] [max readers]
+#
+
+size_mb=${1:-512}
+file_mb=${2:-32}
+max=${3:-$(getconf _NPROCESSORS_ONLN)}
+
+dir=$(cd "$(dirname "$0")" && pwd)
+img=$(mktemp /tmp/rkfs-bench.XXXXXX)
+mnt=$(mktemp -d /tmp/rkfs-mnt.XXXXXX)
+loop=
+
+cleanup() {
+	umount "$mnt" 2>/dev/null
+	[ -n "$loop" ] && losetup -d "$loop"
+	rm -f "$img"
+	rmdir "$mnt"
+}
+trap cleanup EXIT INT TERM
+
+dd if=/dev/zero of="$img" bs=1M count="$size_mb" 2>/dev/null || exit 1
+loop=$(losetup -f --show "$img") || exit 1
+"$dir/mkrkfs" -q -s -2 "$loop" || exit 1
+mount -t rkfs "$loop" "$mnt" || exit 1
+
+i=1
+while [ $i -le "$max" ]; do
+	dd if=/dev/urandom of="$mnt/f$i" bs=1M count="$file_mb" \
+	    2>/dev/null || exit 1
+	i=$((i + 1))
+done
+sync
+
+# run <readers> <same>: prints MB/s for <readers> concurrent dd readers
+run() {
+	sync
+	echo 3 >/proc/sys/vm/drop_caches
+	start=$(date +%s.%N)
+	i=1
+	while [ $i -le "$1" ]; do
+		if [ "$2" = 1 ]; then f=f1; else f=f$i; fi
+		dd if="$mnt/$f" of=/dev/null bs=64k 2>/dev/null &
+		i=$((i + 1))
+	done
+	wait
+	end=$(date +%s.%N)
+	echo "$1 $file_mb $start $end" |
+	    awk '{ printf "%8.1f", $1 * $2 / ($4 - $3) }'
+}
+
+printf "%8s %12s %12s\n" readers "own (MB/s)" "same (MB/s)"
+n=1
+while [ $n -le "$max" ]; do
+	printf "%8d %12s %12s\n" $n "$(run $n 0)" "$(run $n 1)"
+	n=$((n * 2))
+done
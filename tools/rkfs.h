@@ -42,6 +42,63 @@ struct rkfs_inode {
 	__u16 i_block[RKFS_N_BLOCKS];	//Data blocks
 };
 
+/*
+* Inode of a filesystem with 32-bit block numbers (RKFS_FEATURE_32BIT).
+* Same size as the 16-bit one: 17 direct blocks, then single, double
+* and triple indirect.
+*/
+#define RKFS_N_BLOCKS32      20
+
+struct rkfs_inode32 {
+	__u16 i_uid;		//User id
+	__u16 i_gid;		//Group id
+	__u16 i_mode;		//Type/access rights
+	__u16 i_links_count;	//Number of childs
+	__u32 i_time;		//Create/access/modification/del time
+	__u32 i_size;		//Size in bytes
+	__u32 i_blocks;		//Number of blocks
+	__u32 i_block[RKFS_N_BLOCKS32];	//Data blocks
+};
+
+/*
+* Inline data (RKFS_FEATURE_INLINE_DATA): a regular file or symlink of
+* no more than RKFS_INLINE_SIZE (RKFS_INLINE_SIZE32) bytes keeps them in
+* i_block instead of a data block. Such an inode has no blocks and
+* RKFS_INLINE_MAGIC in the last i_block slot, which the data never
+* reaches; an inode without blocks otherwise has all its slots zero.
+*/
+#define RKFS_INLINE_MAGIC    0x4c49
+#define RKFS_INLINE_SIZE     ((RKFS_N_BLOCKS - 1) * sizeof(__u16))
+#define RKFS_INLINE_SIZE32   ((RKFS_N_BLOCKS32 - 1) * sizeof(__u32))
+
+/*
+* Extent-mapped inode (RKFS_FEATURE_EXTENTS): i_block holds a header and
+* up to RKFS_EXT_ROOT_MAX extents sorted by ee_block. Once they don't
+* fit, eh_depth is 1 and they move to one overflow block, headed the
+* same way, whose number is the ee_start of the only entry in i_block.
+* The magic can't be a block pointer: in a 16-bit first slot it reads
+* as RKFS_SUPER_BLOCK, in a 32-bit one it is past any block.
+*/
+struct rkfs_extent_header {
+	__u32 eh_magic;		//RKFS_EXT_MAGIC
+	__u16 eh_entries;	//Extents in use
+	__u16 eh_depth;		//0 or 1 (overflow block)
+};
+
+struct rkfs_extent {
+	__u32 ee_block;		//First logical block
+	__u32 ee_start;		//First physical block
+	__u16 ee_len;		//Blocks
+	__u16 ee_unused;
+};
+
+#define RKFS_EXT_MAGIC       0xe7e00001
+#define RKFS_EXT_ROOT_MAX    6	//Extents in i_block
+#define RKFS_EXT_MAX_LEN     0xffff
+#define RKFS_EXT_BLOCK_MAX(bsize) \
+        (((bsize) - sizeof(struct rkfs_extent_header)) / \
+         sizeof(struct rkfs_extent))
+
 /*
 * Super Block / Inode related constants
 */
@@ -55,7 +112,9 @@ struct rkfs_inode {
 #define RKFS_MIN_BLOCKS 1440	//1.4MB
 #define RKFS_MAX_BLOCKS 65535	//64MB
 
-#define RKFS_BLOCK_SIZE 1024
+#define RKFS_BLOCK_SIZE 1024	//v1, and the smallest v2 block size
+#define RKFS_MAX_BLOCK_SIZE 4096
+#define RKFS_MAX_LOG_BLOCK_SIZE 2	//log2(RKFS_MAX_BLOCK_SIZE/RKFS_BLOCK_SIZE)
 
 #define RKFS_BLOCK_MAP_SIZE ((RKFS_MIN_BLOCKS/8)/2)
 #define RKFS_INODE_MAP_SIZE RKFS_BLOCK_MAP_SIZE
@@ -92,6 +151,100 @@ struct rkfs_super_block {
 	__u16 s_total_blocks;	//Total blocks
 };
 
+/*
+* Version 2 layout. The group superblock only describes the group; its
+* block bitmap, inode bitmap and inode table map (same format as the v1
+* s_itable_map) sit in blocks of their own, so allocations never dirty
+* the superblock. mkrkfs puts them right after the group superblock:
+* group 0 is boot block, superblock, maps, first inode table and root
+* dir block; every other group is superblock and maps.
+*
+* The block size may be 1, 2 or 4 KB (s_log_block_size). Everything is
+* counted in blocks of that size; the superblock is still block
+* RKFS_SUPER_BLOCK.
+*
+* The geometry is chosen by mkrkfs and recorded in every group
+* superblock: s_blocks_per_group and s_inodes_per_group (each at most
+* 8 * block size, the bits of one map block) and s_inode_size (at least
+* RKFS_INODE_SIZE, 0 means RKFS_INODE_SIZE, and small enough for the
+* reserved inodes and the root to share the first inode table block).
+* Inode numbers are group * s_inodes_per_group + bit. An inode table
+* block holds block size / s_inode_size inodes, and the inode table map
+* has one entry per inode table block of the group; it must fit in its
+* block.
+*/
+#define RKFS_VER2      200	//Version 2 layout
+
+#define RKFS_V2_BLOCK_MAP_OFFSET     1	//From the group superblock
+#define RKFS_V2_INODE_MAP_OFFSET     2
+#define RKFS_V2_ITABLE_MAP_OFFSET    3
+#define RKFS_V2_GROUP_META_BLOCKS    4	//Superblock + maps
+#define RKFS_V2_FIRST_INODE_TABLE_BLOCK 5
+#define RKFS_V2_ROOT_DIR_BLOCK       6
+#define RKFS_V2_FIRST_BLOCK          7
+
+/*
+* Flex groups (s_log_groups_per_flex = n > 0): the superblocks and maps
+* of 2^n consecutive groups are packed at the start of the first one,
+* a RKFS_V2_GROUP_META_BLOCKS slot per group in group order, and the
+* other groups of the flex group hold data only (s_first_block 0). In
+* group 0 the packed area starts at RKFS_SUPER_BLOCK, and the first
+* inode table and root dir block follow it: the RKFS_V2_*_BLOCK numbers
+* above move up by RKFS_V2_FLEX_SHIFT(groups in the first flex group).
+*/
+#define RKFS_MAX_LOG_GROUPS_PER_FLEX 10
+#define RKFS_V2_FLEX_SHIFT(groups) (((groups) - 1) * RKFS_V2_GROUP_META_BLOCKS)
+
+struct rkfs_super_block2 {
+	__u16 s_fsid;		//Filesystem ID
+	__u16 s_fsver;		//Filesystem version (RKFS_VER2)
+	__u16 s_state;		//Filesystem state
+	__u16 s_group;		//Group this superblock describes
+	__u32 s_total_blocks;	//Total blocks
+	__u32 s_blocks_per_group;	//Blocks per group
+	__u32 s_inodes_per_group;	//Inodes per group
+	__u32 s_block_map;	//Block bitmap block of the group
+	__u32 s_inode_map;	//Inode bitmap block of the group
+	__u32 s_itable_map;	//Inode table map block of the group
+	__u32 s_first_block;	//First allocatable bit of the group
+	__u32 s_free_blocks;	//Free blocks in the group (as of umount)
+	__u32 s_free_inodes;	//Free inodes in the group (as of umount)
+	__u32 s_features;	//RKFS_FEATURE_*
+	__u32 s_log_block_size;	//Block size is RKFS_BLOCK_SIZE << this
+	__u32 s_inode_size;	//Bytes per on-disk inode
+	__u32 s_log_groups_per_flex;	//Groups per flex group is 1 << this
+};
+
+#define RKFS_MAX_GROUP_BITS(bsize) ((bsize) * 8)	//Per group, either map
+
+/*
+* v2 features (s_features). RKFS_FEATURE_32BIT widens block numbers,
+* in inodes and indirect blocks, and inode numbers, in directory
+* entries, to 32 bits. Such a filesystem is limited by the number of
+* groups instead. RKFS_FEATURE_INLINE_DATA allows inline data (see
+* RKFS_INLINE_MAGIC), RKFS_FEATURE_EXTENTS extent-mapped regular files
+* (see rkfs_extent_header).
+*/
+#define RKFS_FEATURE_32BIT   0x0001
+#define RKFS_FEATURE_INLINE_DATA 0x0002
+#define RKFS_FEATURE_EXTENTS 0x0004
+#define RKFS_FEATURES \
+        (RKFS_FEATURE_32BIT | RKFS_FEATURE_INLINE_DATA | \
+         RKFS_FEATURE_EXTENTS)	//Known to this version
+
+#define RKFS_MAX_GROUPS      65535
+#define RKFS_MAX_INODES      65536	//Without RKFS_FEATURE_32BIT
+
+/*
+* Inode table map block of a RKFS_FEATURE_32BIT filesystem, with 'n'
+* entries (inode table blocks per group): __u32 it_block[n], the inode
+* table blocks, which may lie in any group, then __u16 it_count[n], the
+* inodes in use in each. Without the feature the map is __u16 [n][2],
+* block and count, like the v1 s_itable_map.
+*/
+#define RKFS_ITABLE_ENTRY_SIZE(is32) ((is32) ? 6 : 4)
+#define rkfs_itable_map32_count(map,n) ((__u16 *)((__u32 *)(map) + (n)))
+
 /*
 * Directory entry related constants
 */
@@ -120,6 +273,18 @@ struct rkfs_dir_entry {
 
 #define RKFS_DIR_ENTRY_PER_BLOCK (RKFS_BLOCK_SIZE/RKFS_DIR_ENTRY_SIZE)
 
+/*
+* Directory entry with a 32-bit inode number (RKFS_FEATURE_32BIT).
+*/
+#define RKFS_MAX_FILENAME_LEN32 250
+#define RKFS_DIR_ENTRY32_LEN(nlen) (nlen + 6)
+
+struct rkfs_dir_entry32 {
+	__u32 de_inode;		//File inode number
+	__u16 de_name_len;	//File name len
+	char de_name[RKFS_MAX_FILENAME_LEN32];	//File name
+};
+
 #ifdef __KERNEL__
 /*
 * Following are required for rkfs in linux kernel.
@@ -111,7 +111,7 @@ ulong get_total_device_blocks(const char *device)
 	}
 
 	close(fd);
-	res = (ushort) (size / (1024 / 512));
+	res = size / (1024 / 512);
 
 	return res;
 }
@@ -178,7 +178,241 @@ int test_bit(ushort bit_nr, void *addr)
 	return ((mask & *ADDR) != 0);
 }
 
-int write_block(register int fd, ushort blkno, const void *blk_buf)
+/*
+* Whole-map bit counting and searching. The maps are little endian
+* bitmaps like the ones set_bit() works on; a plain version does eight
+* bytes at a time, and on x86 an SSE2 or AVX2 version (picked at run
+* time) does 16 or 32. Bits from 'nbits' on are ignored.
+*/
+static uint count_bits_tail(const unsigned char *p, uint nbytes, uint nbits)
+{
+	unsigned long long w = 0;
+	uint sum = 0, i = 0;
+
+	for (i = 0; i + 8 <= nbytes; i += 8) {
+		memcpy(&w, p + i, 8);
+		sum += __builtin_popcountll(w);
+	}
+
+	for (; i < nbytes; i++)
+		sum += __builtin_popcount(p[i]);
+
+	if (nbits & 0x07)
+		sum += __builtin_popcount(p[nbytes] &
+					  ((1 << (nbits & 0x07)) - 1));
+
+	return sum;
+}
+
+static uint zero_bit_tail(const unsigned char *p, uint from, uint nbits)
+{
+	uint i = 0;
+
+	for (i = from; i < nbits; i++)
+		if (!(p[i >> 3] & (1 << (i & 0x07))))
+			return i;
+
+	return nbits;
+}
+
+static uint count_bits_plain(const unsigned char *p, uint nbits)
+{
+	return count_bits_tail(p, nbits >> 3, nbits);
+}
+
+/*
+* First zero bit from bit 'i' (a multiple of 8) on, 64 bits at a time;
+* the vector versions finish their tails here too.
+*/
+static uint first_zero_from(const unsigned char *p, uint i, uint nbits)
+{
+	unsigned long long w = 0;
+
+	for (; i + 64 <= nbits; i += 64) {
+		memcpy(&w, p + (i >> 3), 8);
+		if (~w)
+			return i + __builtin_ctzll(~w);
+	}
+
+	return zero_bit_tail(p, i, nbits);
+}
+
+static uint first_zero_plain(const unsigned char *p, uint nbits)
+{
+	return first_zero_from(p, 0, nbits);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__ ((target("sse2")))
+static uint count_bits_sse2(const unsigned char *p, uint nbits)
+{
+	const __m128i m1 = _mm_set1_epi8(0x55);
+	const __m128i m2 = _mm_set1_epi8(0x33);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+	__m128i v, acc = _mm_setzero_si128();
+	uint nbytes = nbits >> 3, i = 0;
+
+	for (i = 0; i + 16 <= nbytes; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+		v = _mm_add_epi8(_mm_and_si128(v, m2),
+				 _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+		v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+	}
+
+	return _mm_cvtsi128_si32(acc) +
+	    _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)) +
+	    count_bits_tail(p + i, nbytes - i, nbits);
+}
+
+__attribute__ ((target("sse2")))
+static uint first_zero_sse2(const unsigned char *p, uint nbits)
+{
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	uint nbytes = nbits >> 3, i = 0, mask = 0;
+
+	for (i = 0; i + 16 <= nbytes; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(ones,
+				_mm_loadu_si128((const __m128i *)(p + i))));
+		if (mask != 0xffff) {
+			i += __builtin_ctz(~mask);
+			return (i << 3) + __builtin_ctz(~p[i]);
+		}
+	}
+
+	return first_zero_from(p, i << 3, nbits);
+}
+
+__attribute__ ((target("avx2")))
+static uint count_bits_avx2(const unsigned char *p, uint nbits)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4,
+					     0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m4 = _mm256_set1_epi8(0x0f);
+	__m256i v, hi, cnt, acc = _mm256_setzero_si256();
+	__m128i sum;
+	uint nbytes = nbits >> 3, i = 0;
+
+	for (i = 0; i + 32 <= nbytes; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), m4);
+		cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut,
+					_mm256_and_si256(v, m4)),
+				      _mm256_shuffle_epi8(lut, hi));
+		acc = _mm256_add_epi64(acc,
+				       _mm256_sad_epu8(cnt,
+						       _mm256_setzero_si256()));
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			    _mm256_extracti128_si256(acc, 1));
+	return _mm_cvtsi128_si32(sum) +
+	    _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)) +
+	    count_bits_tail(p + i, nbytes - i, nbits);
+}
+
+__attribute__ ((target("avx2")))
+static uint first_zero_avx2(const unsigned char *p, uint nbits)
+{
+	const __m256i ones = _mm256_set1_epi8((char)0xff);
+	uint nbytes = nbits >> 3, i = 0, mask = 0;
+
+	for (i = 0; i + 32 <= nbytes; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(ones,
+				_mm256_loadu_si256((const __m256i *)(p + i))));
+		if (mask != 0xffffffff) {
+			i += __builtin_ctz(~mask);
+			return (i << 3) + __builtin_ctz(~p[i]);
+		}
+	}
+
+	return first_zero_from(p, i << 3, nbits);
+}
+#endif
+
+static uint (*count_bits_fn) (const unsigned char *, uint);
+static uint (*first_zero_fn) (const unsigned char *, uint);
+
+static void pick_bitmap_ops(void)
+{
+	count_bits_fn = count_bits_plain;
+	first_zero_fn = first_zero_plain;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		count_bits_fn = count_bits_avx2;
+		first_zero_fn = first_zero_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		count_bits_fn = count_bits_sse2;
+		first_zero_fn = first_zero_sse2;
+	}
+#endif
+}
+
+/*
+* Force the "plain", "sse2" or "avx2" bitmap ops instead of the ones
+* picked for this CPU (bitbench uses it to time each). Returns -1 if
+* the name is unknown or the CPU lacks it.
+*/
+int set_bitmap_ops(const char *name)
+{
+	if (!strcmp(name, "plain")) {
+		count_bits_fn = count_bits_plain;
+		first_zero_fn = first_zero_plain;
+		return 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		count_bits_fn = count_bits_sse2;
+		first_zero_fn = first_zero_sse2;
+		return 0;
+	}
+	if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		count_bits_fn = count_bits_avx2;
+		first_zero_fn = first_zero_avx2;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+uint count_zero_bits(const void *addr, uint nbits)
+{
+	if (!count_bits_fn)
+		pick_bitmap_ops();
+
+	return nbits - count_bits_fn((const unsigned char *)addr, nbits);
+}
+
+uint find_first_zero_bit(const void *addr, uint nbits)
+{
+	if (!first_zero_fn)
+		pick_bitmap_ops();
+
+	return first_zero_fn((const unsigned char *)addr, nbits);
+}
+
+/*
+* Block of the v2 superblock of 'group': the superblocks and maps of a
+* flex group are packed at the start of its first group, group 0's
+* right after the boot block.
+*/
+uint group_sb_block(uint group, uint blocks_per_group, uint log_flex)
+{
+	uint first = (group >> log_flex) << log_flex;
+
+	return (first ? first * blocks_per_group : RKFS_SUPER_BLOCK) +
+	    (group - first) * RKFS_V2_GROUP_META_BLOCKS;
+}
+
+int write_block(register int fd, uint blkno, const void *blk_buf)
 {
 	const char *this = "write_block:";
 	off_t noffset = 0;
@@ -189,14 +423,14 @@ int write_block(register int fd, ushort blkno, const void *blk_buf)
 		return -1;
 	}
 
-	noffset = blkno * RKFS_BLOCK_SIZE;
+	noffset = (off_t) blkno * block_size;
 	if (lseek(fd, noffset, SEEK_SET) != noffset) {
 		print_emsg("\n%s 'lseek' error: %s.", this, strerror(errno));
 		return -1;
 	}
 
-	wrote = write(fd, blk_buf, RKFS_BLOCK_SIZE);
-	if (wrote != RKFS_BLOCK_SIZE) {
+	wrote = write(fd, blk_buf, block_size);
+	if (wrote != block_size) {
 		print_emsg("\n%s 'write' error: %s.", this, strerror(errno));
 		return -1;
 	}
@@ -204,7 +438,7 @@ int write_block(register int fd, ushort blkno, const void *blk_buf)
 	return 0;
 }
 
-int read_block(register int fd, ushort blkno, void *blk_buf)
+int read_block(register int fd, uint blkno, void *blk_buf)
 {
 	const char *this = "read_block:";
 	off_t noffset = 0;
@@ -215,14 +449,14 @@ int read_block(register int fd, ushort blkno, void *blk_buf)
 		return -1;
 	}
 
-	noffset = blkno * RKFS_BLOCK_SIZE;
+	noffset = (off_t) blkno * block_size;
 	if (lseek(fd, noffset, SEEK_SET) != noffset) {
 		print_emsg("\n%s 'lseek' error: %s.", this, strerror(errno));
 		return -1;
 	}
 
-	actual = read(fd, blk_buf, RKFS_BLOCK_SIZE);
-	if (actual != RKFS_BLOCK_SIZE) {
+	actual = read(fd, blk_buf, block_size);
+	if (actual != block_size) {
 		print_emsg("\n%s 'read' error: %s.", this, strerror(errno));
 		return -1;
 	}
@@ -15,6 +15,7 @@
 
 extern boolean quiet;
 extern boolean verbose;
+extern uint block_size;
 
 void print_msg(const char *frmt, ...);
 void print_emsg(const char *frmt, ...);
@@ -28,7 +29,11 @@ int close_device(register int fd);
 int set_bit(ushort bit_nr, void *addr);
 int clear_bit(ushort bit_nr, void *addr);
 int test_bit(ushort bit_nr, void *addr);
-int write_block(register int fd, ushort blkno, const void *blk_buf);
-int read_block(register int fd, ushort blkno, void *blk_buf);
+uint count_zero_bits(const void *addr, uint nbits);
+uint find_first_zero_bit(const void *addr, uint nbits);
+int set_bitmap_ops(const char *name);
+uint group_sb_block(uint group, uint blocks_per_group, uint log_flex);
+int write_block(register int fd, uint blkno, const void *blk_buf);
+int read_block(register int fd, uint blkno, void *blk_buf);
 
 #endif